@@ -47,6 +47,22 @@ double MAnalysis::dummy[10]{};
 int MAnalysis::dummyM[10]{};
 int* MAnalysis::maxZ2;
 size_t* MAnalysis::bufSize2;
+vector<double>* MAnalysis::peakScores;
+int* MAnalysis::peakZ;
+vector<double>* MAnalysis::closedScores;
+int* MAnalysis::closedZ;
+vector<unsigned int>* MAnalysis::preValid;
+vector<int>* MAnalysis::openScores;
+vector<int>* MAnalysis::openBest;
+mPruneCount* MAnalysis::pruneCount;
+vector<int>* MAnalysis::prefilterShared;
+mPrefilterCount* MAnalysis::prefilterCount;
+int MAnalysis::sampleStride=1;
+int MAnalysis::searchStage=0;
+vector<bool> MAnalysis::explained;
+bool MAnalysis::bCheckpoint=false;
+bool MAnalysis::bResume=false;
+time_t MAnalysis::checkpointTime;
 
 //bool MAnalysis::bEcho;
 //int MAnalysis::sCounter;
@@ -128,53 +144,83 @@ MAnalysis::~MAnalysis(){
 //  Public Functions
 //============================
 bool MAnalysis::doPeptideAnalysis(){
-  size_t i;
-  int iPercent;
-  int iTmp;
-  vector<mPeptide>* p;
-  vector<int> index;
-  vector<mPepMod> mods;
-
-  //mScoreCard sc;
 
-  ThreadPool<mAnalysisStruct*>* threadPool = new ThreadPool<mAnalysisStruct*>(analyzePeptideProc,params.threads,params.threads,1);
+  //A streamed database starts without peptides kept from earlier results
+  if(db->isStreamed()) db->rewindStream(false);
 
-  //Set progress meter
-  iPercent=0;
-  printf("%2d%%",iPercent);
-  fflush(stdout);
-
-  //Set which list of peptides to search (with and without internal lysine)
-  p=db->getPeptideList();
-
-  //Iterate the peptide for the first pass
-  for(i=0;i<p->size();i++){
-
-    threadPool->WaitForQueuedParams();
-
-    mAnalysisStruct* a = new mAnalysisStruct(&mutexKIonsManager,&p->at(i),(int)i);
-    threadPool->Launch(a);
+  //A resumed search already has the precursor tolerance and adduct masses of the passes below
+  bResume=params.resume;
+  if(bResume){
+    params.ppmPrecursor=spec->getCheckpoint().ppmPrecursor;
+    params.adducts=spec->getCheckpoint().adducts;
+  }
 
-    //Update progress meter
-    iTmp=(int)((double)i/p->size()*100);
-    if(iTmp>iPercent){
-      iPercent=iTmp;
-      printf("\b\b\b%2d%%",iPercent);
-      fflush(stdout);
+  //Optionally calibrate the precursor masses from a quick closed search first
+  if(params.recalSample>1 && !bResume) recalibrate();
+
+  //Adaptive open search: a first pass over a sample of the spectra finds the adduct masses that
+  //occur, then all spectra are searched for only those adducts.
+  if(params.adaptiveSample>1 && bResume){
+    printf("(adduct masses of the first pass restored) ");
+  } else if(params.adaptiveSample>1 && !params.adducts.empty()){
+    printf("(adaptive_sample ignored; adduct_mass list given) ");
+  } else if(params.adaptiveSample>1){
+    printf("first pass on 1 of every %d spectra ... ",params.adaptiveSample);
+    sampleStride=params.adaptiveSample;
+    searchStaged();
+    sampleStride=1;
+    if(findAdductPeaks()){
+      for(int j=0;j<spec->size();j++) spec->at(j).clearScores();
+      printf("  Second pass on all spectra for %d adduct masses ... ",(int)params.adducts.size());
+    } else {
+      for(int j=0;j<spec->size();j++) spec->at(j).clearScores();
+      printf("  No adduct masses found; second pass on all spectra over the full adduct range ... ");
     }
   }
 
-  threadPool->WaitForQueuedParams();
-  threadPool->WaitForThreads();
-
-  //Finalize progress meter
-  printf("\b\b\b100%%");
-  cout << endl;
+  //Only the main search saves checkpoints; the passes above are repeated if it is interrupted first
+  bCheckpoint=params.checkpoint>0;
+  time(&checkpointTime);
+  searchStaged();
+  bCheckpoint=false;
+  spec->finishCheckpoint();
+  if(params.clusterSpectra) copyClusterResults();
+  if(db->isStreamed()) db->finishStream();
+
+  //Report how much of the b-ion ladders came from overlapping peptides
+  size_t reuse=0;
+  size_t total=0;
+  for(int j=0;j<params.threads;j++){
+    reuse+=ions[j].ladderReuse;
+    total+=ions[j].ladderTotal;
+  }
+  if(total>0) printf("  Fragment ladder reuse: %.1lf%% (%zu of %zu b-ion positions)\n",(double)reuse/total*100,reuse,total);
+
+  //Report how many spectrum candidates were skipped by their score upper bound
+  if(params.scorePruning){
+    mPruneCount pc;
+    for(int j=0;j<params.threads;j++){
+      pc.closed+=pruneCount[j].closed;
+      pc.closedPruned+=pruneCount[j].closedPruned;
+      pc.open+=pruneCount[j].open;
+      pc.openPruned+=pruneCount[j].openPruned;
+    }
+    printf("  Score pruning: %zu of %zu closed and %zu of %zu open spectrum candidates skipped\n",pc.closedPruned,pc.closed,pc.openPruned,pc.open);
+  }
 
-  //clean up memory & release pointers
-  delete threadPool;
-  threadPool=NULL;
-  p=NULL;
+  //Report the prefilter, and its recall of the best exhaustive scores
+  if(params.prefilterTopK>0){
+    mPrefilterCount pf;
+    for(int j=0;j<params.threads;j++){
+      pf.spectra+=prefilterCount[j].spectra;
+      pf.variants+=prefilterCount[j].variants;
+      pf.kept+=prefilterCount[j].kept;
+      pf.recall+=prefilterCount[j].recall;
+      pf.recallHit+=prefilterCount[j].recallHit;
+    }
+    printf("  Prefilter: %zu of %zu variants kept for full scoring in %zu spectrum candidates\n",pf.kept,pf.variants,pf.spectra);
+    if(params.prefilterRecall && pf.recall>0) printf("  Prefilter recall: %.2lf%% (%zu of %zu best exhaustive scores kept)\n",(double)pf.recallHit/pf.recall*100,pf.recallHit,pf.recall);
+  }
 
   return true;
 }
@@ -247,7 +293,10 @@ void MAnalysis::analyzePeptideProc(mAnalysisStruct* s){
     exit(-1);
   }
   s->bKIonsMem = &bKIonsManager[i];
-  analyzePeptide(s->pep,s->pepIndex,i);
+  if(s->order==NULL) analyzePeptide(s->pep,s->pepIndex,i);
+  else {
+    for(int j=0;j<s->count;j++) analyzePeptide(&db->getPeptideList()->at(s->order[j]),s->order[j],i);
+  }
   delete s;
   s=NULL;
 }
@@ -286,121 +335,631 @@ bool MAnalysis::analyzePeptide(mPeptide* p, int pepIndex, int iIndex){
     return true;
   }
 
-  ions[iIndex].setPeptide(&db->at(p->map->at(0).index).sequence[p->map->at(0).start],p->map->at(0).stop-p->map->at(0).start+1,p->mass,p->nTerm,p->cTerm);
-  ions[iIndex].buildModIons2(false); //having this here is bad if there are lots of mods and few spectra
-
-  //Check peptide without open modifications
-  double lastMass=0;
-  for(size_t j=0;j<ions[iIndex].pepCount;j++){ //TODO: instead of pepcount, go by unique peptide masses
-    //TODO: skip variants already searched. Must do some additional work to 
-    //identify peptides with the same mass
-    //if (ions[iIndex].pepMass[j] <= lastMass) {
-    //  if(echo) cout << "skip" << endl;
-    //  continue; //skip peptide variants already searched
-    //}
+  //the open search stage of a hierarchical search only needs peptides that can take an adduct
+  if(searchStage==2 && p->xlSites==0) return true;
 
-    if(spec->getBoundaries2(ions[iIndex].pepMass[j],params.ppmPrecursor,index,scanBuffer[iIndex])){
-      scoreSpectra2(index, ions[iIndex].pepMass[j], len, pepIndex, iIndex);
-    } 
-    lastMass= ions[iIndex].pepMass[j];
+  //Enumerate the variants once for both searches. Open modification sites are only added if
+  //the peptide has sites where the modification can bind.
+  string pepSeq;
+  db->getPeptideSeq(*p, pepSeq);
+  ions[iIndex].setPeptide(pepSeq.c_str(),len,p->mass,p->nTerm,p->cTerm,p->map->at(0).index,p->map->at(0).start);
+  ions[iIndex].buildModVariants(p->xlSites>0 && searchStage!=1);
+  if(searchStage==2) ions[iIndex].pepClosed.assign(ions[iIndex].pepCount,false);
+
+  //Check peptide without open modifications. Variants with the same mass are grouped (in order
+  //of their first variant), so each candidate spectrum is visited once per unique mass.
+  map<double,size_t> massGroup;
+  vector<double> groupMass;
+  vector<sDIndex> groupVar;
+  for(size_t j=0;j<ions[iIndex].pepCount;j++){
+    if(!ions[iIndex].pepClosed[j]) continue;
+    map<double,size_t>::iterator it=massGroup.find(ions[iIndex].pepMass[j]);
+    sDIndex di;
+    if(it==massGroup.end()){
+      di.a=groupMass.size();
+      massGroup[ions[iIndex].pepMass[j]]=di.a;
+      groupMass.push_back(ions[iIndex].pepMass[j]);
+    } else di.a=it->second;
+    di.b=j;
+    groupVar.push_back(di);
   }
-  
-  if (p->xlSites == 0) {
-    return true;
+  sort(groupVar.begin(),groupVar.end(),compareDIndex);
+  vector<size_t> groupStart(groupMass.size()+1,groupVar.size());
+  for(size_t j=groupVar.size();j-->0;) groupStart[groupVar[j].a]=j;
+  vector<size_t> closedVar(groupVar.size());
+  for(size_t j=0;j<groupVar.size();j++) closedVar[j]=groupVar[j].b;
+
+  //find the mass groups that have candidate spectra, and record each (spectrum, group) pair
+  vector<sDIndex> closed;
+  for(size_t g=0;g<groupMass.size();g++){
+    bool bMatch=spec->getBoundaries2(groupMass[g],params.ppmPrecursor,index,scanBuffer[iIndex]);
+    if(bMatch && sampleStride>1){
+      filterSpectra(index);
+      bMatch=!index.empty();
+    }
+    for(size_t j=groupStart[g];j<groupStart[g+1];j++){
+      if(bMatch) ions[iIndex].pepSelect[closedVar[j]]=true;
+      else ions[iIndex].pepClosed[closedVar[j]]=false;
+    }
+    if(!bMatch) continue;
+    for(size_t k=0;k<index.size();k++){
+      sDIndex di;
+      di.a=index[k];
+      di.b=g;
+      closed.push_back(di);
+    }
   }
+  sort(closed.begin(),closed.end(),compareDIndex);
 
   //Search for open modifications on peptide as well if it has sites where modification can bind
-  analyzeSinglets(*p, pepIndex, iIndex);
+  vector<int> scanIndex;
+  double minMassA=0;
+  double maxMassA=0;
+  if(p->xlSites>0 && searchStage!=1) getSingletSpectra(scanIndex,minMassA,maxMassA,iIndex);
+
+  if(closed.empty() && scanIndex.empty()) return true;
+
+  //Build the fragment ions once for all selected variants, then score each candidate spectrum
+  //once, with both hypotheses sharing its unshifted fragment scores.
+  ions[iIndex].buildModIons();
+  size_t a=0;
+  size_t b=0;
+  while(a<closed.size() || b<scanIndex.size()){
+    int si;
+    if(b==scanIndex.size() || (a<closed.size() && (int)closed[a].a<=scanIndex[b])) si=(int)closed[a].a;
+    else si=scanIndex[b];
+    peakZ[iIndex]=0;
+    closedZ[iIndex]=0;
+    for(;a<closed.size() && (int)closed[a].a==si;a++){
+      size_t g=closed[a].b;
+      scoreSpectra2(si, &closedVar[groupStart[g]], groupStart[g+1]-groupStart[g], len, pepIndex, iIndex);
+    }
+    if(b<scanIndex.size() && scanIndex[b]==si){
+      scoreSingletSpectra2(si, p->mass, len, pepIndex, minMassA, maxMassA, iIndex);
+      b++;
+    }
+  }
 
   //cout << "Done: " << str << endl;
   return true;
-  
-  
-  //
-  //ions[iIndex].buildIons();
-  //ions[iIndex].modIonsRec2(0,-1,0,0,false);
+}
 
-  //for(j=0;j<ions[iIndex].size();j++){
-  //  bt= spec->getBoundaries2(ions[iIndex][j].mass, params.ppmPrecursor, index, scanBuffer[iIndex]);
-  //  if(bt) scoreSpectra(index,j,len,ions[iIndex][j].difMass,pepIndex,-1,-1,-1,-1,iIndex);
-  // }
+//Gets all spectra that might contain the current peptide and an adduct, and flags the variants
+//that can pair with them. Returns false if there are none.
+bool MAnalysis::getSingletSpectra(vector<int>& scanIndex, double& minMass, double& maxMass, int iIndex) {
 
-  //if(p->xlSites==0) return true;
+  //With a list of known adducts, look up spectra only at each variant mass plus each adduct
+  if (!params.adducts.empty()) {
+    if (!getAdductSpectra(scanIndex, minMass, maxMass, iIndex)) {
+      scanIndex.clear();
+      return false;
+    }
+  } else {
+
+    //Set Mass boundaries
+    minMass = ions[iIndex].pepMassMin + params.minAdductMass;
+    maxMass = ions[iIndex].pepMassMax + params.maxAdductMass;
+    minMass-=(minMass/1000000*params.ppmPrecursor); //is this necessary because all adduct results end in 0ppm error?
+    maxMass+=(maxMass/1000000*params.ppmPrecursor);
+
+    if (!spec->getBoundaries(minMass, maxMass, scanIndex, scanBuffer[iIndex])) {
+      scanIndex.clear();
+      return false;
+    }
+  }
 
-  ////Search for open modifications on peptide as well if it has sites where modification can bind
-  //analyzeSinglets(*p,pepIndex,iIndex);
+  filterSpectra(scanIndex);
+  if (scanIndex.empty()) return false;
 
-  //return true;
+  //build fragment ions only for the variants that can pair with a candidate precursor
+  if (!selectSingletVariants(scanIndex, minMass, maxMass, iIndex)) {
+    scanIndex.clear();
+    return false;
+  }
+  sort(scanIndex.begin(),scanIndex.end());
+  return true;
 }
 
-bool MAnalysis::analyzeSinglets(mPeptide& pep, int index, int iIndex) {
+//Gets the spectra with a precursor at any variant mass plus any of the listed adducts, and the
+//precursor mass range that covers them. Returns false if there are none.
+bool MAnalysis::getAdductSpectra(vector<int>& scanIndex, double& minMass, double& maxMass, int iIndex){
+  MIons* ion = &ions[iIndex];
+  size_t a,b;
 
-  //get the peptide sequence
-  string pepSeq;
-  db->getPeptideSeq(pep, pepSeq);
-
-  //if(index!=903) return false;
-
-  //Build our peptide
-  int len = (pep.map->at(0).stop - pep.map->at(0).start) + 1;
-  ions[iIndex].setPeptide(&db->at(pep.map->at(0).index).sequence[pep.map->at(0).start], len, pep.mass, pep.nTerm, pep.cTerm);
-  ions[iIndex].buildModIons2(); //It would be more efficient to do this after spec->getBoundaries below. Must use alternative way to compute min and max peptides.
-                                
-  //cout << "BUILD DONE: " << ions[iIndex].pepCount << endl;
-
-  /*if (index == 103) {
-    cout << "Bions:" << endl;
-    vector<sNode2>* peaks = ions[iIndex].peaks;
-    for (size_t a = 0; a < peaks->size(); a++) {
-      cout << a << " " << peaks->at(a).id << "\t" << peaks->at(a).mass << "\t" << peaks->at(a).next.size() << endl;
-      for (size_t b = 0; b < peaks->at(a).next.size(); b++) {
-        cout << "  N\t" << b << "\t" << peaks->at(a).next[b].nextIndex << "\t" << peaks->at(a).next[b].nextNode << "\t" << peaks->at(a).next[b].pepNum << endl;
-      }
-      for (size_t b = 0; b < peaks->at(a).start.size(); b++) {
-        cout << "  S\t" << b << "\t" << peaks->at(a).start[b].nextIndex << "\t" << peaks->at(a).start[b].nextNode << "\t" << peaks->at(a).start[b].pepNum << endl;
-      }
+  //distinct variant masses
+  vector<double> mass(ion->pepMass.begin(), ion->pepMass.begin()+ion->pepCount);
+  sort(mass.begin(),mass.end());
+  mass.erase(unique(mass.begin(),mass.end()),mass.end());
+
+  vector<int> index;
+  scanIndex.clear();
+  minMass=0;
+  maxMass=0;
+  for(b=0;b<params.adducts.size();b++){
+    double lo = mass[0] + params.adducts[b].mass;
+    double hi = mass.back() + params.adducts[b].mass;
+    lo-=(lo/1000000*adductPPM(b));
+    hi+=(hi/1000000*adductPPM(b));
+    if(b==0 || lo<minMass) minMass=lo;
+    if(b==0 || hi>maxMass) maxMass=hi;
+    for(a=0;a<mass.size();a++){
+      if(!spec->getBoundaries2(mass[a]+params.adducts[b].mass,adductPPM(b),index,scanBuffer[iIndex])) continue;
+      scanIndex.insert(scanIndex.end(),index.begin(),index.end());
     }
+  }
+  sort(scanIndex.begin(),scanIndex.end());
+  scanIndex.erase(unique(scanIndex.begin(),scanIndex.end()),scanIndex.end());
+  return !scanIndex.empty();
+}
+
+//Precursor tolerance (ppm) of a listed adduct
+double MAnalysis::adductPPM(size_t i){
+  if(params.adducts[i].ppm>0) return params.adducts[i].ppm;
+  return params.ppmPrecursor;
+}
+
+//Returns true if the precursor mass less the variant mass is an adduct that is searched: any
+//mass within the adduct bounds, or with a list of adducts, any listed mass within its tolerance.
+bool MAnalysis::checkAdduct(double preMass, double pepMass){
+  if(params.adducts.empty()){
+    double massA = preMass - pepMass;
+    return massA>=params.minAdductMass && massA<=params.maxAdductMass;
+  }
+  for(size_t i=0;i<params.adducts.size();i++){
+    double target = pepMass + params.adducts[i].mass;
+    if(fabs(preMass-target)<=target/1000000*adductPPM(i)) return true;
+  }
+  return false;
+}
+
+//Calls the adduct masses of the adaptive open search from the first pass results: the adduct
+//masses of the top hits with E-value <= 0.01 are sorted, and runs of masses that lie within the
+//precursor tolerance of their neighbours form a peak. Peaks with at least adaptive_min_count hits
+//become the adduct list of the second pass, at their median mass. Returns false if none qualify.
+bool MAnalysis::findAdductPeaks(){
+  vector<mAdductHit> v;
+  for(int i=0;i<spec->size();i+=sampleStride){
+    mScoreCard& sc=spec->at(i).getScoreCard(0);
+    if(sc.eVal>0.01 || sc.massA==0) continue;
+    mAdductHit h;
+    h.massA=sc.massA;
+    h.tol=(sc.mass+sc.massA)/1000000*params.ppmPrecursor*2;
+    v.push_back(h);
+  }
+  if(v.empty()) return false;
+  sort(v.begin(),v.end(),compareAdductHit);
+
+  printf("  Adduct mass peaks from %zu first pass hits:",v.size());
+  size_t start=0;
+  for(size_t i=1;i<=v.size();i++){
+    if(i<v.size() && v[i].massA-v[i-1].massA<=v[i].tol) continue;
+    size_t count=i-start;
+    if((int)count>=params.adaptiveMinCount){
+      mAdduct ad;
+      ad.mass=v[start+count/2].massA;
+      ad.ppm=0;
+      params.adducts.push_back(ad);
+      printf(" %.4lf (%zu)",ad.mass,count);
+    }
+    start=i;
+  }
+  if(params.adducts.empty()) printf(" none");
+  printf("\n");
+  return !params.adducts.empty();
+}
+
+//Fits the systematic precursor mass error, in ppm, as a linear function of precursor m/z and
+//retention time, from the confident unmodified hits of a closed search over every recalSample-th
+//spectrum. All precursor masses are then corrected, and the precursor tolerance is tightened to
+//four standard deviations of the fit residuals (no less than 1 ppm). Results of the calibration
+//search are discarded.
+bool MAnalysis::recalibrate(){
+  printf("precursor recalibration on 1 of every %d spectra ... ",params.recalSample);
+  sampleStride=params.recalSample;
+  searchStage=1;
+  searchPeptides();
+  sampleStride=1;
+  searchStage=0;
+
+  //collect the errors of the confident hits, with centered m/z and retention time
+  vector<double> ppm, mz, rt;
+  double mzMean=0;
+  double rtMean=0;
+  for(int i=0;i<spec->size();i+=params.recalSample){
+    MSpectrum* s=&spec->at(i);
+    mScoreCard& sc=s->getScoreCard(0);
+    if(sc.eVal>0.01 || sc.massA!=0) continue;
+    mPrecursor* p=s->getPrecursor2(sc.precursor);
+    ppm.push_back((p->monoMass-sc.mass)/sc.mass*1e6);
+    mz.push_back((p->monoMass+p->charge*1.007276466)/p->charge);
+    rt.push_back(s->getRTime());
+    mzMean+=mz.back();
+    rtMean+=rt.back();
+  }
+  for(int i=0;i<spec->size();i++) spec->at(i).clearScores();
+  if(ppm.size()<10){
+    printf("  Precursor recalibration skipped: %zu confident hits (10 needed)\n  Scoring peptides ... ",ppm.size());
+    return false;
+  }
+  size_t n=ppm.size();
+  mzMean/=n;
+  rtMean/=n;
+
+  //least squares fit of ppm = c0 + c1*(mz-mzMean) + c2*(rt-rtMean)
+  double a[3][4];
+  for(int j=0;j<3;j++){
+    for(int k=0;k<4;k++) a[j][k]=0;
+  }
+  for(size_t i=0;i<n;i++){
+    double x[3]={1, mz[i]-mzMean, rt[i]-rtMean};
+    for(int j=0;j<3;j++){
+      for(int k=0;k<3;k++) a[j][k]+=x[j]*x[k];
+      a[j][3]+=x[j]*ppm[i];
+    }
+  }
+  double c[3]={0,0,0};
+  for(int j=0;j<3;j++){ //Gaussian elimination with partial pivoting
+    int piv=j;
+    for(int k=j+1;k<3;k++) if(fabs(a[k][j])>fabs(a[piv][j])) piv=k;
+    for(int k=0;k<4;k++) swap(a[j][k],a[piv][k]);
+    if(fabs(a[j][j])<1e-12) continue; //no spread in this variable; leave its term at zero
+    for(int k=0;k<3;k++){
+      if(k==j) continue;
+      double f=a[k][j]/a[j][j];
+      for(int m=j;m<4;m++) a[k][m]-=f*a[j][m];
+    }
+  }
+  for(int j=0;j<3;j++) if(fabs(a[j][j])>=1e-12) c[j]=a[j][3]/a[j][j];
+
+  //residual spread of the fit
+  double sd=0;
+  for(size_t i=0;i<n;i++){
+    double r=ppm[i]-(c[0]+c[1]*(mz[i]-mzMean)+c[2]*(rt[i]-rtMean));
+    sd+=r*r;
+  }
+  sd=sqrt(sd/n);
+
+  //correct every precursor and rebuild the precursor mass list
+  for(int i=0;i<spec->size();i++){
+    MSpectrum* s=&spec->at(i);
+    double t=s->getRTime()-rtMean;
+    for(int j=0;j<s->sizePrecursor();j++){
+      mPrecursor* p=s->getPrecursor2(j);
+      double m=(p->monoMass+p->charge*1.007276466)/p->charge-mzMean;
+      p->monoMass-=p->monoMass*(c[0]+c[1]*m+c[2]*t)/1e6;
+    }
+  }
+  spec->buildMassList();
+  maxMass = spec->getMaxMass()+0.25;
+  minMass = spec->getMinMass()-0.25;
+
+  double tol=4*sd;
+  if(tol<1) tol=1;
+  if(tol>params.ppmPrecursor) tol=params.ppmPrecursor;
+  printf("  Precursor recalibration from %zu hits: ppm error %.2lf %+.2e/Th %+.2e/RT, residual SD %.2lf ppm; tolerance %.1lf -> %.1lf ppm\n",n,c[0],c[1],c[2],sd,params.ppmPrecursor,tol);
+  params.ppmPrecursor=tol;
+  printf("  Scoring peptides ... ");
+  return true;
+}
 
-    cout << "Yions:"<<endl;
-    vector<sNode2>* peaksRev=ions[iIndex].peaksRev;
-    for (size_t a = 0; a < peaksRev->size(); a++) {
-      cout << a << " " << peaksRev->at(a).id << "\t" << peaksRev->at(a).mass << "\t" << peaksRev->at(a).next.size() << endl;
-      for (size_t b = 0; b < peaksRev->at(a).next.size(); b++) {
-        cout << "  N\t" << b << "\tNindex: " << peaksRev->at(a).next[b].nextIndex << "\tNnode: " << peaksRev->at(a).next[b].nextNode << "\tPep: " << peaksRev->at(a).next[b].pepNum << endl;
+//Copies the results of each cluster representative to the other spectra of its cluster. Each
+//hit is moved to the member's matching precursor, and its E-value is computed from the member's
+//own E-value histogram.
+void MAnalysis::copyClusterResults(){
+  vector<mPeptide>* p=db->getPeptideList();
+  for(int i=0;i<spec->size();i++){
+    MSpectrum* s=&spec->at(i);
+    if(s->cluster<0 || s->cluster==i) continue;
+    MSpectrum* r=&spec->at(s->cluster);
+    for(int k=0;k<20;k++){
+      mScoreCard sc=r->getScoreCard(k);
+      if(sc.simpleScore<=0) break;
+
+      //closest precursor of the member to the one of the hit
+      double m=r->getPrecursor2(sc.precursor)->monoMass;
+      int best=-1;
+      for(int j=0;j<s->sizePrecursor();j++){
+        if(best<0 || fabs(s->getPrecursor2(j)->monoMass-m)<fabs(s->getPrecursor2(best)->monoMass-m)) best=j;
       }
-      for (size_t b = 0; b < peaksRev->at(a).start.size(); b++) {
-        cout << "  S\t" << b << "\tSindex: " << peaksRev->at(a).start[b].nextIndex << "\tSnode: " << peaksRev->at(a).start[b].nextNode << "\tPep: " << peaksRev->at(a).start[b].pepNum << "\tParentPep: " << peaksRev->at(a).start[b].parentPepNum << endl;
+      if(best<0 || fabs(s->getPrecursor2(best)->monoMass-m)>m/1000000*params.ppmPrecursor) continue;
+      if(sc.massA!=0) sc.massA=s->getPrecursor2(best)->monoMass-sc.mass;
+      sc.precursor=best;
+
+      mPeptide& pep=p->at(sc.pep);
+      int len=(pep.map->at(0).stop-pep.map->at(0).start)+1;
+      sc.eVal=s->computeE(sc.simpleScore,len);
+      s->getTopPeps(best)->checkPeptideScore(sc);
+      s->checkScore(sc,0);
+    }
+  }
+}
+
+//Keeps only the spectrum indexes searched in the current pass: every sampleStride-th spectrum,
+//less those already explained by the closed search stage.
+void MAnalysis::filterSpectra(vector<int>& index){
+  if(sampleStride<2 && explained.empty()) return;
+  size_t n=0;
+  for(size_t i=0;i<index.size();i++){
+    if(index[i]%sampleStride!=0) continue;
+    if(!explained.empty() && explained[index[i]]) continue;
+    index[n++]=index[i];
+  }
+  index.resize(n);
+}
+
+//Saves a checkpoint of the search if one is due. Peptides before cursor in the list are searched.
+void MAnalysis::saveCheckpoint(size_t cursor){
+  time_t t;
+  time(&t);
+  if(difftime(t,checkpointTime)<params.checkpoint*60.0) return;
+  mCheckpoint cp;
+  cp.stage=searchStage;
+  cp.cursor=cursor;
+  cp.peptides=(size_t)db->getPeptideListSize();
+  cp.ppmPrecursor=params.ppmPrecursor;
+  cp.adducts=params.adducts;
+  cp.explained=explained;
+  if(spec->writeCheckpoint(cp)) checkpointTime=t;
+}
+
+//Searches all peptides, optionally in two stages: the closed search first, then the open search
+//on only the spectra whose best closed hit is above the closed_evalue_cutoff.
+bool MAnalysis::searchStaged(){
+  if(params.closedEValue<=0) return searchPeptides();
+
+  //A search resumed in the open search stage keeps the spectra explained by its closed search
+  if(bResume && spec->getCheckpoint().stage==2){
+    explained=spec->getCheckpoint().explained;
+  } else {
+    searchStage=1;
+    searchPeptides();
+
+    int count=0;
+    int total=0;
+    explained.assign(spec->size(),false);
+    for(int i=0;i<spec->size();i+=sampleStride){
+      total++;
+      if(spec->at(i).getScoreCard(0).eVal>params.closedEValue) continue;
+      explained[i]=true;
+      count++;
+    }
+    printf("  Closed search explains %d of %d spectra (E-value <= %g); open search on the rest ... ",count,total,params.closedEValue);
+  }
+
+  searchStage=2;
+  searchPeptides();
+  searchStage=0;
+  explained.clear();
+  return true;
+}
+
+//Searches all peptides against the spectra, or against every sampleStride-th spectrum.
+//Searches the peptide list. A streamed database is searched one block of proteins at a time;
+//after each block, the peptides referenced by the search results are kept and the rest released.
+bool MAnalysis::searchPeptides(){
+  if(!db->isStreamed()) {
+    size_t sz=db->getPeptideList()->size();
+    size_t lo=0;
+    size_t hi=sz;
+    if(params.shardCount>0 && params.shardMode==0){ //peptide shard: a contiguous part of the mass-ordered list
+      lo=sz*(params.shardIndex-1)/params.shardCount;
+      hi=sz*params.shardIndex/params.shardCount;
+    }
+    if(!bCheckpoint && !bResume) return searchPeptideRange(lo,hi);
+
+    //Search in blocks, so the search state can be saved between them. A resumed search starts
+    //with the block after its checkpoint.
+    size_t start=lo;
+    if(bResume && spec->getCheckpoint().cursor>lo) start=spec->getCheckpoint().cursor;
+    bResume=false;
+    int iPercent=0;
+    if(hi>lo) iPercent=(int)((double)(start-lo)/(hi-lo)*100);
+    printf("%2d%%",iPercent);
+    fflush(stdout);
+    for(size_t b=0;b<CHECKPOINT_BLOCKS;b++){
+      size_t bLo=lo+(hi-lo)*b/CHECKPOINT_BLOCKS;
+      size_t bHi=lo+(hi-lo)*(b+1)/CHECKPOINT_BLOCKS;
+      if(bHi<=start) continue;
+      if(bLo<start) bLo=start;
+      searchPeptideRange(bLo,bHi,false);
+      if(bCheckpoint) saveCheckpoint(bHi);
+      int iTmp=(int)((double)(bHi-lo)/(hi-lo)*100);
+      if(iTmp>iPercent){
+        iPercent=iTmp;
+        printf("\b\b\b%2d%%",iPercent);
+        fflush(stdout);
       }
     }
-  }*/
-
-  /*cout << endl;
-  for(size_t a=0;a<ions[iIndex].peaks->size();a++){
-    cout << ions[iIndex].peaks->at(a).mass << "\t" << ions[iIndex].peaks->at(a).next.size() << "\t" << ions[iIndex].peaks->at(a).start.size() << endl;
-  }*/
-
-  //get all spectra that might contain this peptide and adduct
-  //Set Mass boundaries
-  double minMass = ions[iIndex].pepMassMin + params.minAdductMass;
-  double maxMass = ions[iIndex].pepMassMax + params.maxAdductMass;
-  minMass-=(minMass/1000000*params.ppmPrecursor); //is this necessary because all adduct results end in 0ppm error?
-  maxMass+=(maxMass/1000000*params.ppmPrecursor);
- 
-  vector<int> scanIndex;
-  //cout << "Boundaries" << endl;
-  if (!spec->getBoundaries(minMass, maxMass, scanIndex, scanBuffer[iIndex])) return true;
+    printf("\b\b\b100%%");
+    cout << endl;
+    return true;
+  }
+
+  db->rewindStream(true);
+  while(db->buildPeptideBlock()){
+    size_t base=db->getKeptCount();
+    searchPeptideRange(base,db->getPeptideList()->size());
+    vector<bool> used(db->getPeptideList()->size()-base,false);
+    for(int i=0;i<spec->size();i++) spec->at(i).markPeptides(used,(int)base);
+    vector<int> remap;
+    db->keepPeptides(used,remap);
+    for(int i=0;i<spec->size();i++) spec->at(i).remapPeptides(remap,(int)base);
+  }
+  return true;
+}
+
+//Searches the peptides from lo to hi-1 of the peptide list, which must be ordered by mass.
+//bMeter shows the progress of the range.
+bool MAnalysis::searchPeptideRange(size_t lo, size_t hi, bool bMeter){
+  size_t i;
+  int iPercent;
+  int iTmp;
+  vector<mPeptide>* p;
+  vector<int> index;
+  vector<mPepMod> mods;
+
+  //mScoreCard sc;
 
+  ThreadPool<mAnalysisStruct*>* threadPool = new ThreadPool<mAnalysisStruct*>(analyzePeptideProc,params.threads,params.threads,1);
 
-  //cout << "onward" << endl;
-  for (size_t j = 0; j<scanIndex.size(); j++){
-    scoreSingletSpectra2(scanIndex[j], pep.mass, len, index, minMass, maxMass, iIndex);
+  //Set progress meter
+  iPercent=0;
+  if(bMeter){
+    printf("%2d%%",iPercent);
+    fflush(stdout);
   }
 
-  //cout << "Done Singlets" << endl;
+  //Set which list of peptides to search (with and without internal lysine)
+  p=db->getPeptideList();
+
+  //The peptide list is ordered by mass. Only the slice that can reach the precursors of the
+  //current spectra is searched: the lightest precursor is reached with the largest adduct, all
+  //modifications at their heaviest, and isotope error. Heavy peptides are also skipped in analyzePeptide.
+  //The closed search needs no offset, so the reach is never below zero, even for a losses-only open search.
+  double reach=0;
+  if(params.maxAdductMass>reach) reach=params.maxAdductMass;
+  for(i=0;i<params.adducts.size();i++){
+    if(params.adducts[i].mass>reach) reach=params.adducts[i].mass;
+  }
+  double modMax=0;
+  for(i=0;i<params.mods.size();i++){
+    if(params.mods[i].mass>modMax) modMax=params.mods[i].mass;
+  }
+  reach+=modMax*params.maxMods+params.isotopeError*1.00335+1.0;
+  size_t first=lo;
+  size_t last=hi;
+  while(first<last && p->at(first).mass<minMass-reach) first++;
+  while(last>first && p->at(last-1).mass>spec->getMaxMass()+1) last--;
+
+  //Optionally order the peptides by protein and start position. Peptides that share a start
+  //(missed cleavages) are searched as one job, so the worker can reuse their fragment ladders.
+  vector<int> order;
+  if(params.peptideOrder==1){
+    vector<mPepOrder> po(last-first);
+    for(i=first;i<last;i++){
+      po[i-first].protein=p->at(i).map->at(0).index;
+      po[i-first].start=p->at(i).map->at(0).start;
+      po[i-first].stop=p->at(i).map->at(0).stop;
+      po[i-first].pep=(int)i;
+    }
+    sort(po.begin(),po.end(),comparePepOrder);
+    order.resize(po.size());
+    for(i=0;i<po.size();i++) order[i]=po[i].pep;
+  }
+
+  //Iterate the peptide for the first pass
+  for(i=0;i<last-first;){
+
+    threadPool->WaitForQueuedParams();
+
+    mAnalysisStruct* a;
+    if(params.peptideOrder==1){
+      size_t j=i+1;
+      while(j<order.size() && p->at(order[j]).map->at(0).index==p->at(order[i]).map->at(0).index && p->at(order[j]).map->at(0).start==p->at(order[i]).map->at(0).start) j++;
+      a = new mAnalysisStruct(&mutexKIonsManager,NULL,order[i],&order[i],(int)(j-i));
+      i=j;
+    } else {
+      a = new mAnalysisStruct(&mutexKIonsManager,&p->at(first+i),(int)(first+i));
+      i++;
+    }
+    threadPool->Launch(a);
+
+    //Update progress meter
+    iTmp=(int)((double)i/(last-first)*100);
+    if(bMeter && iTmp>iPercent){
+      iPercent=iTmp;
+      printf("\b\b\b%2d%%",iPercent);
+      fflush(stdout);
+    }
+  }
+
+  threadPool->WaitForQueuedParams();
+  threadPool->WaitForThreads();
+
+  //Finalize progress meter
+  if(bMeter){
+    printf("\b\b\b100%%");
+    cout << endl;
+  }
+
+  //clean up memory & release pointers
+  delete threadPool;
+  threadPool=NULL;
+  p=NULL;
 
   return true;
 }
 
+//Flags the peptide variants whose adduct mass (precursor - variant) falls within the allowed
+//range for at least one precursor that scoreSingletSpectra2 will consider. Returns false if
+//no variant qualifies.
+bool MAnalysis::selectSingletVariants(vector<int>& scanIndex, double minMass, double maxMass, int iIndex){
+  MIons* ion = &ions[iIndex];
+
+  //collect the precursors in the same way as scoreSingletSpectra2
+  vector<double> pre;
+  for(size_t a=0;a<scanIndex.size();a++){
+    MSpectrum* s = spec->getSpectrum(scanIndex[a]);
+    int sz = s->sizePrecursor();
+    int count = 0;
+    for(int i=0;i<sz;i++){
+      double m = s->getPrecursor2(i)->monoMass;
+      if(m<minMass || m>maxMass) continue;
+      pre.push_back(m);
+      if(++count==MAX_PRECURSOR) break;
+    }
+  }
+  sort(pre.begin(),pre.end());
+
+  bool bSel=false;
+  for(size_t a=0;a<ion->pepCount;a++){
+    if(!params.adducts.empty()){
+      for(size_t b=0;b<params.adducts.size();b++){
+        double target = ion->pepMass[a] + params.adducts[b].mass;
+        double tol = target/1000000*adductPPM(b);
+        vector<double>::iterator it = lower_bound(pre.begin(), pre.end(), target - tol);
+        if(it==pre.end() || *it>target+tol) continue;
+        ion->pepSelect[a]=true;
+        bSel=true;
+        break;
+      }
+      continue;
+    }
+    vector<double>::iterator it = lower_bound(pre.begin(), pre.end(), ion->pepMass[a] + params.minAdductMass - 0.001);
+    for(;it!=pre.end();it++){
+      double massA = *it - ion->pepMass[a];
+      if(massA>params.maxAdductMass) break;
+      if(massA<params.minAdductMass) continue;
+      ion->pepSelect[a]=true;
+      bSel=true;
+      break;
+    }
+  }
+  return bSel;
+}
+
+//Returns true if a hit with a raw score of at most bound can enter neither the top hits of
+//the spectrum nor the peptide lists of the given precursors. E-values fall as scores rise, so
+//the E-value of the bound is the best any such hit can get.
+bool MAnalysis::pruneSpectrum(MSpectrum* s, int index, int bound, vector<int>& prec, int len){
+  if (bound <= 0) return true; //only positive scores are reported
+
+  float score = (float)(bound * 0.005);
+  for (size_t i = 0; i<prec.size(); i++){
+    Threading::LockMutex(mutexSingletScore[index][prec[i]]);
+    MTopPeps* tp = s->getTopPeps(prec[i]);
+    bool bFull = tp->peptideCount>0 && tp->peptideCount==tp->peptideMax && score<tp->peptideLast->simpleScore;
+    Threading::UnlockMutex(mutexSingletScore[index][prec[i]]);
+    if (!bFull) return false;
+  }
+
+  Threading::LockMutex(mutexSpecScore[index]);
+  double ev = s->computeE(score, len);
+  bool bPrune = ev >= s->getScoreCard(19).eVal;
+  Threading::UnlockMutex(mutexSpecScore[index]);
+  return bPrune;
+}
+
 /*============================
   Private Functions
 ============================*/
@@ -417,6 +976,16 @@ bool MAnalysis::allocateMemory(int threads){
   }
   maxZ2=new int[threads];
   bufSize2=new size_t[threads];
+  peakScores=new vector<double>[threads];
+  peakZ=new int[threads];
+  closedScores=new vector<double>[threads];
+  closedZ=new int[threads];
+  preValid=new vector<unsigned int>[threads];
+  openScores=new vector<int>[threads];
+  openBest=new vector<int>[threads];
+  pruneCount=new mPruneCount[threads];
+  prefilterShared=new vector<int>[threads];
+  prefilterCount=new mPrefilterCount[threads];
   return true;
 }
 
@@ -429,6 +998,16 @@ void MAnalysis::deallocateMemory(int threads){
   delete[] scanBuffer;
   delete[] maxZ2;
   delete[] bufSize2;
+  delete[] peakScores;
+  delete[] peakZ;
+  delete[] closedScores;
+  delete[] closedZ;
+  delete[] preValid;
+  delete[] openScores;
+  delete[] openBest;
+  delete[] pruneCount;
+  delete[] prefilterShared;
+  delete[] prefilterCount;
 }
 
 //This function is way out of date. Particularly the mutexes and how to deal with multiple precursors.
@@ -629,59 +1208,68 @@ void MAnalysis::scoreSingletSpectra2(int index, double mass, int len, int pep, d
   //  cout << pre[a].monomass << "\t" << pre[a].maxZ << "\t" << pre[a].index << endl;
   //}
   size_t preCount=pre.size();
-  sScoreSet2* pScores = new sScoreSet2[pepCount];
-  score9(s, ions[iIndex].vPeaks, pScores, &pre, iIndex);
-
-  sScoreSet2* pScores3 = new sScoreSet2[pepCount];
-  score9(s,ions[iIndex].vPeaksRev,pScores3, &pre, iIndex);
 
-  //keep only the best score(s).
-  vector<sDIndex> vTop;
-  topScore=0;
-  size_t minMods=100;
+  //flag the precursors that give each variant an adduct mass within bounds (one bit per precursor)
+  vector<unsigned int>& valid = preValid[iIndex];
+  valid.assign(pepCount, 0);
   for (size_t a = 0; a<pepCount; a++){
-    //cout << "Peptide: " << a << "\t" << ions[iIndex].pepMass[a] << "\t" << ions[iIndex].pepLinks[a] << "\t" << ions[iIndex].pepMods[a].mods.size() << "\t" << pScores[a].scores << endl;
-    double topPreScore=0;
-    size_t topPreIndex=0;
     for (size_t b = 0; b<preCount; b++){
+      if(!checkAdduct(pre[b].monomass, ions[iIndex].pepMass[a])) continue; //skip adducts outside our bounds
+      valid[a] |= (1u << b);
+    }
+  }
 
-      double massA = pre[b].monomass - ions[iIndex].pepMass[a];
-      if(massA<params.minAdductMass || massA>params.maxAdductMass) continue; //skip adducts outside our bounds
-
-      double trueScore=pScores[a].score+pScores[a].scoreP[b]+pScores3[a].score+pScores3[a].scoreP[b];
-      if(trueScore>topPreScore){
-      //if (pScores[a].scores[b]+pScores2[a].scores[b] > topPreScore){
-        topPreScore=trueScore;
-        //topPreScore=pScores[a].scores[b] + pScores2[a].scores[b];
-        topPreIndex=b;
+  //optionally rank the variants by the strong spectrum bins they share, and fully score only
+  //the top K. For the recall report, all variants are scored first.
+  int exhaustive = 0;
+  bool bFiltered = false;
+  if (params.prefilterTopK > 0) {
+    if (params.prefilterRecall) {
+      scoreOpenVariants(s, index, pre, len, iIndex, false);
+      for (size_t a = 0; a<pepCount; a++){
+        if (openBest[iIndex][a] > exhaustive) exhaustive = openBest[iIndex][a];
       }
     }
+    bFiltered = prefilterVariants(s, iIndex);
+  }
+  if (!scoreOpenVariants(s, index, pre, len, iIndex, params.scorePruning && !params.prefilterRecall)) return;
+  int* topPre = &openBest[iIndex][0];
+  int* topPreIndex = topPre + pepCount;
 
-    if (topPreScore > topScore){
-      topScore = topPreScore;
-      //topScore = pScores[a].scores[topPreIndex]+pScores2[a].scores[topPreIndex];
+  //keep only the best score(s).
+  vector<sDIndex> vTop;
+  int topInt=0;
+  size_t minMods=100;
+  for (size_t a = 0; a<pepCount; a++){
+    if (topPre[a] == 0) continue;
+    if (topPre[a] > topInt){
+      topInt = topPre[a];
       vTop.clear();
       sDIndex di;
       di.a=a;
-      di.b = topPreIndex;
+      di.b = topPreIndex[a];
       vTop.push_back(di);
-      minMods = ions[iIndex].pepMods[a].mods.size();
-    } else if (topPreScore == topScore){
+      minMods = ions[iIndex].pepModCount[a];
+    } else if (topPre[a] == topInt){
       sDIndex di;
       di.a = a;
-      di.b = topPreIndex;
+      di.b = topPreIndex[a];
       vTop.push_back(di);
-      if (ions[iIndex].pepMods[a].mods.size()<minMods) minMods = ions[iIndex].pepMods[a].mods.size();
+      if (ions[iIndex].pepModCount[a]<minMods) minMods = ions[iIndex].pepModCount[a];
     }
-   
+  }
+  topScore=topInt;
+
+  if (bFiltered && exhaustive > 0) {
+    prefilterCount[iIndex].recall++;
+    if (topInt == exhaustive) prefilterCount[iIndex].recallHit++;
   }
 
   //TODO: Combine all ambiguous localizations here
   if(topScore>0){
     for(size_t a=0;a<vTop.size();a++){
-      double score= (pScores[vTop[a].a].score+pScores[vTop[a].a].scoreP[vTop[a].b] + pScores3[vTop[a].a].score+ pScores3[vTop[a].a].scoreP[vTop[a].b]) * 0.005;
-      //double score = (pScores[vTop[a].a].scores[vTop[a].b]+ pScores2[vTop[a].a].scores[vTop[a].b]) *0.005;
-      if (ions[iIndex].pepMods[vTop[a].a].mods.size()>minMods) continue; //skip modified peptides that are explained with fewer modifications
+      double score = topPre[vTop[a].a] * 0.005;
+      if (ions[iIndex].pepModCount[vTop[a].a]>minMods) continue; //skip modified peptides that are explained with fewer modifications
 
       topScore = score;
       //topMatch = pScores[vTop[a].a].match[vTop[a].b];
@@ -693,10 +1281,7 @@ void MAnalysis::scoreSingletSpectra2(int index, double mass, int len, int pep, d
       sc.massA = pre[vTop[a].b].monomass - ions[iIndex].pepMass[vTop[a].a];
       sc.precursor = pre[vTop[a].b].index;
       sc.site = ions[iIndex].pepLinks[vTop[a].a];
-      sc.mods->clear();
-      for (size_t c = 0; c<ions[iIndex].pepMods[vTop[a].a].mods.size(); c++){
-        sc.mods->push_back(ions[iIndex].pepMods[vTop[a].a][c]);
-      }
+      ions[iIndex].getVariantMods(vTop[a].a, *sc.mods);
 
       double ev = 1000;
       Threading::LockMutex(mutexSpecScore[index]);
@@ -717,59 +1302,203 @@ void MAnalysis::scoreSingletSpectra2(int index, double mass, int len, int pep, d
     }
   }
 
-  delete [] pScores;
-  //delete [] pScores2;
-  delete [] pScores3;
-  //peaks=NULL;
+}
+
+//Scores the variants flagged in preValid against the precursors of a spectrum in the open
+//search, leaving the best precursor score and index of each variant in openBest. Returns
+//false if the spectrum was skipped by score pruning.
+bool MAnalysis::scoreOpenVariants(MSpectrum* s, int index, vector<sPrecursor>& pre, int len, int iIndex, bool bPrune){
+  size_t pepCount=ions[iIndex].pepCount;
+  size_t preCount=pre.size();
+  vector<unsigned int>& valid = preValid[iIndex];
+
+  //Score accumulators, sized to this spectrum: the unshifted score of each variant, followed by
+  //the shifted scores of all variants for each precursor in turn (precursor-major). Pairs outside
+  //the adduct bounds start far below zero so they never win the best-precursor reduction.
+  vector<int>& acc = openScores[iIndex];
+  acc.resize(pepCount*(preCount+1));
+  int* base = &acc[0];
+  int* preScore = base + pepCount;
+  for (size_t a = 0; a<pepCount; a++) base[a] = 0;
+  for (size_t b = 0; b<preCount; b++){
+    int* ps = preScore + b*pepCount;
+    for (size_t a = 0; a<pepCount; a++) ps[a] = (valid[a] & (1u << b)) ? 0 : -0x40000000;
+  }
 
+  //unshifted ions first
+  scoreUnshifted(s, maxZ2[iIndex], iIndex);
+  score9(s, ions[iIndex].vPeaks, &peakScores[iIndex][0], &valid[0], base, NULL, pepCount, &pre, iIndex);
+  score9(s, ions[iIndex].vPeaksRev, &peakScores[iIndex][ions[iIndex].vPeaks.peaks.size()*3], &valid[0], base, NULL, pepCount, &pre, iIndex);
+
+  //optionally skip the shifted ions if no variant can score high enough: a variant with an
+  //open modification has at most one shifted ion per ladder position, each adding at most the
+  //largest bin value of the spectrum per charge state
+  if (bPrune) {
+    pruneCount[iIndex].open++;
+    int shiftMax = (int)ions[iIndex].getLadderLen() * maxZ2[iIndex] * (s->kojakMax > 0 ? s->kojakMax : 0);
+    int bound = 0;
+    unsigned int anyValid = 0;
+    for (size_t a = 0; a<pepCount; a++){
+      if (valid[a] == 0) continue;
+      anyValid |= valid[a];
+      int b = base[a] + (ions[iIndex].pepLinks[a] == -99 ? 0 : shiftMax);
+      if (b > bound) bound = b;
+    }
+    vector<int> prec;
+    for (size_t b = 0; b<preCount; b++){
+      if (anyValid & (1u << b)) prec.push_back(pre[b].index);
+    }
+    if (pruneSpectrum(s, index, bound, prec, len)) {
+      pruneCount[iIndex].openPruned++;
+      return false;
+    }
+  }
+
+  //then the shifted ions
+  score9(s, ions[iIndex].vPeaks, NULL, &valid[0], NULL, preScore, pepCount, &pre, iIndex);
+  score9(s, ions[iIndex].vPeaksRev, NULL, &valid[0], NULL, preScore, pepCount, &pre, iIndex);
+
+  //best precursor of each variant; the first precursor wins ties
+  vector<int>& best = openBest[iIndex];
+  best.assign(pepCount*2, 0);
+  int* topPre = &best[0];
+  int* topPreIndex = topPre + pepCount;
+  for (size_t b = 0; b<preCount; b++){
+    const int* ps = preScore + b*pepCount;
+    for (size_t a = 0; a<pepCount; a++){
+      int trueScore = base[a] + ps[a];
+      bool bUp = trueScore > topPre[a];
+      topPre[a] = bUp ? trueScore : topPre[a];
+      topPreIndex[a] = bUp ? (int)b : topPreIndex[a];
+    }
+  }
+
+  return true;
 }
 
-void MAnalysis::score9(MSpectrum* s, vector<sIPeak>& peakSet, sScoreSet2* ss, vector<sPrecursor>* pre, int iIndex){
-  for(size_t a=0;a<peakSet.size();a++){
-    if (peakSet[a].mass > 0) {
-      double score=0;
-      //if(echo) cout << a << " score9 A: " << peakSet[a].mass << endl;
-      for (int b = 1; b <= maxZ2[iIndex]; b++) {
-        double mz = (peakSet[a].mass + 1.007276466 * b) / b;
-        score+=magnumScoring2(s, mz);
-      }
-      for (size_t b = 0; b < peakSet[a].index[0].pepIndex.size(); b++) {
-        //if(echo) cout << "Add " << score << " to " << peakSet[a].index[0].pepIndex[b] << endl;
-        ss[peakSet[a].index[0].pepIndex[b]].score += score;
-      }
+//Ranks the candidate variants of a spectrum by how many of their unshifted fragment ions fall in
+//strong bins of the spectrum, and clears the precursor flags of all but the top K. Returns true
+//if any variant was dropped.
+bool MAnalysis::prefilterVariants(MSpectrum* s, int iIndex){
+  size_t pepCount=ions[iIndex].pepCount;
+  vector<unsigned int>& valid = preValid[iIndex];
+  size_t a, b;
+  int z;
+
+  size_t cand=0;
+  for (a = 0; a<pepCount; a++){
+    if (valid[a] != 0) cand++;
+  }
+  if (cand <= (size_t)params.prefilterTopK) return false;
+
+  //count the shared bins over the charge states of the open search
+  vector<int>& shared = prefilterShared[iIndex];
+  shared.assign(pepCount, 0);
+  sIPeakSet* sets[2] = { &ions[iIndex].vPeaks, &ions[iIndex].vPeaksRev };
+  for (int x = 0; x<2; x++){
+    sIPeakSet& peakSet = *sets[x];
+    for (a = 0; a<peakSet.peaks.size(); a++){
+      sIPeak& pk = peakSet.peaks[a];
+      if (pk.mass < 0) continue;
+      int n = 0;
+      for (z = 1; z <= maxZ2[iIndex]; z++) n += strongBin(s, (pk.mass + 1.007276466 * z) / z);
+      if (n == 0) continue;
+      size_t* pep = &peakSet.pep[pk.first];
+      for (b = 0; b < pk.count; b++) shared[pep[b]] += n;
+    }
+  }
+
+  //rank the candidates: most shared bins first, then by variant index
+  vector<sDIndex> rank;
+  for (a = 0; a<pepCount; a++){
+    if (valid[a] == 0) continue;
+    sDIndex di;
+    di.a = (size_t)(0x7fffffff - shared[a]);
+    di.b = a;
+    rank.push_back(di);
+  }
+  nth_element(rank.begin(), rank.begin() + params.prefilterTopK, rank.end(), compareDIndex);
+  for (a = params.prefilterTopK; a<rank.size(); a++) valid[rank[a].b] = 0;
+
+  prefilterCount[iIndex].spectra++;
+  prefilterCount[iIndex].variants+=rank.size();
+  prefilterCount[iIndex].kept+=params.prefilterTopK;
+  return true;
+}
+
+//Returns true if the mass falls in a strong bin of the spectrum (see MSpectrum::kojakBits).
+bool MAnalysis::strongBin(MSpectrum* s, double mass) {
+  int b = (int)(mass * s->getInvBinSize() + params.binOffset);
+  if (b < 0 || (size_t)(b >> 5) >= s->kojakBits.size()) return false;
+  return (s->kojakBits[b >> 5] >> (b & 31)) & 1;
+}
+
+//Scores the unshifted (positive) fragment peaks of the current peptide against a spectrum, one
+//cumulative score per charge state. The closed and open searches of a spectrum share these
+//scores; set peakZ to 0 when moving to a new spectrum. Higher charges are added as needed.
+void MAnalysis::scoreUnshifted(MSpectrum* s, int maxZ, int iIndex){
+  sIPeakSet& pb = ions[iIndex].vPeaks;
+  sIPeakSet& py = ions[iIndex].vPeaksRev;
+  size_t nb = pb.peaks.size();
+  size_t n = nb + py.peaks.size();
+  vector<double>& v = peakScores[iIndex];
+
+  if (peakZ[iIndex] == 0 && v.size() < n * 3 + 1) v.resize(n * 3 + 1);
+  for (int z = peakZ[iIndex] + 1; z <= maxZ; z++) {
+    for (size_t a = 0; a < n; a++) {
+      sIPeak& pk = (a < nb) ? pb.peaks[a] : py.peaks[a - nb];
+      if (pk.mass < 0) continue;
+      double mz = (pk.mass + 1.007276466 * z) / z;
+      v[a * 3 + z - 1] = ((z == 1) ? 0 : v[a * 3 + z - 2]) + magnumScoring2(s, mz);
+    }
+  }
+  if (maxZ > peakZ[iIndex]) peakZ[iIndex] = maxZ;
+}
+
+//Adds the peak scores to the open search accumulators: unshifted peaks to base (one score per
+//variant), shifted peaks to preScore (pepCount scores per precursor). Either accumulator may
+//be NULL to skip that part of the peaks. Shifted peaks are only scored for the precursors
+//flagged in valid, and only added to the variants flagged for that precursor. The variants of a
+//shifted peak share a precursor mass, but the prefilter may clear the flags of some of them.
+void MAnalysis::score9(MSpectrum* s, sIPeakSet& peakSet, const double* pkScore, const unsigned int* valid, int* base, int* preScore, size_t pepCount, vector<sPrecursor>* pre, int iIndex){
+  for(size_t a=0;a<peakSet.peaks.size();a++){
+    sIPeak& pk = peakSet.peaks[a];
+    size_t* pep = &peakSet.pep[pk.first];
+    if (pk.mass > 0) {
+      if (base == NULL) continue;
+      int score = (int)pkScore[a * 3 + maxZ2[iIndex] - 1];
+      for (size_t b = 0; b < pk.count; b++) base[pep[b]] += score;
     } else {
-      //if two peptides have the same precursor mass, then scoring is repeated.
-      //TODO: see if we can avoid the repeat...
-      for(size_t b=0;b< peakSet[a].index.size();b++){
-        for (size_t c = 0; c < pre->size(); c++) {
-          double score = 0;
-          //if(echo) cout << a << " score9 b: " << peakSet[a].mass << " pep:"<< peakSet[a].index[b].pepMass << " pre: " << c << " becomes " << pre->at(c).monomass- peakSet[a].index[b].pepMass - peakSet[a].mass << endl;
-          for (int d = 1; d <= maxZ2[iIndex]; d++) {
-            double mz = (pre->at(c).monomass - peakSet[a].index[b].pepMass - peakSet[a].mass + 1.007276466 *d) /d;
-            if(mz<0) continue;
-            score += magnumScoring2(s, mz);
-          }
-          for (size_t d = 0; d < peakSet[a].index[b].pepIndex.size(); d++) {
-            //if (echo) cout << "Add " << score << " to " << peakSet[a].index[b].pepIndex[d] << endl;
-            ss[peakSet[a].index[b].pepIndex[d]].scoreP[c] += score;
-          }
+      if (preScore == NULL) continue;
+      unsigned int v = 0;
+      for (size_t d = 0; d < pk.count; d++) v |= valid[pep[d]];
+      for (size_t c = 0; v != 0 && c < pre->size(); c++) {
+        unsigned int bit = 1u << c;
+        if (!(v & bit)) continue;
+        int score = 0;
+        for (int d = 1; d <= maxZ2[iIndex]; d++) {
+          double mz = (pre->at(c).monomass - pk.pepMass - pk.mass + 1.007276466 *d) /d;
+          if(mz<0) continue;
+          score += magnumScoring2(s, mz);
+        }
+        int* ps = preScore + c*pepCount;
+        for (size_t d = 0; d < pk.count; d++) {
+          if (valid[pep[d]] & bit) ps[pep[d]] += score;
         }
       }
     }
   }
 }
 
-//TODO: Fix inefficiencies. Right now all precursor variations are scored, including those that are the wrong mass.
-void MAnalysis::score9solo(MSpectrum* s, vector<sIPeak>& peakSet, sScoreSet2* ss, int maxZ, int iIndex) {
-  for (size_t a = 0;a < peakSet.size();a++) {
-    double score = 0;
-    for (int b = 1; b <= maxZ; b++) {
-      double mz = (peakSet[a].mass + 1.007276466 * b) / b;
-      score += magnumScoring2(s, mz);
-    }
-    for (size_t b = 0; b < peakSet[a].index[0].pepIndex.size(); b++) {
-      ss[peakSet[a].index[0].pepIndex[b]].score += score;
-    }
+//Adds the unshifted peak scores at the given charge to each variant's closed search score.
+//Open modification and whole-sequence peaks are not part of the closed search.
+void MAnalysis::score9solo(sIPeakSet& peakSet, const double* pkScore, double* ss, int maxZ) {
+  for (size_t a = 0;a < peakSet.peaks.size();a++) {
+    sIPeak& pk = peakSet.peaks[a];
+    if (pk.mass < 0 || pk.full) continue;
+    size_t* pep = &peakSet.pep[pk.first];
+    double score = pkScore[a * 3 + maxZ - 1];
+    for (size_t b = 0; b < pk.count; b++) ss[pep[b]] += score;
   }
 }
 
@@ -855,113 +1584,113 @@ void MAnalysis::score9solo(MSpectrum* s, vector<sIPeak>& peakSet, sScoreSet2* ss
 //
 //}
 
-void MAnalysis::scoreSpectra2(vector<int>& index, double mass, int len, int pep1, int iIndex) {
-  unsigned int a;
+//Scores a group of variants of equal mass against one spectrum without open modifications.
+//The variant scores are computed once per spectrum (and precursor charge) and kept in
+//closedScores for the other mass groups that match the spectrum; set closedZ to 0 when
+//moving to a new spectrum.
+void MAnalysis::scoreSpectra2(int index, size_t* var, size_t count, int len, int pep1, int iIndex) {
   int ps;
   mScoreCard sc;
   mPrecursor* p = NULL;
   MTopPeps* tp = NULL;
-  MSpectrum* s=NULL;
-
-  //score spectra
-  for (a = 0; a < index.size(); a++) {
-    s=spec->getSpectrum(index[a]);
-
-    //find the specific precursor mass in this spectrum to identify the charge state
-    sPrecursor pre;
-    pre.index=-1;
-    for (int i = 0; i < s->sizePrecursor(); i++) {
-      p = s->getPrecursor2(i);
-      double ppm = (p->monoMass - mass) / mass * 1e6;
-      if (ppm<params.ppmPrecursor && ppm>-params.ppmPrecursor) {
-        pre.index=i;
-        pre.monomass=p->monoMass;
-        pre.maxZ = p->charge - 1;
-        if (pre.maxZ < 1) pre.maxZ = 1;
-        if (pre.maxZ > 3) pre.maxZ = 3;
-        tp = s->getTopPeps(i);
-        ps=i;
-        break;
-      }
-    }
+  MSpectrum* s=spec->getSpectrum(index);
+  double mass=ions[iIndex].pepMass[var[0]];
 
-    //bufSize2[iIndex] = sizeof(double);
-    size_t pepCount = ions[iIndex].pepCount;
-
-    //TODO: FIX TO ONLY SCORE AROUND ONCE
-    sScoreSet2* pScores = new sScoreSet2[pepCount];
-    sScoreSet2* pScores2 = new sScoreSet2[pepCount];
-    score9solo(s, ions[iIndex].vPeaks, pScores, pre.maxZ, iIndex);
-    score9solo(s, ions[iIndex].vPeaksRev, pScores2, pre.maxZ, iIndex);
-
-    vector<sDIndex> vTop;
-    size_t minMods = 100;
-    sc.simpleScore = 0;
-    for (size_t b = 0; b < pepCount; b++) {
-      double sumScore=pScores[b].score+pScores2[b].score;
-      if(ions[iIndex].pepMass[b]!=mass) continue;
-      if (sumScore<=0) continue;
-      if (sumScore > sc.simpleScore) {
-        sc.simpleScore = (float)sumScore;
-        vTop.clear();
-        sDIndex di;
-        di.a = b;
-        di.b = pre.index;
-        vTop.push_back(di);
-        minMods = ions[iIndex].pepMods[b].mods.size();
-      } else if (sumScore == sc.simpleScore) {
-        sDIndex di;
-        di.a = b;
-        di.b = pre.index;
-        vTop.push_back(di);
-        if (ions[iIndex].pepMods[b].mods.size() < minMods) minMods = ions[iIndex].pepMods[b].mods.size();
-      }
-    }
-    //cout << "simpleScore: " << sc.simpleScore << endl;
-    if (sc.simpleScore == 0) {
-      //peaks=NULL;
-      delete [] pScores;
-      delete[] pScores2;
-      continue;
+  //find the specific precursor mass in this spectrum to identify the charge state
+  sPrecursor pre;
+  pre.index=-1;
+  for (int i = 0; i < s->sizePrecursor(); i++) {
+    p = s->getPrecursor2(i);
+    double ppm = (p->monoMass - mass) / mass * 1e6;
+    if (ppm<params.ppmPrecursor && ppm>-params.ppmPrecursor) {
+      pre.index=i;
+      pre.monomass=p->monoMass;
+      pre.maxZ = p->charge - 1;
+      if (pre.maxZ < 1) pre.maxZ = 1;
+      if (pre.maxZ > 3) pre.maxZ = 3;
+      tp = s->getTopPeps(i);
+      ps=i;
+      break;
     }
+  }
 
-    sc.simpleScore *= 0.005;
-    double ev = 1000;
-    Threading::LockMutex(mutexSpecScore[index[a]]);
-    ev = spec->at(index[a]).computeE(sc.simpleScore, len);
-    Threading::UnlockMutex(mutexSpecScore[index[a]]);
-    
-    for (size_t b = 0; b < vTop.size(); b++) {
-      if (ions[iIndex].pepMods[vTop[b].a].mods.size() > minMods) continue; //skip modified peptides that are explained with fewer modifications
-      sc.eVal = ev;
-      sc.site = -1;
-      sc.mass = mass;
-      sc.massA = 0;
-      sc.pep = pep1;
-      sc.precursor = (char)pre.index;
-      sc.mods->clear();
-      for (size_t c = 0; c < ions[iIndex].pepMods[vTop[b].a].mods.size(); c++) {
-        sc.mods->push_back(ions[iIndex].pepMods[vTop[b].a][c]);
-      }
+  //optionally skip the spectrum if no variant can score high enough: each unshifted ion and
+  //charge state adds at most the largest bin value of the spectrum
+  if (params.scorePruning) {
+    pruneCount[iIndex].closed++;
+    vector<int> prec(1, ps);
+    int bound = 2 * (len - 1) * pre.maxZ * (s->kojakMax > 0 ? s->kojakMax : 0);
+    if (pruneSpectrum(s, index, bound, prec, len)) {
+      pruneCount[iIndex].closedPruned++;
+      return;
+    }
+  }
 
-      Threading::LockMutex(mutexSingletScore[index[a]][ps]);
-      tp->checkPeptideScore(sc);
-      Threading::UnlockMutex(mutexSingletScore[index[a]][ps]);
+  //score all variants of the peptide against this spectrum, unless already done
+  if (closedZ[iIndex] != pre.maxZ) {
+    vector<double>& v = closedScores[iIndex];
+    v.assign(ions[iIndex].pepCount, 0);
+    scoreUnshifted(s, pre.maxZ, iIndex);
+    score9solo(ions[iIndex].vPeaks, &peakScores[iIndex][0], &v[0], pre.maxZ);
+    score9solo(ions[iIndex].vPeaksRev, &peakScores[iIndex][ions[iIndex].vPeaks.peaks.size()*3], &v[0], pre.maxZ);
+    closedZ[iIndex] = pre.maxZ;
+  }
+  const double* pScores = &closedScores[iIndex][0];
 
-      Threading::LockMutex(mutexSpecScore[index[a]]);
-      spec->at(index[a]).checkScore(sc, iIndex);
-      Threading::UnlockMutex(mutexSpecScore[index[a]]);
+  vector<sDIndex> vTop;
+  size_t minMods = 100;
+  sc.simpleScore = 0;
+  for (size_t a = 0; a < count; a++) {
+    size_t b = var[a];
+    double sumScore=pScores[b];
+    if (sumScore<=0) continue;
+    if (sumScore > sc.simpleScore) {
+      sc.simpleScore = (float)sumScore;
+      vTop.clear();
+      sDIndex di;
+      di.a = b;
+      di.b = pre.index;
+      vTop.push_back(di);
+      minMods = ions[iIndex].pepModCount[b];
+    } else if (sumScore == sc.simpleScore) {
+      sDIndex di;
+      di.a = b;
+      di.b = pre.index;
+      vTop.push_back(di);
+      if (ions[iIndex].pepModCount[b] < minMods) minMods = ions[iIndex].pepModCount[b];
     }
-    
-    delete[] pScores;
-    delete[] pScores2;
-    //peaks=NULL;
+  }
+  //cout << "simpleScore: " << sc.simpleScore << endl;
+  if (sc.simpleScore == 0) return;
+
+  sc.simpleScore *= 0.005;
+  double ev = 1000;
+  Threading::LockMutex(mutexSpecScore[index]);
+  ev = s->computeE(sc.simpleScore, len);
+  Threading::UnlockMutex(mutexSpecScore[index]);
+
+  for (size_t b = 0; b < vTop.size(); b++) {
+    if (ions[iIndex].pepModCount[vTop[b].a] > minMods) continue; //skip modified peptides that are explained with fewer modifications
+    sc.eVal = ev;
+    sc.site = -1;
+    sc.mass = mass;
+    sc.massA = 0;
+    sc.pep = pep1;
+    sc.precursor = (char)pre.index;
+    ions[iIndex].getVariantMods(vTop[b].a, *sc.mods);
+
+    Threading::LockMutex(mutexSingletScore[index][ps]);
+    tp->checkPeptideScore(sc);
+    Threading::UnlockMutex(mutexSingletScore[index][ps]);
+
+    Threading::LockMutex(mutexSpecScore[index]);
+    s->checkScore(sc, iIndex);
+    Threading::UnlockMutex(mutexSpecScore[index]);
   }
 
   p = NULL;
   tp = NULL;
   s=NULL;
-
 }
 
 //An alternative score uses the XCorr metric from the Comet algorithm
@@ -1110,6 +1839,21 @@ char MAnalysis::magnumScoring2(MSpectrum* s, double mass) {
 /*============================
   Utilities
 ============================*/
+bool MAnalysis::compareAdductHit(const mAdductHit& a, const mAdductHit& b){
+  return a.massA<b.massA;
+}
+
+bool MAnalysis::compareDIndex(const sDIndex& a, const sDIndex& b){
+  if(a.a!=b.a) return a.a<b.a;
+  return a.b<b.b;
+}
+
+bool MAnalysis::comparePepOrder(const mPepOrder& a, const mPepOrder& b){
+  if(a.protein!=b.protein) return a.protein<b.protein;
+  if(a.start!=b.start) return a.start<b.start;
+  return a.stop<b.stop;
+}
+
 int MAnalysis::compareD(const void *p1, const void *p2){
   const double d1 = *(double *)p1;
   const double d2 = *(double *)p2;
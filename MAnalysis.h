@@ -24,6 +24,10 @@ limitations under the License.
 #include "ThreadPool.h"
 #include "CometDecoys.h"
 
+//With checkpoints, the peptide list is searched in this many blocks, with the search state saved
+//between blocks when a checkpoint is due
+#define CHECKPOINT_BLOCKS 100
+
 //=============================
 // Structures for threading
 //=============================
@@ -32,10 +36,14 @@ struct mAnalysisStruct {
   Mutex*      mutex;        //Pointer to a mutex for protecting memory
   mPeptide*   pep;
   int         pepIndex;
-  mAnalysisStruct(Mutex* m, mPeptide* p, int i){
+  int*        order;        //if not NULL, the job is count peptide indexes from this list
+  int         count;
+  mAnalysisStruct(Mutex* m, mPeptide* p, int i, int* o=NULL, int c=1){
     mutex=m;
     pep=p;
     pepIndex=i;
+    order=o;
+    count=c;
   }
   ~mAnalysisStruct(){
     //Mark that memory is not being used, but do not delete it here.
@@ -45,9 +53,41 @@ struct mAnalysisStruct {
     Threading::UnlockMutex(*mutex);
     mutex=NULL;   //release mutex
     pep=NULL;
+    order=NULL;
   }
 };
 
+//Spectrum candidates checked and skipped by the score upper-bound pruning, per thread
+typedef struct mPruneCount {
+  size_t closed=0;
+  size_t closedPruned=0;
+  size_t open=0;
+  size_t openPruned=0;
+} mPruneCount;
+
+//Open search prefilter counters, per thread
+typedef struct mPrefilterCount {
+  size_t spectra=0;   //spectrum candidates with more than K variants
+  size_t variants=0;  //candidate variants in those spectra
+  size_t kept=0;      //variants passed on to full scoring
+  size_t recall=0;    //filtered candidates with a positive exhaustive score (recall mode)
+  size_t recallHit=0; //of those, candidates that kept their best exhaustive score
+} mPrefilterCount;
+
+//Adduct mass of a first pass hit in the adaptive open search
+typedef struct mAdductHit {
+  double massA;
+  double tol;   //precursor tolerance of the hit, in Da
+} mAdductHit;
+
+//Peptide position in its (first) protein, for searching peptides in protein order
+typedef struct mPepOrder {
+  int protein;
+  int start;
+  int stop;
+  int pep;
+} mPepOrder;
+
 class MAnalysis{
 public:
 
@@ -70,8 +110,24 @@ private:
 
   //Private Functions
   bool         allocateMemory          (int threads);
-  static bool  analyzeSinglets         (mPeptide& pep, int index, int iIndex);
+  static double adductPPM              (size_t i);
+  static bool  checkAdduct             (double preMass, double pepMass);
+  static bool  findAdductPeaks         ();
+  static bool  getAdductSpectra        (std::vector<int>& scanIndex, double& minMass, double& maxMass, int iIndex);
+  static bool  getSingletSpectra       (std::vector<int>& scanIndex, double& minMass, double& maxMass, int iIndex);
+  static bool  selectSingletVariants   (std::vector<int>& scanIndex, double minMass, double maxMass, int iIndex);
   static void  checkXLMotif            (int motifA, char* motifB, std::vector<int>& v);
+  static void  filterSpectra           (std::vector<int>& index);
+  bool         searchPeptides          ();
+  bool         searchPeptideRange      (size_t lo, size_t hi, bool bMeter=true);
+  bool         searchStaged            ();
+  bool         recalibrate             ();
+  void         saveCheckpoint          (size_t cursor);
+  void         copyClusterResults      ();
+  static bool  prefilterVariants       (MSpectrum* s, int iIndex);
+  static bool  pruneSpectrum           (MSpectrum* s, int index, int bound, std::vector<int>& prec, int len);
+  static bool  scoreOpenVariants       (MSpectrum* s, int index, std::vector<sPrecursor>& pre, int len, int iIndex, bool bPrune);
+  static bool  strongBin               (MSpectrum* s, double mass);
   void         deallocateMemory        (int threads);
   //static void  scoreSingletSpectra     (int index, int sIndex, double mass, int len, int pep, char k, double minMass, double maxMass, int iIndex, bool bSiteless=false);
   //static void  scoreSpectra            (std::vector<int>& index, int sIndex, int len, double modMass, int pep1, int pep2, int k1, int k2, int link, int iIndex);
@@ -113,20 +169,40 @@ private:
   static int dummyM[10];
   static int* maxZ2;
   static size_t* bufSize2;
+  static std::vector<double>* peakScores; //unshifted fragment scores of the current spectrum, by charge
+  static int* peakZ;                      //highest charge scored in peakScores
+  static std::vector<double>* closedScores; //closed search score of each variant for the current spectrum
+  static int* closedZ;                      //precursor charge of closedScores; 0 if not scored
+  static std::vector<unsigned int>* preValid; //per variant, bit flags of the precursors within the adduct bounds
+  static std::vector<int>* openScores;        //open search score accumulators of the current spectrum
+  static std::vector<int>* openBest;          //best precursor score and index of each variant
+  static mPruneCount* pruneCount;
+  static std::vector<int>* prefilterShared;   //shared strong bin counts of the prefilter
+  static mPrefilterCount* prefilterCount;
+  static int sampleStride;                    //search only every Nth spectrum (adaptive first pass)
+  static int searchStage;                     //0=closed and open search, 1=closed only, 2=open only
+  static std::vector<bool> explained;         //spectra with a confident closed hit, skipped in stage 2
+  static bool bCheckpoint;                    //save checkpoints during the current search
+  static bool bResume;                        //the current search continues from the checkpoint of spec
+  static time_t checkpointTime;               //time of the last checkpoint
   static char magnumScoring2(MSpectrum* s, double mass);
   static void scoreSingletSpectra2(int index, double mass, int len, int pep, double minMass, double maxMass, int iIndex);
-  static void scoreSpectra2(std::vector<int>& index, double mass, int len, int pep1, int iIndex);
+  static void scoreSpectra2(int index, size_t* var, size_t count, int len, int pep1, int iIndex);
+  static void scoreUnshifted(MSpectrum* s, int maxZ, int iIndex);
   //static void score6(MSpectrum* s, sNode2* node, sLink2* link, double* score, double* scoreNL, int depth, sScoreSet* v, std::vector<sPrecursor>* pre, int iIndex/*, double minMass, double maxMass*/);
   //static void score7(MSpectrum* s, std::vector<sNode2>* peakSet, sNode2* node, sLink2* link, double* score, double* scoreNL, int depth, sScoreSet* v, std::vector<sPrecursor>* pre, int iIndex/*, double minMass, double maxMass*/);
   //static void score8(MSpectrum* s, std::vector<sNode2>* peakSet, sNode2* node, sLink2* link, sScoreSet* v, std::vector<sPrecursor>* pre, int iIndex);
   //static void score6solo(MSpectrum* s, sNode2* node, sLink2* link, double* score, double* scoreNL, sScoreSet* v, sPrecursor& pre, int iIndex, double maxMass);
   //static void score7solo(MSpectrum* s, std::vector<sNode2>* peakSet, sNode2* node, sLink2* link, double* score, double* scoreNL, sScoreSet* v, sPrecursor& pre, int iIndex, double maxMass);
-  static void score9(MSpectrum* s, std::vector<sIPeak>& peakSet, sScoreSet2* score, std::vector<sPrecursor>* pre, int iIndex);
-  static void score9solo(MSpectrum* s, std::vector<sIPeak>& peakSet, sScoreSet2* score, int maxZ, int iIndex);
+  static void score9(MSpectrum* s, sIPeakSet& peakSet, const double* pkScore, const unsigned int* valid, int* base, int* preScore, size_t pepCount, std::vector<sPrecursor>* pre, int iIndex);
+  static void score9solo(sIPeakSet& peakSet, const double* pkScore, double* score, int maxZ);
   //static void score7(MSpectrum* s, sNode2* node, sLink2* link, double* score, double* scoreNL, int* match, int* matchNL, int depth, sScoreSet* v, std::vector<sPrecursor>* pre, int iIndex, int maxZ, size_t bufSize, size_t bufSizeM/*, double minMass, double maxMass*/);
 
   //Utilities
   static int compareD           (const void *p1,const void *p2);
+  static bool compareAdductHit  (const mAdductHit& a, const mAdductHit& b);
+  static bool compareDIndex     (const sDIndex& a, const sDIndex& b);
+  static bool comparePepOrder   (const mPepOrder& a, const mPepOrder& b);
 
   
 };
@@ -15,6 +15,14 @@ limitations under the License.
 */
 
 #include "MDB.h"
+#include "ThreadPool.h"
+#include <zlib.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 
@@ -50,6 +58,16 @@ MDatabase::MDatabase(){
   fixMassProtC=0;
   fixMassProtN=0;
   adductPepCount=0;
+  pepTotal=0;
+  streamBlock=0;
+  streamNext=0;
+  keptCount=0;
+  digestMin=0;
+  digestMax=0;
+  digestMis=0;
+  digestMinP=0;
+  digestMaxP=0;
+  digestThreads=1;
 
   for(int i=0;i<100;i++) minMass[i]=1e6;
 
@@ -62,86 +80,226 @@ MDatabase::~MDatabase(){
 //==============================
 //  Operators
 //==============================
-mDB& MDatabase::operator[ ](const int& i){
-  return vDB[i];
+mProtein MDatabase::operator[ ](const int& i){
+  return getProtein(i);
 }
 
 //==============================
 //  User Functions
 //==============================
 
-//buildDB reads in a FASTA file and stores it in memory.
-bool  MDatabase::buildDB(const char* fname, string decoyStr, string entrapmentStr) {
-  char    str[10240];
-  char*   tok;
-  FILE*   f;
-  mDB    d;
-  char   c;
-
-  d.name="NIL";
+//buildDB reads in a FASTA file and stores it in memory. The file is memory-mapped and split into
+//spans on record boundaries, and the spans are parsed in parallel. A gzipped file is decompressed in
+//blocks instead; each run of whole records is parsed while the next block is decompressed, so the
+//whole file is never held in memory. Residues from every span are then packed into a single
+//sequence arena in file order.
+bool  MDatabase::buildDB(const char* fname, string decoyStr, string entrapmentStr, int threads) {
+  size_t i,j;
+  size_t fSize=0;
+  char*  buf=NULL;
+  vector<char> vBuf;
+  bool   bMapped=false;
+  bool   bOK=true;
+  vector<mFastaChunk*> chunks;
+  mFastaChunk* c;
 
   vDB.clear();
-  f=fopen(fname,"rt");
-  if(f==NULL) return false;
-  while(!feof(f)){
-    if(fgets(str,10240,f)==NULL) continue;
-    if(strlen(str)>0){
-      tok=strtok(str,"\r\n");
-      if(tok==NULL) continue;
-      strcpy(str,tok);
-    }
-    if(str[0]=='>') {
-      if(d.name.compare("NIL")!=0) {
-        if(d.sequence.length()>65000){
-          if (mlog != NULL) mlog->addDBWarning(d.name + " has a sequence that is too long. It will be skipped.");
-          else cout << "  WARNING: " << &d.name[0] << " has a sequence that is too long. It will be skipped." << endl;
-        } else {
-          if (d.name.find(decoyStr) != string::npos) d.decoy = true;
-          else d.decoy = false;
-          vDB.push_back(d);
-        }
+  vHdr.clear();
+  vSeq.clear();
+
+  //Lookup tables replace the per-residue toupper and mass checks
+  char resTable[256];
+  char resKeep[256];
+  char resWarn[256];
+  for(i=0;i<256;i++){
+    resTable[i]=(char)toupper((int)i);
+    resKeep[i]=1;
+    if(i<128) resWarn[i]=(AA[toupper((int)i)]==0);
+    else resWarn[i]=1;
+  }
+  resKeep['\n']=resKeep['\r']=0;
+  resWarn['\n']=resWarn['\r']=0;
+  resKeep[' ']=resKeep['\t']=resKeep[0]=0;
+
+  if(threads<1) threads=1;
+  size_t len=strlen(fname);
+  if(len>3 && strcmp(fname+len-3,".gz")==0){
+    gzFile gz=gzopen(fname,"rb");
+    if(gz==NULL) return false;
+    gzbuffer(gz,1<<20);
+
+    //Hand each block, up to the last record that begins in it, to the parsing threads. The rest
+    //of the block is carried over to the next one.
+    ThreadPool<mFastaChunk*>* threadPool = new ThreadPool<mFastaChunk*>(parseFastaChunk, threads, threads, 1);
+    vector<char> carry;
+    int n;
+    do {
+      size_t sz=carry.size();
+      carry.resize(sz+(1<<22));
+      n=gzread(gz,&carry[sz],1<<22);
+      if(n<0){
+        bOK=false;
+        break;
       }
-      string st=&str[1];
-      size_t sp=st.find_first_of(' ');
-      d.name=st.substr(0,sp);
-      d.description=st.substr(sp+1,st.size());
-      d.sequence="";
-    } else {
-      for(unsigned int i=0;i<strlen(str);i++){
-        c=toupper(str[i]);
-        if(AA[c]==0) {
-          if (mlog != NULL) mlog->addDBWarning(d.name + " has an unexpected amino acid character or errant white space: '" + c + "'");
-          else cout << "  WARNING: " << &d.name[0] << " has an unexpected amino acid character or errant white space: '" << c << "'" << endl;
-        }
-        if(c==' ' || c=='\t') continue;
-        if (AA[c] == 0) {
-          if (mlog != NULL) {
-            string tmpStr = "Mass of '";
-            mlog->addDBWarning(tmpStr + c + "' is currently set to 0. Consider revising with the aa_mass parameter.");
-          } else cout << "  WARNING: Mass of '" << c << "' is currently set to 0. Consider revising with the aa_mass parameter." << endl;
+      carry.resize(sz+n);
+      size_t cut=carry.size();
+      if(n>0){
+        cut=0;
+        for(j=carry.size()-1;j>0;j--){
+          if(carry[j]=='>' && carry[j-1]=='\n'){
+            cut=j;
+            break;
+          }
         }
-        d.sequence+=c;
       }
+      if(cut==0) continue;
+      c=new mFastaChunk;
+      c->resTable=resTable;
+      c->resKeep=resKeep;
+      c->resWarn=resWarn;
+      c->decoyStr=&decoyStr;
+      c->text.swap(carry);
+      carry.assign(c->text.begin()+cut,c->text.end());
+      c->text.resize(cut);
+      c->start=&c->text[0];
+      c->stop=c->start+cut;
+      chunks.push_back(c);
+      threadPool->WaitForQueuedParams();
+      threadPool->Launch(c);
+    } while(n>0);
+    gzclose(gz);
+    threadPool->WaitForQueuedParams();
+    threadPool->WaitForThreads();
+    delete threadPool;
+    threadPool=NULL;
+  } else {
+    //Bring the entire file into addressable memory
+#ifdef _WIN32
+    FILE* f=fopen(fname,"rb");
+    if(f==NULL) return false;
+    _fseeki64(f,0,SEEK_END);
+    fSize=(size_t)_ftelli64(f);
+    _fseeki64(f,0,SEEK_SET);
+    vBuf.resize(fSize);
+    if(fSize>0) fSize=fread(&vBuf[0],1,fSize,f);
+    fclose(f);
+    if(fSize>0) buf=&vBuf[0];
+#else
+    int fd=open(fname,O_RDONLY);
+    if(fd<0) return false;
+    struct stat st;
+    if(fstat(fd,&st)!=0){
+      close(fd);
+      return false;
+    }
+    fSize=(size_t)st.st_size;
+    if(fSize>0){
+      void* m=mmap(NULL,fSize,PROT_READ,MAP_PRIVATE,fd,0);
+      if(m==MAP_FAILED){
+        close(fd);
+        return false;
+      }
+      madvise(m,fSize,MADV_SEQUENTIAL);
+      buf=(char*)m;
+      bMapped=true;
     }
+    close(fd);
+#endif
+
+    //Split the file into spans that each begin with a FASTA header
+    size_t chunkCount=(size_t)threads*4;
+    if(fSize/chunkCount < (1<<20)) chunkCount=fSize/(1<<20)+1;
+    size_t pos=0;
+    for(i=0;i<chunkCount;i++){
+      c=new mFastaChunk;
+      c->resTable=resTable;
+      c->resKeep=resKeep;
+      c->resWarn=resWarn;
+      c->decoyStr=&decoyStr;
+      c->start=buf+pos;
+      size_t next=fSize*(i+1)/chunkCount;
+      if(next<pos) next=pos;
+      while(next<fSize && !(buf[next]=='>' && buf[next-1]=='\n')){
+        const char* q=(const char*)memchr(buf+next,'\n',fSize-next);
+        if(q==NULL) next=fSize;
+        else next=q-buf+1;
+      }
+      if(i==chunkCount-1) next=fSize;
+      c->stop=buf+next;
+      chunks.push_back(c);
+      pos=next;
+    }
+
+    ThreadPool<mFastaChunk*>* threadPool = new ThreadPool<mFastaChunk*>(parseFastaChunk, threads, threads, 1);
+    for(i=0;i<chunks.size();i++){
+      threadPool->WaitForQueuedParams();
+      threadPool->Launch(chunks[i]);
+    }
+    threadPool->WaitForQueuedParams();
+    threadPool->WaitForThreads();
+    delete threadPool;
+    threadPool=NULL;
+
+#ifndef _WIN32
+    if(bMapped) munmap(buf,fSize);
+#endif
+    vector<char>().swap(vBuf);
   }
-  fclose(f);
-  if(d.sequence.length()>SIZE_MAX){
-    if (mlog != NULL) mlog->addDBWarning(d.name + " has a sequence that is too long. It will be skipped.");
-    else cout << "  WARNING: " << &d.name[0] << " has a sequence that is too long. It will be skipped." << endl;
+
+  if(!bOK){
+    for(i=0;i<chunks.size();i++) delete chunks[i];
+    return false;
+  }
+
+  //Pack all spans into the sequence arena, in file order
+  size_t total=0;
+  size_t totalHdr=0;
+  size_t protCount=0;
+  for(i=0;i<chunks.size();i++) {
+    total+=chunks[i]->seq.size();
+    totalHdr+=chunks[i]->hdr.size();
+    protCount+=chunks[i]->prot.size();
+  }
+  vDB.reserve(protCount);
+  if(chunks.size()==1) {
+    vSeq.swap(chunks[0]->seq);
+    vHdr.swap(chunks[0]->hdr);
   } else {
-    if (d.name.find(decoyStr) != string::npos) d.decoy = true;
-    else d.decoy = false;
-    vDB.push_back(d);
+    vSeq.reserve(total);
+    vHdr.reserve(totalHdr);
+  }
+  for(i=0;i<chunks.size();i++){
+    for(j=0;j<chunks[i]->warnings.size();j++){
+      if (mlog != NULL) mlog->addDBWarning(chunks[i]->warnings[j]);
+      else cout << "  WARNING: " << chunks[i]->warnings[j] << endl;
+    }
+    size_t offset=0;
+    size_t offsetHdr=0;
+    if(chunks.size()>1){
+      offset=vSeq.size();
+      offsetHdr=vHdr.size();
+      vSeq.insert(vSeq.end(),chunks[i]->seq.begin(),chunks[i]->seq.end());
+      vHdr.insert(vHdr.end(),chunks[i]->hdr.begin(),chunks[i]->hdr.end());
+      vector<char>().swap(chunks[i]->seq);
+      vector<char>().swap(chunks[i]->hdr);
+    }
+    for(j=0;j<chunks[i]->prot.size();j++){
+      vDB.push_back(chunks[i]->prot[j]);
+      vDB.back().seqOffset+=offset;
+      vDB.back().nameOffset+=offsetHdr;
+      vDB.back().descOffset+=offsetHdr;
+    }
+    delete chunks[i];
   }
 
   cout << "  Total Proteins: " << vDB.size() << endl;
   return true;
 }
 
-//Builds decoys on the fly from sequences in the search space. Decoys are sequences reversed in place between
-//enzyme cut points. If the sequence is palindromic, a minor attempt at creating a novel sequence is made.
-void MDatabase::buildDecoy(string decoy_label) {
-  addShuffledTargets(decoy_label);
+//Builds decoys on the fly from sequences in the search space. Decoys are shuffled copies of each sequence,
+//held as virtual records and only materialized when their residues are needed.
+void MDatabase::buildDecoy(string decoy_label, uint64_t seed) {
+  addShuffledTargets(decoy_label, seed);
 
   cout << "  Adding Magnum-generated " + decoy_label + "s. New Total Proteins: " << vDB.size() << endl;
 }
@@ -156,274 +314,60 @@ void MDatabase::buildEntrapment(string entrapment_label)
   cout << "  Adding Magnum-generated " + entrapment_label + "s. New Total Proteins: " << vDB.size() << endl;
 }
 
+//Adds an entrapment record for every protein. Residues are not stored; they are produced on demand
+//by reversing the source sequence between enzyme cut sites (see reverseSequence).
 void MDatabase::addReversedTargets(string label) {
-  typedef struct clips {
-    int start;
-    int stop;
-  } clips;
-
-  size_t i, j, sz;
-  vector<clips> cut;
-  clips c;
-
-  sz = vDB.size();
-  char alter = '0';
-  for (i = 0; i < sz; i++) {
-
-    cut.clear();
-    c.start = -1;
-    for (j = 1; j < vDB[i].sequence.size(); j++) {
-      if (enzyme.cutN[vDB[i].sequence[j]] || enzyme.cutC[vDB[i].sequence[j]]) {
-        if (c.start > -1) { //mark the space in between
-          c.stop = (int)j - 1;
-          cut.push_back(c);
-          c.start = -1; //reset
-        }
-      } else {
-        if (c.start < 0) c.start = (int)j;
-      }
-    }
-    if (!enzyme.cutN[vDB[i].sequence[j - 1]] && !enzyme.cutC[vDB[i].sequence[j - 1]]) { //check last amino acid
-      c.stop = (int)j - 1;
-      cut.push_back(c);
-    }
-
-    //reverse the sequences
-    string rev;
+  size_t sz = vDB.size();
+  vDB.reserve(sz*2);
+  for (size_t i = 0; i < sz; i++) {
     mDB reversed = vDB[i];
-    reversed.name = label + "_" + reversed.name;
-    for (j = 0; j < cut.size(); j++) {
-      rev.clear();
-
-      //adjust ends for restrictive sites
-      while (enzyme.exceptN[reversed.sequence[cut[j].start]] || enzyme.exceptC[reversed.sequence[cut[j].start]]) {
-        cut[j].start++;
-        if (cut[j].start == reversed.sequence.size()) break;
-      }
-      while (enzyme.exceptN[reversed.sequence[cut[j].stop]] || enzyme.exceptC[reversed.sequence[cut[j].stop]]) {
-        cut[j].stop--;
-        if (cut[j].stop == -1) break;
-      }
-      if (cut[j].start == reversed.sequence.size()) continue; //skip when out of bounds
-      if (cut[j].stop == -1) continue; //skip when out of bounds
-      if (cut[j].stop <= cut[j].start) continue; //skip if nothing will happen
-
-      for (size_t k = cut[j].stop; k >= cut[j].start; k--) {
-        rev += reversed.sequence[k];
-        if (k == 0) break;
-      }
-      if (rev.size() > 2 && rev.compare(reversed.sequence.substr(cut[j].start, (size_t)cut[j].stop - (size_t)cut[j].start + 1)) == 0) { //edge case of palindrome sequence
-        char c = rev[0];
-        rev[0] = rev[rev.size() / 2];
-        rev[rev.size() / 2] = c; //just swap the first and middle characters, see if that breaks up the palindrome
-      }
-      reversed.sequence.replace(cut[j].start, (size_t)cut[j].stop - (size_t)cut[j].start + 1, rev);
-    }
-
+    reversed.nameOffset = appendHeader(label + "_" + getName((int)i));
+    reversed.source = (int)i;
+    reversed.transform = 'r';
+    reversed.seed = 0;
     vDB.push_back(reversed);
   }
 }
 
-void MDatabase::addShuffledTargets(string label) {
+//Adds a decoy record for every protein. Residues are produced on demand by shuffling the source
+//sequence with a generator seeded from the decoy name and the run seed, so every decoy is reproducible
+//on its own, independent of generation order or thread count.
+void MDatabase::addShuffledTargets(string label, uint64_t seed) {
   size_t sz = vDB.size();
+  vDB.reserve(sz*2);
   for (size_t i = 0; i < sz; i++) {
     mDB shuffled = vDB[i];
-    shuffled.name = label + "_" + shuffled.name;
-    string seq = shuffled.sequence;
-    size_t n = seq.length();
-
-    // Fisher-Yates shuffle algorithm
-    for (size_t j = n - 1; j > 0; j--) {
-      // Pick a random index from 0 to j (inclusive)
-      size_t k = rand() % (j + 1);
-
-      // Swap sequence[j] with sequence[k]
-      swap(seq[j], seq[k]);
-    }
-
-    shuffled.sequence = seq;
+    shuffled.nameOffset = appendHeader(label + "_" + getName((int)i));
+    shuffled.source = (int)i;
+    shuffled.transform = 's';
+    shuffled.seed = hashName(&vHdr[shuffled.nameOffset]) ^ (seed * 0x9E3779B97F4A7C15ULL);
     vDB.push_back(shuffled);
   }
 }
 
 //buildPeptides creates lists of peptides to search based on the user-defined enzyme rules
-bool MDatabase::buildPeptides(double min, double max, int mis,int minP, int maxP){
-
-  double mass;
-  bool bCutMarked;
-  bool bNTerm;
-  bool bCTerm;
-
-  int mc;
-  int next;
-
-  char xlSites;
+bool MDatabase::buildPeptides(double min, double max, int mis,int minP, int maxP, int threads){
 
-  mPepMap  pm;
-  mPeptide p;
-  
-  size_t DBSize=vDB.size();
   size_t i;
-  size_t k;
   size_t n;
-  size_t seqSize;
-  size_t start;
-
-  vPep.clear();
-
-  for(i=0;i<DBSize;i++){
-    seqSize=vDB[i].sequence.size();
-    start=0;
-    n=0;
-    k=0;
-    mc=0;
-    mass=18.0105633+fixMassPepN+fixMassProtN;
-    if(vDB[i].sequence[0]=='M') next=0; //allow for next start site to be amino acid after initial M.
-    else next = -1;
-
-    pm.index=(int)i;
-    bNTerm=false;
-    bCTerm=false;
-    if(adductSites['$'] || adductSites['%']) xlSites=1;
-    else xlSites=0;
-
-    while(true){
-
-      bCutMarked=false;
-
-      //Check if we cut n-terminal to this AA
-      if(n>0 && enzyme.cutN[vDB[i].sequence[start+n]] && !enzyme.exceptC[vDB[i].sequence[start+n-1]]){
-        if(next==-1) next=(int)start+(int)n-1;
-        if(!bCutMarked) mc++;
-        bCutMarked=true;
-
-        //Add the peptide now (if enough mass and length)
-        if ((mass+fixMassPepC)>min && n>=(minP-1)) addPeptide((int)i, (int)start, (int)n - 1, mass+fixMassPepC, p, vPep, bNTerm, bCTerm, xlSites);
-
-      }
-
-      //Add the peptide mass
-      mass+=AA[vDB[i].sequence[start+n]];
-
-      //Check if we cut c-terminal to this AA
-      if((start+n+1)<seqSize && enzyme.cutC[vDB[i].sequence[start+n]] && !enzyme.exceptN[vDB[i].sequence[start+n+1]]){
-        if(next==-1) next=(int)(start+n);
-        if(!bCutMarked) mc++;
-        bCutMarked=true;
-
-        //Add the peptide now (if enough mass)
-        if ((mass + fixMassPepC)>min && (mass + fixMassPepC)<max && n >= (minP - 1) ) addPeptide((int)i, (int)start, (int)n, mass + fixMassPepC, p, vPep, bNTerm, bCTerm, xlSites);
 
-      }
-
-      //Mark sites of adduct formation
-      if(checkAA(i,start,n,seqSize,bNTerm,bCTerm)) xlSites++;
-
-      //Check if we are at the end of the sequence
-      if((start+n+1)==seqSize) {
-
-        //Add the peptide now (if enough mass)
-        if ((mass + fixMassPepC + fixMassProtC)>min && (mass + fixMassPepC + fixMassProtC)<max && n >= (minP - 1) )addPeptide((int)i, (int)start, (int)n, mass + fixMassPepC + fixMassProtC, p, vPep, bNTerm, bCTerm, xlSites);
-        if(next>-1) {
-          start=next+1;
-          n=0;
-          mc=0;
-          mass=18.0105633+fixMassPepN;
-          bNTerm = false;
-          bCTerm = false;
-          if (adductSites['$'] || adductSites['%']) xlSites = 1;
-          else xlSites = 0;
-          next=-1;
-          continue;
-        } else {
-          break;
-        }
-
-      }
+  digestMin=min;
+  digestMax=max;
+  digestMis=mis;
+  digestMinP=minP;
+  digestMaxP=maxP;
+  digestThreads=threads;
 
-      //Check if we exceeded peptide mass
-      //Check if we exceeded the number of missed cleavages
-      //Check if we exceeded peptide length
-      if((mass+fixMassPepC)>max || mc>mis || n>=(maxP-1)) {
-
-        //if we know next cut site
-        if(next>-1) {
-          start=next+1;
-          n=0;
-          mc=0;
-          mass=18.0105633+fixMassPepN;
-          bNTerm = false;
-          bCTerm = false;
-          if (adductSites['$'] || adductSites['%']) xlSites = 1;
-          else xlSites = 0;
-          next=-1;
-
-        //Otherwise, continue scanning until it is found
-        } else {
-          while((start+n)<seqSize-1){
-            n++;
-            if(n>0 && enzyme.cutN[vDB[i].sequence[start+n]] && !enzyme.exceptC[vDB[i].sequence[start+n-1]]){
-              next=(int)(start+n);
-              break;
-            } else if((start+n+1)<seqSize && enzyme.cutC[vDB[i].sequence[start+n]] && !enzyme.exceptN[vDB[i].sequence[start+n+1]]){
-              next=(int)(start+n);
-              break;
-            } 
-          }
-          if(next<0) break;
-
-          start=next+1;
-          n=0;
-          mc=0;
-          mass=18.0105633+fixMassPepN;
-          bNTerm = false;
-          bCTerm = false;
-          if (adductSites['$'] || adductSites['%']) xlSites = 1;
-          else xlSites = 0;
-          next=-1;
-        }  
-      } else {
-        n++;
-        continue;
-      }
-
-    }
-
-  }
-
-  //merge duplicates
-  mPepSort ps;
-  ps.index=0;
-  ps.sequence.clear();
-  vector<mPepSort> vPS;
-  for(i=0;i<vPep.size();i++){
-    ps.index=(int)i;
-    getPeptideSeq(vPep[i].map->at(0).index,vPep[i].map->at(0).start,vPep[i].map->at(0).stop,ps.sequence);
-    vPS.push_back(ps);
-  }
-  //qsort(&vPS[0],vPS.size(),sizeof(kPepSort),compareSequence);
-  sort(vPS.begin(),vPS.end(),compareSequenceB);
-
-  vector<mPeptide> vtp;
-  for(i=vPS.size()-1;i>0;i--){
-    if(vPS[i].sequence.compare(vPS[i-1].sequence)==0){
-      for(k=0;k<vPep[vPS[i].index].map->size();k++){
-        vPep[vPS[i-1].index].map->push_back(vPep[vPS[i].index].map->at(k));
-        if (vPep[vPS[i].index].cTerm) vPep[vPS[i - 1].index].cTerm = vPep[vPS[i].index].cTerm;
-        if (vPep[vPS[i].index].nTerm) vPep[vPS[i - 1].index].nTerm = vPep[vPS[i].index].nTerm;
-        if (vPep[vPS[i].index].xlSites>vPep[vPS[i - 1].index].xlSites) vPep[vPS[i - 1].index].xlSites = vPep[vPS[i].index].xlSites;
-      }
-      vPep[vPS[i].index].mass=-1;
-    }
-  }
-  for(i=0;i<vPep.size();i++){
-    if(vPep[i].mass>0) vtp.push_back(vPep[i]);
-  }
   vPep.clear();
+  vPepSeq.clear();
+  vPepSeqOffset.clear();
+  if(streamBlock>0) return buildPeptideHash();
+
+  digestRange(0,vDB.size(),vPep);
+  mergePeptides(vPep,NULL,true);
   n=0;
-  for(i=0;i<vtp.size();i++) {
-    if (vtp[i].xlSites>0)n++;
-    vPep.push_back(vtp[i]);
+  for(i=0;i<vPep.size();i++) {
+    if (vPep[i].xlSites>0)n++;
   }
 
   //For determining boundaries of E-value precalculations based on peptide length
@@ -452,12 +396,192 @@ bool MDatabase::buildPeptides(double min, double max, int mis,int minP, int maxP
 
 }
 
+//Streamed database: digests every block of proteins once to collect the unique peptide
+//sequences (by hash), the block where each is first seen, their flags merged over all
+//occurrences, and the mass boundaries of the E-value precalculations. Only this hash list is
+//kept; the peptides themselves are digested again, block by block, during the search.
+bool MDatabase::buildPeptideHash(){
+  size_t i,j,k,m,r;
+  size_t n;
+  vector<mPeptide> v;
+  vector<uint64_t> h;
+  mPepHash ph;
+
+  vPepHash.clear();
+  int block=0;
+  for(size_t first=0;first<vDB.size();first+=streamBlock,block++){
+    size_t last=first+streamBlock;
+    if(last>vDB.size()) last=vDB.size();
+    v.clear();
+    h.clear();
+    digestRange(first,last,v);
+    mergePeptides(v,&h);
+    for(i=0;i<v.size();i++){
+      ph.hash=h[i];
+      ph.first=v[i].map->at(0);
+      ph.block=block;
+      ph.xlSites=v[i].xlSites;
+      ph.nTerm=v[i].nTerm;
+      ph.cTerm=v[i].cTerm;
+      vPepHash.push_back(ph);
+      if(v[i].mass-1<minMass[v[i].map->at(0).stop-v[i].map->at(0).start+1]){
+        minMass[v[i].map->at(0).stop - v[i].map->at(0).start + 1] = v[i].mass-1;
+      }
+    }
+  }
+  for(i=0;i<100;i++){
+    if(i<99 && minMass[i+1]<minMass[i]) minMass[i]=minMass[i+1];
+  }
+
+  //merge peptides seen in more than one block. Entries that share a hash are merged only if their
+  //sequences match, so different sequences with the same hash keep an entry each.
+  sort(vPepHash.begin(),vPepHash.end(),comparePepHash);
+  n=0;
+  for(i=0;i<vPepHash.size();i=j){
+    for(j=i+1;j<vPepHash.size() && vPepHash[j].hash==vPepHash[i].hash;j++);
+    r=n;
+    for(k=i;k<j;k++){
+      m=r;
+      while(m<n && !sameSequence(vPepHash[m].first,vPepHash[k].first)) m++;
+      if(m<n){
+        if(vPepHash[k].xlSites>vPepHash[m].xlSites) vPepHash[m].xlSites=vPepHash[k].xlSites;
+        if(vPepHash[k].nTerm) vPepHash[m].nTerm=true;
+        if(vPepHash[k].cTerm) vPepHash[m].cTerm=true;
+        continue;
+      }
+      vPepHash[n++]=vPepHash[k];
+    }
+  }
+  vPepHash.resize(n);
+
+  n=0;
+  for(i=0;i<vPepHash.size();i++){
+    if(vPepHash[i].xlSites>0) n++;
+  }
+  pepTotal=(int)vPepHash.size();
+  adductPepCount=(int)n;
+  cout << "  " << pepTotal << " peptides to search (" << n << " with binding sites), digested in " << block << " blocks of " << streamBlock << " proteins." << endl;
+
+  streamNext=0;
+  keptCount=0;
+  keptIndex.clear();
+  return true;
+}
+
+//Streamed database: replaces the previous block with the peptides of the next block of proteins,
+//ordered by mass, after the kept peptides. Peptides first seen in another block are skipped, so
+//each peptide is searched once. Returns false when all blocks have been searched.
+bool MDatabase::buildPeptideBlock(){
+  vector<mPeptide> v;
+  vector<uint64_t> h;
+  mPepHash ph;
+
+  vPep.resize(keptCount);
+  vPepSeq.clear();
+  vPepSeqOffset.clear();
+  if(streamNext>=vDB.size()) return false;
+
+  size_t last=streamNext+streamBlock;
+  if(last>vDB.size()) last=vDB.size();
+  int block=(int)(streamNext/streamBlock);
+  digestRange(streamNext,last,v);
+  mergePeptides(v,&h,true);
+  streamNext=last;
+
+  ph.block=-1;
+  for(size_t i=0;i<v.size();i++){
+    ph.hash=h[i];
+    vector<mPepHash>::iterator it=lower_bound(vPepHash.begin(),vPepHash.end(),ph,comparePepHash);
+    if(it==vPepHash.end() || it->hash!=h[i]) continue;
+    if(it+1!=vPepHash.end() && (it+1)->hash==h[i]){ //the hash is shared by different sequences
+      while(it!=vPepHash.end() && it->hash==h[i] && !sameSequence(it->first,v[i].map->at(0))) it++;
+      if(it==vPepHash.end() || it->hash!=h[i]) continue;
+    }
+    if(it->block!=block) continue;
+    v[i].xlSites=it->xlSites;
+    v[i].nTerm=it->nTerm;
+    v[i].cTerm=it->cTerm;
+    vPep.push_back(v[i]);
+  }
+  if(vPep.size()>keptCount) qsort(&vPep[keptCount],vPep.size()-keptCount,sizeof(mPeptide),compareMass);
+  return true;
+}
+
+//Streamed database: rebuilds the protein mappings of the kept peptides from all of their
+//occurrences, so results list every protein, and drops the last searched block.
+void MDatabase::finishStream(){
+  vector<mPeptide> v;
+  mSeqCache cache;
+  string seq;
+  size_t i,k;
+
+  vPep.resize(keptCount);
+  vPepSeq.clear();
+  vPepSeqOffset.clear();
+  if(keptCount==0) return;
+  for(i=0;i<keptCount;i++) vPep[i].map->clear();
+  for(size_t first=0;first<vDB.size();first+=streamBlock){
+    size_t last=first+streamBlock;
+    if(last>vDB.size()) last=vDB.size();
+    v.clear();
+    digestRange(first,last,v);
+    mergePeptides(v);
+    for(i=0;i<v.size();i++){
+      getPeptideSeq(v[i],seq,&cache);
+      map<string,int>::iterator it=keptIndex.find(seq);
+      if(it==keptIndex.end()) continue;
+      for(k=0;k<v[i].map->size();k++) vPep[it->second].map->push_back(v[i].map->at(k));
+    }
+  }
+}
+
+//Streamed database: moves the peptides of the current block that are referenced by search results
+//(used, indexed from the first block peptide) to the kept list, and gives their new indexes in remap.
+//A peptide kept from an earlier pass over the blocks keeps its index. Stored residues are dropped
+//with the block, so kept peptides read theirs from the protein again.
+void MDatabase::keepPeptides(vector<bool>& used, vector<int>& remap){
+  vector<mPeptide> v;
+  string seq;
+
+  remap.assign(used.size(),-1);
+  for(size_t i=0;i<used.size();i++){
+    if(!used[i]) continue;
+    getPeptideSeq(vPep[keptCount+i],seq);
+    map<string,int>::iterator it=keptIndex.find(seq);
+    if(it!=keptIndex.end()){
+      remap[i]=it->second;
+      continue;
+    }
+    remap[i]=(int)(keptCount+v.size());
+    keptIndex[seq]=remap[i];
+    v.push_back(vPep[keptCount+i]);
+    v.back().seqIndex=-1;
+  }
+  vPep.resize(keptCount);
+  vPep.insert(vPep.end(),v.begin(),v.end());
+  keptCount=vPep.size();
+}
+
+//Streamed database: starts the next pass over the blocks. If bKept is false, the peptides kept
+//for earlier search results are released as well.
+void MDatabase::rewindStream(bool bKept){
+  streamNext=0;
+  if(bKept) return;
+  keptCount=0;
+  keptIndex.clear();
+  vPep.clear();
+  vPepSeq.clear();
+  vPepSeqOffset.clear();
+}
+
+//Streams the database, materializing generated proteins one at a time.
 void MDatabase::exportDB(string fName) {
   size_t i;
+  string buf;
   FILE* f = fopen(fName.c_str(), "wt");
   for (i = 0; i < vDB.size(); i++) {
-    fprintf(f, ">%s\n", vDB[i].name.c_str());
-    fprintf(f, "%s\n", vDB[i].sequence.c_str());
+    fprintf(f, ">%s\n", getName((int)i));
+    fprintf(f, "%s\n", getSequence((int)i,buf));
   }
   fclose(f);
 }
@@ -473,8 +597,8 @@ void MDatabase::addFixedMod(char mod, double mass){
   else AA[mod]+=mass;
 }
 
-mDB& MDatabase::at(const int& i){
-  return vDB[i];
+mProtein MDatabase::at(const int& i){
+  return getProtein(i);
 }
 
 mEnzymeRules& MDatabase::getEnzymeRules(){
@@ -497,38 +621,81 @@ vector<mPeptide>* MDatabase::getPeptideList(){
 }
 
 int MDatabase::getPeptideListSize(){
+  if(streamBlock>0) return pepTotal;
   return (int)vPep.size();
 }
 
-bool MDatabase::getPeptideSeq(int index, int start, int stop, char* str){
+size_t MDatabase::getKeptCount(){
+  return keptCount;
+}
+
+bool MDatabase::isStreamed(){
+  return streamBlock>0;
+}
+
+bool MDatabase::getPeptideSeq(int index, int start, int stop, char* str, mSeqCache* cache){
   if ((size_t)index>vDB.size()) return false;
-  string str1=vDB[index].sequence.substr(start,stop-start+1);
-  strcpy(str,&str1[0]);
+  string buf;
+  extractSpan(index,start,stop,buf,cache);
+  memcpy(str,buf.c_str(),buf.size()+1);
   return true;
 }
 
-bool MDatabase::getPeptideSeq(int index, int start, int stop, string& str){
+bool MDatabase::getPeptideSeq(int index, int start, int stop, string& str, mSeqCache* cache){
   if((size_t)index>vDB.size()) return false;
-  str=vDB[index].sequence.substr(start,stop-start+1);
+  extractSpan(index,start,stop,str,cache);
   return true;
 }
 
-bool MDatabase::getPeptideSeq(mPeptide& p, string& str){
-  str=vDB[p.map->at(0).index].sequence.substr(p.map->at(0).start,p.map->at(0).stop-p.map->at(0).start+1);
+bool MDatabase::getPeptideSeq(mPeptide& p, string& str, mSeqCache* cache){
+  if(p.seqIndex>=0){
+    str.assign(&vPepSeq[vPepSeqOffset[p.seqIndex]]);
+    return true;
+  }
+  extractSpan(p.map->at(0).index,p.map->at(0).start,p.map->at(0).stop,str,cache);
   return true;
 }
 
-bool MDatabase::getPeptideSeq(int pepIndex, string& str){
+bool MDatabase::getPeptideSeq(int pepIndex, string& str, mSeqCache* cache){
   if((size_t)pepIndex>vPep.size()) return false;
-  mPeptide p = vPep[(size_t)pepIndex];
-  str = vDB[p.map->at(0).index].sequence.substr(p.map->at(0).start, p.map->at(0).stop - p.map->at(0).start + 1);
-  return true;
+  return getPeptideSeq(vPep[(size_t)pepIndex], str, cache);
+}
+
+const char* MDatabase::getName(int index){
+  return &vHdr[vDB[index].nameOffset];
+}
+
+//Returns a view of the protein into the packed store. Generated proteins have no stored
+//residues, so their view has a NULL sequence; use getSequence() to materialize them.
+mProtein MDatabase::getProtein(int index){
+  mProtein p;
+  const mDB& d=vDB[index];
+  p.decoy=d.decoy;
+  p.description=&vHdr[d.descOffset];
+  p.name=&vHdr[d.nameOffset];
+  if(d.source<0) p.sequence=&vSeq[d.seqOffset];
+  else p.sequence=NULL;
+  p.length=d.seqLen;
+  return p;
 }
 
 int MDatabase::getProteinDBSize(){
   return (int)vDB.size();
 }
 
+//Returns the null-terminated sequence of a protein. FASTA proteins point into the arena;
+//generated proteins are materialized into buf.
+const char* MDatabase::getSequence(int index, string& buf){
+  const mDB& d=vDB[index];
+  if(d.source<0) return &vSeq[d.seqOffset];
+  materialize(d,buf);
+  return buf.c_str();
+}
+
+size_t MDatabase::getSequenceLength(int index){
+  return vDB[index].seqLen;
+}
+
 void MDatabase::setAAMass(char aa, double mass){
   AA[aa] = mass;
 }
@@ -611,6 +778,11 @@ void MDatabase::setAdductSites(bool* arr){
   for (int i = 0; i < 128; i++) adductSites[i]=arr[i];
 }
 
+//Digest and search the database in blocks of this many proteins; 0 digests it all at once
+void MDatabase::setStream(size_t block){
+  streamBlock=block;
+}
+
 //==============================
 //  Private Functions
 //==============================
@@ -635,7 +807,435 @@ void MDatabase::addPeptide(int index, int start, int len, double mass, mPeptide&
 
 }
 
-bool MDatabase::checkAA(size_t i, size_t start, size_t n, size_t seqSize, bool& bN, bool& bC){
+//Appends a name or description to the header arena and returns its position
+size_t MDatabase::appendHeader(const string& str){
+  size_t pos=vHdr.size();
+  vHdr.insert(vHdr.end(),str.begin(),str.end());
+  vHdr.push_back('\0');
+  return pos;
+}
+
+//Digests a single protein according to the user-defined enzyme rules, appending peptides to vP.
+void MDatabase::digestProtein(size_t i, double min, double max, int mis, int minP, int maxP, vector<mPeptide>& vP, string& seqBuf){
+
+  double mass;
+  bool bCutMarked;
+  bool bNTerm;
+  bool bCTerm;
+
+  int mc;
+  int next;
+
+  char xlSites;
+  const char* seq;
+
+  mPeptide p;
+
+  size_t n;
+  size_t seqSize;
+  size_t start;
+
+  seq=getSequence((int)i,seqBuf);
+  seqSize=vDB[i].seqLen;
+  start=0;
+  n=0;
+  mc=0;
+  mass=18.0105633+fixMassPepN+fixMassProtN;
+  if(seq[0]=='M') next=0; //allow for next start site to be amino acid after initial M.
+  else next = -1;
+
+  bNTerm=false;
+  bCTerm=false;
+  if(adductSites['$'] || adductSites['%']) xlSites=1;
+  else xlSites=0;
+
+  while(true){
+
+    bCutMarked=false;
+
+    //Check if we cut n-terminal to this AA
+    if(n>0 && enzyme.cutN[seq[start+n]] && !enzyme.exceptC[seq[start+n-1]]){
+      if(next==-1) next=(int)start+(int)n-1;
+      if(!bCutMarked) mc++;
+      bCutMarked=true;
+
+      //Add the peptide now (if enough mass and length)
+      if ((mass+fixMassPepC)>min && n>=(minP-1)) addPeptide((int)i, (int)start, (int)n - 1, mass+fixMassPepC, p, vP, bNTerm, bCTerm, xlSites);
+
+    }
+
+    //Add the peptide mass
+    mass+=AA[seq[start+n]];
+
+    //Check if we cut c-terminal to this AA
+    if((start+n+1)<seqSize && enzyme.cutC[seq[start+n]] && !enzyme.exceptN[seq[start+n+1]]){
+      if(next==-1) next=(int)(start+n);
+      if(!bCutMarked) mc++;
+      bCutMarked=true;
+
+      //Add the peptide now (if enough mass)
+      if ((mass + fixMassPepC)>min && (mass + fixMassPepC)<max && n >= (minP - 1) ) addPeptide((int)i, (int)start, (int)n, mass + fixMassPepC, p, vP, bNTerm, bCTerm, xlSites);
+
+    }
+
+    //Mark sites of adduct formation
+    if(checkAA(seq,start,n,seqSize,bNTerm,bCTerm)) xlSites++;
+
+    //Check if we are at the end of the sequence
+    if((start+n+1)==seqSize) {
+
+      //Add the peptide now (if enough mass)
+      if ((mass + fixMassPepC + fixMassProtC)>min && (mass + fixMassPepC + fixMassProtC)<max && n >= (minP - 1) )addPeptide((int)i, (int)start, (int)n, mass + fixMassPepC + fixMassProtC, p, vP, bNTerm, bCTerm, xlSites);
+      if(next>-1) {
+        start=next+1;
+        n=0;
+        mc=0;
+        mass=18.0105633+fixMassPepN;
+        bNTerm = false;
+        bCTerm = false;
+        if (adductSites['$'] || adductSites['%']) xlSites = 1;
+        else xlSites = 0;
+        next=-1;
+        continue;
+      } else {
+        break;
+      }
+
+    }
+
+    //Check if we exceeded peptide mass
+    //Check if we exceeded the number of missed cleavages
+    //Check if we exceeded peptide length
+    if((mass+fixMassPepC)>max || mc>mis || n>=(maxP-1)) {
+
+      //if we know next cut site
+      if(next>-1) {
+        start=next+1;
+        n=0;
+        mc=0;
+        mass=18.0105633+fixMassPepN;
+        bNTerm = false;
+        bCTerm = false;
+        if (adductSites['$'] || adductSites['%']) xlSites = 1;
+        else xlSites = 0;
+        next=-1;
+
+      //Otherwise, continue scanning until it is found
+      } else {
+        while((start+n)<seqSize-1){
+          n++;
+          if(n>0 && enzyme.cutN[seq[start+n]] && !enzyme.exceptC[seq[start+n-1]]){
+            next=(int)(start+n);
+            break;
+          } else if((start+n+1)<seqSize && enzyme.cutC[seq[start+n]] && !enzyme.exceptN[seq[start+n+1]]){
+            next=(int)(start+n);
+            break;
+          } 
+        }
+        if(next<0) break;
+
+        start=next+1;
+        n=0;
+        mc=0;
+        mass=18.0105633+fixMassPepN;
+        bNTerm = false;
+        bCTerm = false;
+        if (adductSites['$'] || adductSites['%']) xlSites = 1;
+        else xlSites = 0;
+        next=-1;
+      }  
+    } else {
+      n++;
+      continue;
+    }
+
+  }
+}
+
+//Digests proteins first to last-1 in parallel blocks. Generated proteins are materialized inside
+//the workers, and blocks are concatenated in protein order so the peptide list does not depend on
+//the number of threads.
+void MDatabase::digestRange(size_t first, size_t last, vector<mPeptide>& v){
+  size_t i;
+  size_t n;
+  size_t DBSize=last-first;
+  int threads=digestThreads;
+
+  if(DBSize==0) return;
+  if(threads<1) threads=1;
+  size_t blockSize=DBSize/((size_t)threads*16)+1;
+  vector<mDigestBlock> blocks((DBSize+blockSize-1)/blockSize);
+  for(i=0;i<blocks.size();i++){
+    blocks[i].db=this;
+    blocks[i].first=first+i*blockSize;
+    blocks[i].last=first+(i+1)*blockSize;
+    if(blocks[i].last>last) blocks[i].last=last;
+    blocks[i].min=digestMin;
+    blocks[i].max=digestMax;
+    blocks[i].mis=digestMis;
+    blocks[i].minP=digestMinP;
+    blocks[i].maxP=digestMaxP;
+  }
+  ThreadPool<mDigestBlock*>* threadPool = new ThreadPool<mDigestBlock*>(digestProc, threads, threads, 1);
+  for(i=0;i<blocks.size();i++){
+    threadPool->WaitForQueuedParams();
+    threadPool->Launch(&blocks[i]);
+  }
+  threadPool->WaitForQueuedParams();
+  threadPool->WaitForThreads();
+  delete threadPool;
+  threadPool=NULL;
+
+  n=v.size();
+  for(i=0;i<blocks.size();i++) n+=blocks[i].pep.size();
+  v.reserve(n);
+  for(i=0;i<blocks.size();i++){
+    v.insert(v.end(),blocks[i].pep.begin(),blocks[i].pep.end());
+    vector<mPeptide>().swap(blocks[i].pep);
+  }
+}
+
+//Merges peptides with the same sequence into one entry that maps to all of their proteins.
+//If hashes is not NULL, it receives the sequence hash of each remaining peptide. If bStore is true,
+//the residues of remaining peptides of shuffled proteins are stored in the peptide arena, so they
+//are not read by shuffling their whole protein again, one peptide at a time, in mass order.
+void MDatabase::mergePeptides(vector<mPeptide>& v, vector<uint64_t>* hashes, bool bStore){
+  const char* seq=NULL;
+  string seqBuf;
+  size_t i;
+  size_t k;
+
+  if(v.empty()) return;
+
+  mPepSort ps;
+  ps.index=0;
+  ps.sequence.clear();
+  vector<mPepSort> vPS;
+  int lastIndex=-1;
+  for(i=0;i<v.size();i++){
+    ps.index=(int)i;
+    if(v[i].map->at(0).index!=lastIndex){ //peptides are still in protein order; materialize each protein once
+      lastIndex=v[i].map->at(0).index;
+      seq=getSequence(lastIndex,seqBuf);
+    }
+    ps.sequence.assign(seq+v[i].map->at(0).start,v[i].map->at(0).stop-v[i].map->at(0).start+1);
+    vPS.push_back(ps);
+  }
+  //qsort(&vPS[0],vPS.size(),sizeof(kPepSort),compareSequence);
+  sort(vPS.begin(),vPS.end(),compareSequenceB);
+
+  vector<mPeptide> vtp;
+  for(i=vPS.size()-1;i>0;i--){
+    if(vPS[i].sequence.compare(vPS[i-1].sequence)==0){
+      for(k=0;k<v[vPS[i].index].map->size();k++){
+        v[vPS[i-1].index].map->push_back(v[vPS[i].index].map->at(k));
+        if (v[vPS[i].index].cTerm) v[vPS[i - 1].index].cTerm = v[vPS[i].index].cTerm;
+        if (v[vPS[i].index].nTerm) v[vPS[i - 1].index].nTerm = v[vPS[i].index].nTerm;
+        if (v[vPS[i].index].xlSites>v[vPS[i - 1].index].xlSites) v[vPS[i - 1].index].xlSites = v[vPS[i].index].xlSites;
+      }
+      v[vPS[i].index].mass=-1;
+    }
+  }
+  vector<uint64_t> h;
+  if(hashes!=NULL){
+    h.resize(v.size());
+    for(i=0;i<vPS.size();i++) h[vPS[i].index]=hashName(vPS[i].sequence.c_str());
+  }
+  if(bStore){
+    for(i=0;i<vPS.size();i++){
+      mPeptide& p=v[vPS[i].index];
+      if(p.mass<=0 || !isShuffled(p.map->at(0).index)) continue;
+      p.seqIndex=(int)vPepSeqOffset.size();
+      vPepSeqOffset.push_back(vPepSeq.size());
+      vPepSeq.insert(vPepSeq.end(),vPS[i].sequence.begin(),vPS[i].sequence.end());
+      vPepSeq.push_back('\0');
+    }
+  }
+  for(i=0;i<v.size();i++){
+    if(v[i].mass>0) {
+      vtp.push_back(v[i]);
+      if(hashes!=NULL) hashes->push_back(h[i]);
+    }
+  }
+  v.clear();
+  for(i=0;i<vtp.size();i++) v.push_back(vtp[i]);
+}
+
+//Thread-start function: digests a block of proteins.
+void MDatabase::digestProc(mDigestBlock* b){
+  string seqBuf;
+  for(size_t i=b->first;i<b->last;i++) b->db->digestProtein(i,b->min,b->max,b->mis,b->minP,b->maxP,b->pep,seqBuf);
+}
+
+//Materializes a generated protein: the source residues with the record's transform applied.
+void MDatabase::materialize(const mDB& d, string& seq){
+  string src;
+  seq.assign(getSequence(d.source, src), vDB[d.source].seqLen);
+  if (d.transform == 'r') reverseSequence(seq);
+  else if (d.transform == 's') shuffleSequence(seq, d.seed);
+}
+
+//Returns true if two peptide mappings have the same residues
+bool MDatabase::sameSequence(const mPepMap& a, const mPepMap& b){
+  if(a.stop-a.start!=b.stop-b.start) return false;
+  string s1,s2;
+  extractSpan(a.index,a.start,a.stop,s1,NULL);
+  extractSpan(b.index,b.start,b.stop,s2,NULL);
+  return s1==s2;
+}
+
+//Copies residues start..stop of a protein into str. Reversed proteins only reverse the cut-site
+//spans that overlap the peptide; shuffled proteins are materialized whole, reusing the cache if given.
+void MDatabase::extractSpan(int index, int start, int stop, string& str, mSeqCache* cache){
+  const mDB& d=vDB[index];
+  string buf;
+  if(d.transform=='r') {
+    reverseSpan(materializeCached(d.source,buf,cache),vDB[d.source].seqLen,(size_t)start,(size_t)stop,str);
+    return;
+  }
+  str.assign(materializeCached(index,buf,cache)+start,stop-start+1);
+}
+
+//Returns true if reading any residue of a protein requires shuffling a whole protein
+bool MDatabase::isShuffled(int index){
+  const mDB& d=vDB[index];
+  if(d.source<0) return false;
+  if(d.transform=='s') return true;
+  return isShuffled(d.source);
+}
+
+//Same as getSequence(), but a shuffled protein is kept in cache, when given, for the next peptide.
+const char* MDatabase::materializeCached(int index, string& buf, mSeqCache* cache){
+  const mDB& d=vDB[index];
+  if(d.source<0 || cache==NULL || d.transform!='s') return getSequence(index,buf);
+  if(cache->protein!=index){
+    materialize(d,cache->seq);
+    cache->protein=index;
+  }
+  return cache->seq.c_str();
+}
+
+//Writes residues start..stop of the reversed form of seq into str, giving the same residues as
+//reverseSequence() on the whole protein. Only the cut-site spans overlapping the range are read.
+void MDatabase::reverseSpan(const char* seq, size_t len, size_t start, size_t stop, string& str){
+  size_t a,b,e,i,k,n,s;
+  bool bPal;
+
+  str.assign(seq+start,stop-start+1);
+  k=start;
+  while(k<=stop){
+    if(k==0 || enzyme.cutN[seq[k]] || enzyme.cutC[seq[k]]) {
+      k++;
+      continue;
+    }
+
+    //find the uncut span that holds k
+    a=k;
+    while(a>1 && !enzyme.cutN[seq[a-1]] && !enzyme.cutC[seq[a-1]]) a--;
+    b=k;
+    while(b+1<len && !enzyme.cutN[seq[b+1]] && !enzyme.cutC[seq[b+1]]) b++;
+
+    //adjust ends for restrictive sites
+    s=a;
+    while(s<=b && (enzyme.exceptN[seq[s]] || enzyme.exceptC[seq[s]])) s++;
+    e=b;
+    while(e>=a && (enzyme.exceptN[seq[e]] || enzyme.exceptC[seq[e]])) e--;
+
+    if(s<e){
+      n=e-s+1;
+      bPal=(n>2);
+      for(i=0;i<n/2 && bPal;i++){
+        if(seq[s+i]!=seq[e-i]) bPal=false;
+      }
+      for(i=(s>start?s:start);i<=e && i<=stop;i++) str[i-start]=seq[s+e-i];
+      if(bPal){ //edge case of palindrome sequence: the first and middle characters are swapped
+        if(s>=start && s<=stop) str[s-start]=seq[e-n/2];
+        if(s+n/2>=start && s+n/2<=stop) str[s+n/2-start]=seq[e];
+      }
+    }
+    k=b+1;
+  }
+}
+
+//Reverses the sequence in place between enzyme cut sites. If a reversed span is palindromic,
+//a minor attempt at creating a novel sequence is made.
+void MDatabase::reverseSequence(string& seq) {
+  typedef struct clips {
+    int start;
+    int stop;
+  } clips;
+
+  size_t j;
+  vector<clips> cut;
+  clips c;
+
+  if (seq.size() < 2) return;
+
+  c.start = -1;
+  for (j = 1; j < seq.size(); j++) {
+    if (enzyme.cutN[seq[j]] || enzyme.cutC[seq[j]]) {
+      if (c.start > -1) { //mark the space in between
+        c.stop = (int)j - 1;
+        cut.push_back(c);
+        c.start = -1; //reset
+      }
+    } else {
+      if (c.start < 0) c.start = (int)j;
+    }
+  }
+  if (!enzyme.cutN[seq[j - 1]] && !enzyme.cutC[seq[j - 1]]) { //check last amino acid
+    c.stop = (int)j - 1;
+    cut.push_back(c);
+  }
+
+  //reverse the sequences
+  string rev;
+  for (j = 0; j < cut.size(); j++) {
+    rev.clear();
+
+    //adjust ends for restrictive sites
+    while (enzyme.exceptN[seq[cut[j].start]] || enzyme.exceptC[seq[cut[j].start]]) {
+      cut[j].start++;
+      if (cut[j].start == seq.size()) break;
+    }
+    while (enzyme.exceptN[seq[cut[j].stop]] || enzyme.exceptC[seq[cut[j].stop]]) {
+      cut[j].stop--;
+      if (cut[j].stop == -1) break;
+    }
+    if (cut[j].start == seq.size()) continue; //skip when out of bounds
+    if (cut[j].stop == -1) continue; //skip when out of bounds
+    if (cut[j].stop <= cut[j].start) continue; //skip if nothing will happen
+
+    for (size_t k = cut[j].stop; k >= cut[j].start; k--) {
+      rev += seq[k];
+      if (k == 0) break;
+    }
+    if (rev.size() > 2 && rev.compare(seq.substr(cut[j].start, (size_t)cut[j].stop - (size_t)cut[j].start + 1)) == 0) { //edge case of palindrome sequence
+      char c = rev[0];
+      rev[0] = rev[rev.size() / 2];
+      rev[rev.size() / 2] = c; //just swap the first and middle characters, see if that breaks up the palindrome
+    }
+    seq.replace(cut[j].start, (size_t)cut[j].stop - (size_t)cut[j].start + 1, rev);
+  }
+}
+
+//Fisher-Yates shuffle driven by a local splitmix64 generator, so the result depends only on the seed.
+void MDatabase::shuffleSequence(string& seq, uint64_t seed) {
+  uint64_t state = seed;
+  for (size_t j = seq.size(); j > 1; j--) {
+    // Pick a random index from 0 to j-1 (inclusive)
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z = z ^ (z >> 31);
+    size_t k = (size_t)(z % j);
+
+    // Swap sequence[j-1] with sequence[k]
+    swap(seq[j - 1], seq[k]);
+  }
+}
+
+bool MDatabase::checkAA(const char* seq, size_t start, size_t n, size_t seqSize, bool& bN, bool& bC){
   if (start + n == 0){
     bN=true;
     if (adductSites['n']==true) return true;
@@ -648,13 +1248,130 @@ bool MDatabase::checkAA(size_t i, size_t start, size_t n, size_t seqSize, bool&
     bC=true;
     if (adductSites['c']==true) return true;
   }
-  if (adductSites[vDB[i].sequence[start + n]]==true) return true;
+  if (adductSites[seq[start + n]]==true) return true;
   return false;
 }
 
+//Thread-start function: parses every FASTA record that begins within the span.
+void MDatabase::parseFastaChunk(mFastaChunk* c){
+  const char* p=c->start;
+  const char* e=c->stop;
+  const char* q;
+  const char* r;
+  char* out;
+  char  bad;
+  size_t pos;
+  string name;
+  mDB d;
+
+  //skip any lines that precede the first header
+  while(p<e && *p!='>'){
+    q=(const char*)memchr(p,'\n',e-p);
+    if(q==NULL) p=e;
+    else p=q+1;
+  }
+
+  while(p<e){
+
+    //header: name is before the first space, description after it
+    q=(const char*)memchr(p,'\n',e-p);
+    if(q==NULL) q=e;
+    const char* h=p+1;
+    const char* hStop=h;
+    while(hStop<q && *hStop!='\r') hStop++;
+    const char* sp=(const char*)memchr(h,' ',hStop-h);
+    size_t hdrPos=c->hdr.size();
+    if(sp==NULL){
+      name.assign(h,hStop-h);
+      d.nameOffset=d.descOffset=hdrPos;
+      c->hdr.insert(c->hdr.end(),name.begin(),name.end());
+      c->hdr.push_back('\0');
+    } else {
+      name.assign(h,sp-h);
+      d.nameOffset=hdrPos;
+      d.descOffset=hdrPos+name.size()+1;
+      c->hdr.insert(c->hdr.end(),h,hStop);
+      c->hdr[d.descOffset-1]='\0';
+      c->hdr.push_back('\0');
+    }
+    d.decoy=(name.find(*c->decoyStr)!=string::npos);
+    d.source=-1;
+    d.transform=0;
+    d.seed=0;
+
+    //sequence: every line up to the next header
+    p=(q<e) ? q+1 : e;
+    const char* s=p;
+    while(p<e){
+      q=(const char*)memchr(p,'\n',e-p);
+      if(q==NULL) {
+        p=e;
+        break;
+      }
+      p=q+1;
+      if(p<e && *p=='>') break;
+    }
+
+    //branch-free table pass: uppercase, drop white space, and flag unknown residues
+    pos=c->seq.size();
+    c->seq.resize(pos+(p-s)+1);
+    out=&c->seq[pos];
+    bad=0;
+    for(r=s;r<p;r++){
+      unsigned char u=(unsigned char)*r;
+      *out=c->resTable[u];
+      out+=c->resKeep[u];
+      bad|=c->resWarn[u];
+    }
+    *out='\0';
+    d.seqOffset=pos;
+    d.seqLen=out-&c->seq[pos];
+
+    //report unexpected characters once per protein, only on the slow path
+    if(bad){
+      bool seen[256]={false};
+      for(r=s;r<p;r++){
+        unsigned char u=(unsigned char)*r;
+        if(!c->resWarn[u] || seen[u]) continue;
+        seen[u]=true;
+        c->warnings.push_back(name + " has an unexpected amino acid character or errant white space: '" + c->resTable[u] + "'");
+        if(c->resKeep[u]) {
+          string tmpStr = "Mass of '";
+          c->warnings.push_back(tmpStr + c->resTable[u] + "' is currently set to 0. Consider revising with the aa_mass parameter.");
+        }
+      }
+    }
+
+    if(d.seqLen>65000){
+      c->warnings.push_back(name + " has a sequence that is too long. It will be skipped.");
+      c->seq.resize(pos);
+      c->hdr.resize(hdrPos);
+      continue;
+    }
+    c->seq.resize(pos+d.seqLen+1);
+    c->prot.push_back(d);
+  }
+  vector<char>().swap(c->text); //decompressed input is no longer needed
+}
+
 //==============================
 //  Utility Functions
 //==============================
+//FNV-1a hash of a protein name, used to seed generated sequences
+uint64_t MDatabase::hashName(const char* str){
+  uint64_t h=0xCBF29CE484222325ULL;
+  while(*str!='\0'){
+    h^=(unsigned char)*str++;
+    h*=0x100000001B3ULL;
+  }
+  return h;
+}
+
+bool MDatabase::comparePepHash(const mPepHash& p1, const mPepHash& p2){
+  if(p1.hash==p2.hash) return p1.block<p2.block;
+  return p1.hash<p2.hash;
+}
+
 int MDatabase::compareMass(const void *p1, const void *p2){ //sort high to low
   const mPeptide d1 = *(mPeptide *)p1;
   const mPeptide d2 = *(mPeptide *)p2;
@@ -19,12 +19,64 @@ limitations under the License.
 
 #include <algorithm>
 #include <iostream>
+#include <map>
 #include <string>
 #include <vector>
 
 #include "MLog.h"
 #include "MStructs.h"
 
+//=============================
+// Structures for threading
+//=============================
+//A span of the FASTA file that begins on a record boundary, and the proteins parsed from it
+typedef struct mFastaChunk{
+  const char*          start;      //first byte of the span
+  const char*          stop;       //one past the last byte of the span
+  const char*          resTable;   //uppercased residue for every input byte
+  const char*          resKeep;    //1 if the byte is kept in the sequence, 0 if it is line ending or white space
+  const char*          resWarn;    //1 if the byte should be reported as an unexpected residue
+  const std::string*   decoyStr;
+  std::vector<mDB>     prot;       //proteins in this span; offsets are relative to hdr and seq
+  std::vector<char>    hdr;        //names and descriptions of all proteins in this span
+  std::vector<char>    seq;        //residues of all proteins in this span, each terminated with '\0'
+  std::vector<std::string> warnings;
+  std::vector<char>    text;       //input bytes of the span when decompressed rather than mapped
+} mFastaChunk;
+
+class MDatabase;
+
+//The last shuffled protein materialized, reused while peptides are read in protein order
+typedef struct mSeqCache{
+  int         protein;  //protein held in seq; -1 if none
+  std::string seq;
+  mSeqCache(){ protein=-1; }
+} mSeqCache;
+
+//A unique peptide sequence of a streamed database: the block where it is first seen, and its
+//flags merged over all of its occurrences
+typedef struct mPepHash{
+  uint64_t  hash;
+  mPepMap   first;    //first occurrence, to tell apart different sequences with the same hash
+  int       block;
+  char      xlSites;
+  bool      nTerm;
+  bool      cTerm;
+} mPepHash;
+
+//A range of proteins digested by one thread, and the peptides produced from it
+typedef struct mDigestBlock{
+  MDatabase*            db;
+  size_t                first;  //first protein index
+  size_t                last;   //one past the last protein index
+  double                min;
+  double                max;
+  int                   mis;
+  int                   minP;
+  int                   maxP;
+  std::vector<mPeptide> pep;
+} mDigestBlock;
+
 class MDatabase{
 public:
 
@@ -33,33 +85,43 @@ public:
   ~MDatabase();
 
   //Operators
-  mDB& operator[ ](const int& i);
+  mProtein operator[ ](const int& i);
 
   //User Functions
-  bool  buildDB       (const char* fname, std::string decoyStr, std::string entrapmentStr);                     //Reads FASTA file and populates vDB
-  void  buildDecoy(std::string decoy_label);
+  bool  buildDB       (const char* fname, std::string decoyStr, std::string entrapmentStr, int threads=1);     //Reads FASTA file and populates vDB
+  void  buildDecoy(std::string decoy_label, uint64_t seed=0);
   void  buildEntrapment(std::string entrapment_label); //Generate entrapment sequences (shuffled targets labeled as targets) for each target sequence
-  bool  buildPeptides (double min, double max, int mis, int minP, int maxP); //Make peptide list within mass boundaries and miscleavages.
+  bool  buildPeptides (double min, double max, int mis, int minP, int maxP, int threads=1); //Make peptide list within mass boundaries and miscleavages.
+  bool  buildPeptideBlock();  //Streamed database: make the peptide list of the next block of proteins
   void  exportDB(std::string fName);
+  void  finishStream  ();
+  void  keepPeptides  (std::vector<bool>& used, std::vector<int>& remap);
+  void  rewindStream  (bool bKept);
 
   //Accessors & Modifiers
   void                addFixedMod         (char mod, double mass);
-  mDB&                at                  (const int& i);
+  mProtein            at                  (const int& i);
   mEnzymeRules&       getEnzymeRules      ();
+  size_t              getKeptCount        ();
   int                 getMaxPepLen        (double mass);
   mPeptide&           getPeptide          (int index);
   std::vector<mPeptide>*   getPeptideList      ();
   int                 getPeptideListSize  ();
-  bool                getPeptideSeq       (int index, int start, int stop, char* str);
-  bool                getPeptideSeq       (int index, int start, int stop, std::string& str);
-  bool                getPeptideSeq       (mPeptide& p, std::string& str);
-  bool                getPeptideSeq       (int pepIndex, std::string& str);
-  mDB&                getProtein          (int index);
+  bool                getPeptideSeq       (int index, int start, int stop, char* str, mSeqCache* cache=NULL);
+  bool                getPeptideSeq       (int index, int start, int stop, std::string& str, mSeqCache* cache=NULL);
+  bool                getPeptideSeq       (mPeptide& p, std::string& str, mSeqCache* cache=NULL);
+  bool                getPeptideSeq       (int pepIndex, std::string& str, mSeqCache* cache=NULL);
+  mProtein            getProtein          (int index);
   int                 getProteinDBSize    ();
+  const char*         getName             (int index);
+  const char*         getSequence         (int index, std::string& buf);
+  size_t              getSequenceLength   (int index);
+  bool                isStreamed          ();
   void                setAAMass           (char aa, double mass);
   bool                setEnzyme           (const char* str);
   void                setLog              (MLog* c);
   void                setAdductSites      (bool* arr);
+  void                setStream           (size_t block);
 
   double minMass[100];
   int adductPepCount;
@@ -76,20 +138,58 @@ private:
   mEnzymeRules  enzyme;    //Where to cut to generate peptides
 
   std::vector<mDB>      vDB;    //Entire FASTA database stored in memory
+  std::vector<char>     vSeq;   //Sequence arena: all protein sequences back to back, each terminated with '\0'
+  std::vector<char>     vHdr;   //Header arena: protein names and descriptions, each terminated with '\0'
   std::vector<mPeptide> vPep;   //List of all peptides
+  std::vector<char>     vPepSeq;        //Peptide arena: residues of the peptides of shuffled proteins, each terminated with '\0'
+  std::vector<size_t>   vPepSeqOffset;  //position in vPepSeq of each stored peptide, by mPeptide::seqIndex
+
+  //Streamed database: peptides are digested and searched one block of proteins at a time. The
+  //front of vPep keeps the peptides referenced by search results, followed by the current block.
+  size_t        streamBlock;  //proteins per block; 0=digest the whole database at once
+  size_t        streamNext;   //first protein of the next block
+  size_t        keptCount;    //peptides kept for search results
+  int           pepTotal;     //unique peptides of the streamed database
+  double        digestMin;
+  double        digestMax;
+  int           digestMis;
+  int           digestMinP;
+  int           digestMaxP;
+  int           digestThreads;
+  std::vector<mPepHash>  vPepHash;   //unique peptides by sequence hash
+  std::map<std::string,int> keptIndex;  //sequences of the kept peptides
 
   MLog* mlog;
 
   void addPeptide(int index, int start, int len, double mass, mPeptide& p, std::vector<mPeptide>& vP, bool bN, bool bC, char xlSites);
-  bool checkAA(size_t i, size_t start, size_t n, size_t seqSize, bool& bN, bool& bC);
+  size_t appendHeader(const std::string& str);
+  bool buildPeptideHash();
+  void digestProtein(size_t i, double min, double max, int mis, int minP, int maxP, std::vector<mPeptide>& vP, std::string& seqBuf);
+  bool checkAA(const char* seq, size_t start, size_t n, size_t seqSize, bool& bN, bool& bC);
+  void digestRange(size_t first, size_t last, std::vector<mPeptide>& v);
+  void mergePeptides(std::vector<mPeptide>& v, std::vector<uint64_t>* hashes=NULL, bool bStore=false);
+
+  //Thread-start functions
+  static void digestProc(mDigestBlock* b);
+  static void parseFastaChunk(mFastaChunk* c);
 
   // entrapment / decoy generation
   // Do not use addReversedTargets for both entrapment and decoy generation as this will cause decoys to be identical to targets
   void addReversedTargets(std::string label);
-  void addShuffledTargets(std::string label);
+  void addShuffledTargets(std::string label, uint64_t seed);
+  void extractSpan(int index, int start, int stop, std::string& str, mSeqCache* cache);
+  void materialize(const mDB& d, std::string& seq);
+  const char* materializeCached(int index, std::string& buf, mSeqCache* cache);
+  bool isShuffled(int index);
+  void reverseSequence(std::string& seq);
+  void reverseSpan(const char* seq, size_t len, size_t start, size_t stop, std::string& str);
+  bool sameSequence(const mPepMap& a, const mPepMap& b);
+  static void shuffleSequence(std::string& seq, uint64_t seed);
 
   //Utility functions (for sorting)
+  static uint64_t hashName    (const char* str);
   static int compareMass      (const void *p1, const void *p2);
+  static bool comparePepHash  (const mPepHash& p1, const mPepHash& p2);
   static int compareSequence  (const void *p1, const void *p2);
   static bool compareSequenceB(const mPepSort& p1, const mPepSort& p2);
 
@@ -50,6 +50,17 @@ MData::MData(){
   params=NULL;
   for(int i=0;i<128;i++) adductSite[i]=false;
   pepXMLindex=0;
+  fTXT=NULL;
+  fPerc=NULL;
+  fPerc2=NULL;
+  fDiag=NULL;
+  pepxml=NULL;
+  spillFile=NULL;
+  spillOffset=0;
+  lastRTime=-1;
+  specTotal=0;
+  checkpointWriter=NULL;
+  bCheckpointSpectra=false;
 }
 
 MData::MData(mParams* p){
@@ -59,12 +70,25 @@ MData::MData(mParams* p){
   for(i=0;i<p->fMods.size();i++) aa.addFixedMod((char)p->fMods[i].index,p->fMods[i].mass);
   for (i = 0; i<128; i++) adductSite[i] = false;
   pepXMLindex = 0;
+  fTXT=NULL;
+  fPerc=NULL;
+  fPerc2=NULL;
+  fDiag=NULL;
+  pepxml=NULL;
+  spillFile=NULL;
+  spillOffset=0;
+  lastRTime=-1;
+  specTotal=0;
+  checkpointWriter=NULL;
+  bCheckpointSpectra=false;
 }
 
 MData::~MData(){
   params=NULL;
   parObj=NULL;
   if(bScans!=NULL) delete[] bScans;
+  finishCheckpoint();
+  releaseSpill();
 }
 
 
@@ -788,6 +812,114 @@ void MData::formatMS2(MSToolkit::Spectrum* s, MSpectrum* pls){
 
 }
 
+//Keeps a finished spectrum, either in memory or, in a chunked search, in the temporary store
+void MData::addSpectrum(MSpectrum* s){
+  lastRTime = s->getRTime();
+  if (spillFile == NULL) {
+    spec.push_back(s);
+    return;
+  }
+
+  mSpill sp;
+  sp.offset = spillOffset;
+  sp.precursors = s->sizePrecursor();
+  sp.mass = 0;
+  for (int i = 0; i<sp.precursors; i++){
+    if (i == 0 || s->getPrecursor(i).monoMass<sp.mass) sp.mass = s->getPrecursor(i).monoMass;
+  }
+  size_t bytes = s->writeSpill(spillFile);
+  spillOffset += bytes;
+  sp.bytes = bytes + sizeof(MSpectrum) + sp.precursors*(sizeof(MTopPeps) + params->topCount*sizeof(mScoreCard));
+  spillList.push_back(sp);
+  delete s;
+}
+
+//Build mass list - this orders all precursor masses, with an index pointing to the actual
+//array position for the spectrum. This is because all spectra will have more than 1
+//precursor mass
+void MData::buildMassList(){
+  mMass m;
+  massList.clear();
+  for (int i = 0; i<spec.size(); i++){
+    if (spec[i]->cluster >= 0 && spec[i]->cluster != i) continue; //cluster members are searched through their representative
+    m.index = i;
+    for (int j = 0; j<spec[i]->sizePrecursor(); j++){
+      m.mass = spec[i]->getPrecursor(j).monoMass;
+      massList.push_back(m);
+    }
+  }
+
+  //sort mass list from low to high
+  qsort(&massList[0], massList.size(), sizeof(mMass), compareMassList);
+}
+
+//Groups repeated acquisitions of the same precursor: spectra whose first precursors match
+//(charge and ppm tolerance) within cluster_rt minutes, whose precursors are all matched by the
+//representative's, and whose processed spectra have a cosine similarity of at least
+//cluster_similarity. The first spectrum by precursor mass represents its cluster; members are
+//dropped from the mass list so that only the representative is searched.
+void MData::clusterSpectra(){
+  vector<mMass> v;
+  mMass m;
+  for (int i = 0; i<(int)spec.size(); i++){
+    spec[i]->cluster = -1;
+    if (spec[i]->sizePrecursor() == 0) continue;
+    m.index = i;
+    m.mass = spec[i]->getPrecursor(0).monoMass;
+    v.push_back(m);
+  }
+  if (v.size()>0) qsort(&v[0], v.size(), sizeof(mMass), compareMassList);
+
+  int clusters = 0;
+  int members = 0;
+  int largest = 1;
+  for (size_t a = 0; a<v.size(); a++){
+    MSpectrum* r = spec[v[a].index];
+    if (r->cluster >= 0) continue;
+    double mass = v[a].mass;
+    double tol = mass / 1000000 * params->ppmPrecursor;
+    int count = 1;
+    for (size_t b = a + 1; b<v.size(); b++){
+      MSpectrum* s = spec[v[b].index];
+      if (v[b].mass - mass > tol) break;
+      if (s->cluster >= 0) continue;
+      if (s->getPrecursor(0).charge != r->getPrecursor(0).charge) continue;
+      if (fabs(s->getRTime() - r->getRTime()) > params->clusterRT) continue;
+      int j, k;
+      for (j = 0; j<s->sizePrecursor(); j++){
+        double m = s->getPrecursor(j).monoMass;
+        for (k = 0; k<r->sizePrecursor(); k++){
+          if (fabs(r->getPrecursor(k).monoMass - m) <= m / 1000000 * params->ppmPrecursor) break;
+        }
+        if (k == r->sizePrecursor()) break;
+      }
+      if (j<s->sizePrecursor()) continue;
+      if (r->similarity(*s) < params->clusterSimilarity) continue;
+      s->cluster = v[a].index;
+      r->cluster = v[a].index;
+      count++;
+    }
+    if (count>1){
+      clusters++;
+      members += count - 1;
+      if (count>largest) largest = count;
+    }
+  }
+  buildMassList();
+
+  cout << "  " << clusters << " clusters of repeated spectra; " << members << " spectra are searched through their cluster representative (largest cluster: " << largest << ")." << endl;
+  if (mlog != NULL) mlog->addMessage("Spectrum clustering: " + to_string(clusters) + " clusters, " + to_string(members) + " member spectra, largest cluster " + to_string(largest) + ".", true);
+}
+
+//Waits for the checkpoint writer to save any queued checkpoint, then stops it
+void MData::finishCheckpoint(){
+  if (checkpointWriter == NULL) return;
+  checkpointWriter->WaitForQueuedParams();
+  checkpointWriter->WaitForThreads();
+  delete checkpointWriter;
+  checkpointWriter = NULL;
+}
+
 bool MData::getBoundaries(double mass1, double mass2, vector<int>& index, bool* buffer){
   int sz=(int)massList.size();
 
@@ -944,6 +1076,14 @@ double MData::getMinMass(){
   else return massList[0].mass;
 }
 
+mCheckpoint& MData::getCheckpoint(){
+  return checkpoint;
+}
+
+size_t MData::getChunkCount(){
+  return chunkList.size();
+}
+
 void MData::memoryAllocate(){
   //find largest possible array for a spectrum
   int threads = params->threads;
@@ -1088,12 +1228,20 @@ void MData::outputDiagnostics(FILE* f, MSpectrum& s, MDatabase& db){
 }
 
 bool MData::outputResults(MDatabase& db){
-  FILE* fTXT=NULL;
-  FILE* fPerc=NULL;
-  FILE* fPerc2 = NULL;
-  FILE* fDiag=NULL;
-  string fXML;
-  NeoPepXMLParser* pepxml=NULL;
+  if (!createResults(db)) return false;
+  exportResults(db);
+  closeResults();
+  return true;
+}
+
+//Opens the result files. Results are added with exportResults, which may be called once per
+//chunk of spectra, and the files are finished with closeResults.
+bool MData::createResults(MDatabase& db){
+  fTXT=NULL;
+  fPerc=NULL;
+  fPerc2 = NULL;
+  fDiag=NULL;
+  pepxml=NULL;
 
   //Export FASTA database if Magnum generated the decoys.
   if (params->buildDecoy) {
@@ -1119,7 +1267,11 @@ bool MData::outputResults(MDatabase& db){
   if(params->exportPercolator){
     if(!createPercolator(fPerc,fPerc2)) return false;
   }
-  
+  return true;
+}
+
+//Writes the results of the spectra currently held in memory
+void MData::exportResults(MDatabase& db){
   //iterate over all spectra to create exportable results
   //Output top score for each spectrum
   //Must iterate through all possible precursors for that spectrum
@@ -1186,7 +1338,7 @@ bool MData::outputResults(MDatabase& db){
 
         //Determine if target or decoy
         bool bDecoy = false;
-        for (size_t b = 0; b<pep.map->size(); b++) if (db[pep.map->at(b).index].name.find(params->decoyPrefix) != string::npos) bDecoy = true;
+        for (size_t b = 0; b<pep.map->size(); b++) if (strstr(db[pep.map->at(b).index].name, params->decoyPrefix.c_str()) != NULL) bDecoy = true;
         if (bDecoy) res.decoy = true;
         else res.decoy = false;
 
@@ -1195,11 +1347,14 @@ bool MData::outputResults(MDatabase& db){
         //proteins
         for (size_t b = 0; b<pep.map->size(); b++){
           mProtRes pr;
-          pr.protein = db[pep.map->at(b).index].name;
+          mProtein prot = db[pep.map->at(b).index];
+          string protBuf;
+          const char* protSeq = db.getSequence(pep.map->at(b).index, protBuf);
+          pr.protein = prot.name;
           if(pep.map->at(b).start==0) pr.prevAA='-';
-          else pr.prevAA = db[pep.map->at(b).index].sequence[pep.map->at(b).start-1];
-          if (pep.map->at(b).stop + 1 >= db[pep.map->at(b).index].sequence.size()) pr.nextAA = '-';
-          else pr.nextAA = db[pep.map->at(b).index].sequence[pep.map->at(b).stop + 1];
+          else pr.prevAA = protSeq[pep.map->at(b).start-1];
+          if (pep.map->at(b).stop + 1 >= prot.length) pr.nextAA = '-';
+          else pr.nextAA = protSeq[pep.map->at(b).stop + 1];
           pr.startPos = pep.map->at(b).start+1;
           res.proteins.push_back(pr);
         }
@@ -1239,17 +1394,22 @@ bool MData::outputResults(MDatabase& db){
     }
 
   }
+}
 
-  fclose(fTXT);
+void MData::closeResults(){
+  if(fTXT!=NULL) fclose(fTXT);
+  fTXT=NULL;
   if(pepxml!=NULL) {
     pepxml->write(fXML.c_str(),true);
     delete pepxml;
   }
+  pepxml=NULL;
   if(fPerc!=NULL) fclose(fPerc);
+  if(fPerc2!=NULL) fclose(fPerc2);
   if(fDiag!=NULL) fclose(fDiag);
-
-  return true;
-
+  fPerc=NULL;
+  fPerc2=NULL;
+  fDiag=NULL;
 }
 
 //Reads in raw/mzXML/mzML files. Other formats supported in MSToolkit as well.
@@ -1262,6 +1422,8 @@ bool MData::readSpectra(){
   mPrecursor pre;
 
   int totalScans=0;
+  size_t qualityRemoved=0;    //spectra and precursors removed by the quality filter
+  size_t qualityRemovedPre=0;
   int totalPeaks=0;
   int collapsedPeaks=0;
   int finalPeaks=0;
@@ -1279,6 +1441,18 @@ bool MData::readSpectra(){
 
   for (size_t a = 0; a<spec.size(); a++) delete spec[a];
   spec.clear();
+  lastRTime = -1;
+
+  //With a memory budget, finished spectra go to a temporary store instead of memory
+  releaseSpill();
+  if (params->spectrumMemory>0){
+    spillName = params->outFile + ".spectra.tmp";
+    spillFile = fopen(spillName.c_str(), "wb+");
+    if (spillFile == NULL){
+      cout << "ERROR: Cannot open temporary spectrum store: " << spillName << endl;
+      return false;
+    }
+  }
 
   msr.setFilter(MS1);
   msr.addFilter(MS2);
@@ -1306,7 +1480,7 @@ bool MData::readSpectra(){
       vMS1Buffer.emplace_back(s);
       if (vMS1Buffer.size() == 10){  //When buffer is full, transfer to MS1 memory pool
         for (int a = 0; a<params->threads; a++) Threading::LockMutex(mutexHardklor[a]);
-        while (spec.size()>0 && dMS1.size()>0 && dMS1.front()->getRTime()<spec.back()->getRTime() - 1){ //clear old memory
+        while (lastRTime>=0 && dMS1.size()>0 && dMS1.front()->getRTime()<lastRTime - 1){ //clear old memory
           delete dMS1.front();
           dMS1.pop_front();
         }
@@ -1345,8 +1519,14 @@ bool MData::readSpectra(){
     }
 
     while (dMS2.size()>0 && dMS2[0]->state >= 3){ //copy and/or clear finished MS2 spectra
-      if (dMS2[0]->state == 3) spec.push_back(dMS2[0]->pls);
-      else delete dMS2[0]->pls;
+      if (dMS2[0]->state == 3) addSpectrum(dMS2[0]->pls);
+      else {
+        if (dMS2[0]->state == 5) { //removed by the quality filter
+          qualityRemoved++;
+          qualityRemovedPre += dMS2[0]->pls->sizePrecursor();
+        }
+        delete dMS2[0]->pls;
+      }
       dMS2.pop_front();
       nextMS2--;
     }
@@ -1368,7 +1548,7 @@ bool MData::readSpectra(){
 
   //finish flushing buffer
   for (int a = 0; a<params->threads; a++) Threading::LockMutex(mutexHardklor[a]);
-  while (spec.size()>0 && dMS1.size()>0 && dMS1.front()->getRTime()<spec.back()->getRTime() - 1){ //clear old memory
+  while (lastRTime>=0 && dMS1.size()>0 && dMS1.front()->getRTime()<lastRTime - 1){ //clear old memory
     delete dMS1.front();
     dMS1.pop_front();
   }
@@ -1391,8 +1571,14 @@ bool MData::readSpectra(){
   //finish processing last MS2 scans
   while (dMS2.size()>0){
     while (dMS2.size()>0 && dMS2[0]->state >= 3){ //copy and/or clear finished MS2 spectra
-      if (dMS2[0]->state == 3) spec.push_back(dMS2[0]->pls);
-      else delete dMS2[0]->pls;
+      if (dMS2[0]->state == 3) addSpectrum(dMS2[0]->pls);
+      else {
+        if (dMS2[0]->state == 5) { //removed by the quality filter
+          qualityRemoved++;
+          qualityRemovedPre += dMS2[0]->pls->sizePrecursor();
+        }
+        delete dMS2[0]->pls;
+      }
       dMS2.pop_front();
       nextMS2--;
     }
@@ -1415,7 +1601,17 @@ bool MData::readSpectra(){
   Threading::DestroyMutex(mutexLockMS1);
 
 
-  cout << "  " << spec.size() << " total spectra have enough data points for searching." << endl;
+  size_t specCount = spec.size();
+  if (spillFile != NULL) specCount = spillList.size();
+  cout << "  " << specCount << " total spectra have enough data points for searching." << endl;
+  if (qualityRemoved>0){
+    size_t pre = 0;
+    for (size_t a = 0; a<spec.size(); a++) pre += spec[a]->sizePrecursor();
+    for (size_t a = 0; a<spillList.size(); a++) pre += spillList[a].precursors;
+    double pct = (double)qualityRemovedPre / (pre + qualityRemovedPre) * 100;
+    cout << "  " << qualityRemoved << " spectra removed by the XCorr quality filter (" << qualityRemovedPre << " precursors, " << pct << "% of the estimated search cost)." << endl;
+    if (mlog != NULL) mlog->addMessage("XCorr quality filter removed " + to_string(qualityRemoved) + " spectra (" + to_string(qualityRemovedPre) + " precursors, " + to_string(pct) + "% of the estimated search cost).", true);
+  }
   //cout << totalScans << " total scans were loaded." <<  endl;
   //cout << totalPeaks << " total peaks in original data." << endl;
   //cout << collapsedPeaks << " peaks after collapsing." << endl;
@@ -1424,28 +1620,415 @@ bool MData::readSpectra(){
 
  // cout << "  " << specCounts << " spectra with " << peakCounts << " peaks will be analyzed." << endl;
 
-  //Build mass list - this orders all precursor masses, with an index pointing to the actual
-  //array position for the spectrum. This is because all spectra will have more than 1
-  //precursor mass
-  mMass m;
-  massList.clear();
-  for (int i = 0; i<spec.size(); i++){
-    m.index = i;
-    for (int j = 0; j<spec[i]->sizePrecursor(); j++){
-      m.mass = spec[i]->getPrecursor(j).monoMass;
-      massList.push_back(m);
+  if (spillFile != NULL) planChunks();
+  else buildMassList();
+  specTotal = (int)spec.size();
+  specOrder.clear();
+  for (int a = 0; a<specTotal; a++) specOrder.push_back(a);
+
+  if (bScans != NULL) delete[] bScans;
+  bScans = new bool[spec.size()];
+
+  return true;
+}
+
+//Thread-start function of the checkpoint writer
+void MData::checkpointProc(mCheckpointJob* j){
+  MData* d = j->data;
+  if (j->bSpectra && !d->writeCheckpointSpectra()) {
+    d->bCheckpointSpectra = false;
+    delete j;
+    return;
+  }
+  string fName = d->checkpointName();
+  string tName = fName + ".tmp";
+  FILE* f = fopen(tName.c_str(), "wb");
+  if (f == NULL){
+    cout << "ERROR: Cannot open: " << tName << endl;
+    delete j;
+    return;
+  }
+  if (!j->buf.empty()) fwrite(&j->buf[0], 1, j->buf.size(), f);
+  bool bErr = ferror(f) != 0;
+  if (fclose(f) != 0) bErr = true;
+  if (bErr) cout << "ERROR: Cannot write checkpoint: " << tName << endl;
+  else replaceFile(tName, fName);
+  delete j;
+}
+
+//Name of the checkpoint file; the processed spectra are in the same name with ".spectra" added
+string MData::checkpointName(){
+  if (params->shardCount>0) return params->outFile + ".shard" + to_string(params->shardIndex) + ".checkpoint";
+  return params->outFile + ".checkpoint";
+}
+
+//Name of the partial results file of shard i
+string MData::partialName(int i){
+  return params->outFile + ".shard" + to_string(i) + ".mpart";
+}
+
+//Restores the processed spectra and the search state of the last checkpoint, in place of reading
+//the spectra. The E-value histograms, top hits, and top peptides of each precursor found before
+//the checkpoint are restored too. A truncated checkpoint is rejected.
+bool MData::readCheckpoint(){
+  char magic[4];
+  char c;
+  int i, n, sz, order, cluster;
+  uint64_t u;
+  string fName = checkpointName();
+  string sName = fName + ".spectra";
+
+  for (size_t a = 0; a<spec.size(); a++) delete spec[a];
+  spec.clear();
+  specOrder.clear();
+
+  FILE* f = fopen(sName.c_str(), "rb");
+  if (f == NULL){
+    cout << "ERROR: Cannot open checkpoint: " << sName << endl;
+    return false;
+  }
+  if (fread(magic, 1, 4, f) != 4 || fread(&specTotal, sizeof(int), 1, f) != 1 || fread(&sz, sizeof(int), 1, f) != 1 || sz<0 || memcmp(magic, "MCKS", 4) != 0){
+    cout << "ERROR: Not a checkpoint file: " << sName << endl;
+    fclose(f);
+    return false;
+  }
+  for (i = 0; i<sz; i++){
+    MSpectrum* s = new MSpectrum(*params);
+    if (fread(&order, sizeof(int), 1, f) != 1 || fread(&cluster, sizeof(int), 1, f) != 1 || !s->readSpill(f)){
+      cout << "ERROR: Cannot read checkpoint: " << sName << endl;
+      delete s;
+      fclose(f);
+      return false;
     }
+    s->cluster = cluster;
+    spec.push_back(s);
+    specOrder.push_back(order);
   }
+  fclose(f);
 
-  //sort mass list from low to high
-  qsort(&massList[0], massList.size(), sizeof(mMass), compareMassList);
+  f = fopen(fName.c_str(), "rb");
+  if (f == NULL){
+    cout << "ERROR: Cannot open checkpoint: " << fName << endl;
+    return false;
+  }
+  if (fread(magic, 1, 4, f) != 4 || fread(&n, sizeof(int), 1, f) != 1 || memcmp(magic, "MCKP", 4) != 0 || n != sz){
+    cout << "ERROR: Checkpoint does not match its spectra: " << fName << endl;
+    fclose(f);
+    return false;
+  }
+  bool bOK = fread(&checkpoint.stage, sizeof(int), 1, f) == 1;
+  if (bOK && (bOK = fread(&u, sizeof(uint64_t), 1, f) == 1)) checkpoint.cursor = (size_t)u;
+  if (bOK && (bOK = fread(&u, sizeof(uint64_t), 1, f) == 1)) checkpoint.peptides = (size_t)u;
+  if (bOK) bOK = fread(&checkpoint.ppmPrecursor, sizeof(double), 1, f) == 1;
+  if (bOK) bOK = fread(&n, sizeof(int), 1, f) == 1 && n >= 0;
+  if (bOK){
+    checkpoint.adducts.resize(n);
+    if (n>0) bOK = fread(&checkpoint.adducts[0], sizeof(mAdduct), n, f) == (size_t)n;
+  }
+  if (bOK) bOK = fread(&n, sizeof(int), 1, f) == 1 && n >= 0;
+  if (bOK){
+    checkpoint.explained.assign(n, false);
+    for (i = 0; i<n && bOK; i++){
+      bOK = fread(&c, 1, 1, f) == 1;
+      checkpoint.explained[i] = (c != 0);
+    }
+  }
+  for (i = 0; i<sz && bOK; i++) bOK = spec[i]->readState(f);
+  fclose(f);
+  if (!bOK || checkpoint.cursor>checkpoint.peptides){
+    cout << "ERROR: Cannot read checkpoint: " << fName << endl;
+    return false;
+  }
 
+  buildMassList();
   if (bScans != NULL) delete[] bScans;
   bScans = new bool[spec.size()];
+  bCheckpointSpectra = true;
 
+  cout << "  Resuming from checkpoint: " << spec.size() << " spectra; " << checkpoint.cursor << " of " << checkpoint.peptides << " peptides searched." << endl;
+  if (mlog != NULL) mlog->addMessage("Resumed from checkpoint after " + to_string(checkpoint.cursor) + " of " + to_string(checkpoint.peptides) + " peptides.", true);
   return true;
 }
 
+//Combines the partial results files of all shards into the spectra to export. The first shard's
+//file gives the number of shards. Spectra are restored in acquisition order, and the top hits,
+//top peptides, and E-value histograms of a spectrum searched by several shards (peptide sharding)
+//are merged as in a single search.
+bool MData::readPartials(){
+  char magic[4];
+  int i, j;
+  int count = 0;
+  int total = 0;
+  int n, mode, sz, order;
+  vector<MSpectrum*> v;
+
+  for (size_t a = 0; a<spec.size(); a++) delete spec[a];
+  spec.clear();
+
+  for (i = 1; i == 1 || i <= count; i++){
+    string fName = partialName(i);
+    FILE* f = fopen(fName.c_str(), "rb");
+    if (f == NULL){
+      cout << "ERROR: Cannot open shard results: " << fName << endl;
+      for (size_t a = 0; a<v.size(); a++) delete v[a];
+      return false;
+    }
+    fread(magic, 1, 4, f);
+    fread(&j, sizeof(int), 1, f);
+    fread(&n, sizeof(int), 1, f);
+    fread(&mode, sizeof(int), 1, f);
+    fread(&sz, sizeof(int), 1, f);
+    if (memcmp(magic, "MPRT", 4) != 0 || j != i || (i>1 && (n != count || sz != total))){
+      cout << "ERROR: Shard results do not match: " << fName << endl;
+      fclose(f);
+      for (size_t a = 0; a<v.size(); a++) delete v[a];
+      return false;
+    }
+    if (i == 1){
+      count = n;
+      total = sz;
+      v.assign(total, NULL);
+    }
+    fread(&sz, sizeof(int), 1, f);
+    for (j = 0; j<sz; j++){
+      MSpectrum* s = new MSpectrum(*params);
+      if (fread(&order, sizeof(int), 1, f) != 1 || order<0 || order >= total || !s->readSpill(f)){
+        cout << "ERROR: Cannot read shard results: " << fName << endl;
+        delete s;
+        fclose(f);
+        for (size_t a = 0; a<v.size(); a++) delete v[a];
+        return false;
+      }
+      if (v[order] == NULL) v[order] = s;
+      else delete s;
+      if (!v[order]->readState(f)){
+        cout << "ERROR: Cannot read shard results: " << fName << endl;
+        fclose(f);
+        for (size_t a = 0; a<v.size(); a++) delete v[a];
+        return false;
+      }
+    }
+    fclose(f);
+  }
+
+  for (size_t a = 0; a<v.size(); a++){
+    if (v[a] != NULL) spec.push_back(v[a]);
+  }
+  buildMassList();
+  if (bScans != NULL) delete[] bScans;
+  bScans = new bool[spec.size()];
+
+  cout << "  Merged the results of " << count << " shards (" << spec.size() << " spectra)." << endl;
+  if (mlog != NULL) mlog->addMessage("Merged the results of " + to_string(count) + " shards.", true);
+  return true;
+}
+
+//Keeps only the spectra of shard i of n. Spectra are ranked by their lowest precursor mass and
+//split into n ranges of equal count, so every shard makes the same split.
+void MData::selectShard(int i, int n){
+  vector<mMass> v;
+  mMass m;
+  for (int a = 0; a<(int)spec.size(); a++){
+    m.index = a;
+    m.mass = 0;
+    for (int b = 0; b<spec[a]->sizePrecursor(); b++){
+      if (b == 0 || spec[a]->getPrecursor(b).monoMass<m.mass) m.mass = spec[a]->getPrecursor(b).monoMass;
+    }
+    v.push_back(m);
+  }
+  if (v.size()>0) qsort(&v[0], v.size(), sizeof(mMass), compareMassList);
+
+  size_t first = v.size()*(i - 1) / n;
+  size_t last = v.size()*i / n;
+  vector<bool> keep(spec.size(), false);
+  for (size_t a = first; a<last; a++) keep[v[a].index] = true;
+
+  vector<MSpectrum*> vs;
+  vector<int> vo;
+  for (size_t a = 0; a<spec.size(); a++){
+    if (keep[a]) {
+      vs.push_back(spec[a]);
+      vo.push_back(specOrder[a]);
+    } else delete spec[a];
+  }
+  spec.swap(vs);
+  specOrder.swap(vo);
+  buildMassList();
+  if (bScans != NULL) delete[] bScans;
+  bScans = new bool[spec.size()];
+
+  cout << "  Shard " << i << " of " << n << ": " << spec.size() << " spectra, " << getMinMass() << " - " << getMaxMass() << " Da." << endl;
+}
+
+//Queues a checkpoint of the search: the processed spectra, the first time, and the search state
+//with the top hits, top peptides, and E-value histograms of every spectrum. The state is copied here, between
+//peptide blocks, and saved by the writer thread while the search goes on. Returns false, skipping
+//this checkpoint, if the previous one is still being written.
+bool MData::writeCheckpoint(mCheckpoint& cp){
+  if (checkpointWriter != NULL && (checkpointWriter->NumActiveThreads()>0 || checkpointWriter->NumParamsQueued()>0)) return false;
+
+  mCheckpointJob* j = new mCheckpointJob;
+  j->data = this;
+  j->bSpectra = !bCheckpointSpectra;
+  bCheckpointSpectra = true;
+
+  int sz = (int)spec.size();
+  int n;
+  uint64_t u;
+  appendBytes(j->buf, "MCKP", 4);
+  appendBytes(j->buf, &sz, 1);
+  appendBytes(j->buf, &cp.stage, 1);
+  u = cp.cursor;
+  appendBytes(j->buf, &u, 1);
+  u = cp.peptides;
+  appendBytes(j->buf, &u, 1);
+  appendBytes(j->buf, &cp.ppmPrecursor, 1);
+  n = (int)cp.adducts.size();
+  appendBytes(j->buf, &n, 1);
+  if (n>0) appendBytes(j->buf, &cp.adducts[0], n);
+  n = (int)cp.explained.size();
+  appendBytes(j->buf, &n, 1);
+  for (int i = 0; i<n; i++) j->buf.push_back(cp.explained[i] ? 1 : 0);
+  for (size_t a = 0; a<spec.size(); a++) spec[a]->saveState(j->buf);
+
+  if (checkpointWriter == NULL) checkpointWriter = new ThreadPool<mCheckpointJob*>(checkpointProc, 1, 1, 1);
+  checkpointWriter->Launch(j);
+  return true;
+}
+
+//Writes the processed spectra of the checkpoint, with their acquisition order and cluster. The
+//spectra do not change during the search, so they are read here while it continues.
+bool MData::writeCheckpointSpectra(){
+  string fName = checkpointName() + ".spectra";
+  string tName = fName + ".tmp";
+  FILE* f = fopen(tName.c_str(), "wb");
+  if (f == NULL){
+    cout << "ERROR: Cannot open: " << tName << endl;
+    return false;
+  }
+  int sz = (int)spec.size();
+  fwrite("MCKS", 1, 4, f);
+  fwrite(&specTotal, sizeof(int), 1, f);
+  fwrite(&sz, sizeof(int), 1, f);
+  for (size_t a = 0; a<spec.size(); a++){
+    fwrite(&specOrder[a], sizeof(int), 1, f);
+    fwrite(&spec[a]->cluster, sizeof(int), 1, f);
+    spec[a]->writeSpill(f);
+  }
+  bool bErr = ferror(f) != 0;
+  if (fclose(f) != 0) bErr = true;
+  if (bErr){
+    cout << "ERROR: Cannot write checkpoint: " << tName << endl;
+    return false;
+  }
+  return replaceFile(tName, fName);
+}
+
+//Writes the spectra and their search state (see MSpectrum::saveState) to the partial results file
+//of this shard
+bool MData::writePartial(){
+  string fName = partialName(params->shardIndex);
+  FILE* f = fopen(fName.c_str(), "wb");
+  if (f == NULL){
+    cout << "ERROR: Cannot open: " << fName << endl;
+    return false;
+  }
+  int sz = (int)spec.size();
+  fwrite("MPRT", 1, 4, f);
+  fwrite(&params->shardIndex, sizeof(int), 1, f);
+  fwrite(&params->shardCount, sizeof(int), 1, f);
+  fwrite(&params->shardMode, sizeof(int), 1, f);
+  fwrite(&specTotal, sizeof(int), 1, f);
+  fwrite(&sz, sizeof(int), 1, f);
+  vector<char> v;
+  for (size_t a = 0; a<spec.size(); a++){
+    fwrite(&specOrder[a], sizeof(int), 1, f);
+    spec[a]->writeSpill(f);
+    v.clear();
+    spec[a]->saveState(v);
+    fwrite(&v[0], 1, v.size(), f);
+  }
+  fclose(f);
+  cout << "  Partial results written to " << fName << endl;
+  return true;
+}
+
+//Replaces the spectra in memory with those of chunk i of the temporary store. The spectra are
+//kept in acquisition order within the chunk.
+bool MData::loadChunk(size_t i){
+  for (size_t a = 0; a<spec.size(); a++) delete spec[a];
+  spec.clear();
+  massList.clear();
+  if (spillFile == NULL || i >= chunkList.size()) return false;
+
+  size_t last = spillList.size();
+  if (i + 1<chunkList.size()) last = chunkList[i + 1];
+  vector<mSpill> v(spillList.begin() + chunkList[i], spillList.begin() + last);
+  sort(v.begin(), v.end(), compareSpillOffset);
+
+  for (size_t a = 0; a<v.size(); a++){
+#ifdef _WIN32
+    _fseeki64(spillFile, v[a].offset, SEEK_SET);
+#else
+    fseeko(spillFile, (off_t)v[a].offset, SEEK_SET);
+#endif
+    MSpectrum* s = new MSpectrum(*params);
+    if (!s->readSpill(spillFile)){
+      cout << "ERROR: Cannot read temporary spectrum store: " << spillName << endl;
+      delete s;
+      return false;
+    }
+    spec.push_back(s);
+  }
+
+  buildMassList();
+  if (bScans != NULL) delete[] bScans;
+  bScans = new bool[spec.size()];
+  return true;
+}
+
+//Orders the stored spectra by their lowest precursor mass and splits them into chunks that fit
+//the memory budget. A chunk holds at least one spectrum.
+void MData::planChunks(){
+  fflush(spillFile);
+  sort(spillList.begin(), spillList.end(), compareSpillMass);
+
+  size_t budget = (size_t)params->spectrumMemory * 1048576;
+  size_t total = 0;
+  chunkList.clear();
+  for (size_t a = 0; a<spillList.size(); a++){
+    if (a == 0 || total + spillList[a].bytes>budget) {
+      chunkList.push_back(a);
+      total = 0;
+    }
+    total += spillList[a].bytes;
+  }
+
+  cout << "  " << spillList.size() << " spectra (" << spillOffset / 1048576 << " MB) stored in a temporary file; searching in " << chunkList.size() << " precursor mass chunks." << endl;
+  if (mlog != NULL) mlog->addMessage("Spectra stored in a temporary file and searched in " + to_string(chunkList.size()) + " chunks of up to " + to_string(params->spectrumMemory) + " MB.", true);
+}
+
+//Closes and removes the temporary spectrum store
+void MData::releaseSpill(){
+  if (spillFile != NULL) {
+    fclose(spillFile);
+    remove(spillName.c_str());
+  }
+  spillFile = NULL;
+  spillOffset = 0;
+  spillList.clear();
+  chunkList.clear();
+}
+
+//Removes the checkpoint files once the search they belong to is finished
+void MData::removeCheckpoint(){
+  finishCheckpoint();
+  string fName = checkpointName();
+  remove(fName.c_str());
+  remove((fName + ".spectra").c_str());
+  bCheckpointSpectra = false;
+}
+
 void MData::releaseHardklor(){
   for (int a = 0; a<params->threads; a++){
     delete h[a];
@@ -1799,6 +2382,27 @@ int MData::compareMassList(const void *p1, const void *p2){
   }
 }
 
+bool MData::compareSpillMass(const mSpill& a, const mSpill& b){
+  if (a.mass == b.mass) return a.offset<b.offset;
+  return a.mass<b.mass;
+}
+
+bool MData::compareSpillOffset(const mSpill& a, const mSpill& b){
+  return a.offset<b.offset;
+}
+
+//Replaces fName with the finished temporary file tName, so fName is never left partly written
+bool MData::replaceFile(string& tName, string& fName){
+#ifdef _WIN32
+  remove(fName.c_str());
+#endif
+  if (rename(tName.c_str(), fName.c_str()) != 0){
+    cout << "ERROR: Cannot replace: " << fName << endl;
+    return false;
+  }
+  return true;
+}
+
 int MData::getCharge(MSpectrum& s, int index, int next){
   double mass;
 
@@ -2077,6 +2681,13 @@ void MData::processMS2(mMS2struct* s){
   s->pls->kojakXCorr(tempRawData[j], tmpFastXcorrData[j], fastXcorrData[j], preProcess[j]);
   memoryPool[j] = false;
 
+  //drop spectra with too little information left after the transform
+  if (s->pls->xcorrBins < params->minXCorrBins || s->pls->xcorrCoverage < params->minXCorrCoverage){
+    s->state = 5;
+    s->thread = false;
+    return;
+  }
+
   s->state = 3;
   s->thread = false;
 }
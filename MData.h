@@ -51,6 +51,33 @@ typedef struct mMS2struct{
   }
 } mMS2struct;
 
+//A spectrum in the temporary store of a chunked (spectrum_memory) search
+typedef struct mSpill{
+  double    mass;       //lowest precursor mass
+  int64_t   offset;     //position in the store
+  size_t    bytes;      //estimated memory of the spectrum when loaded and searched
+  int       precursors;
+} mSpill;
+
+//Search state saved at a checkpoint, and restored to resume the search
+typedef struct mCheckpoint{
+  int     stage;        //search stage in progress (see MAnalysis::searchStage)
+  size_t  cursor;       //peptides before this index of the peptide list are searched
+  size_t  peptides;     //size of the peptide list, to check that a resumed search uses the same one
+  double  ppmPrecursor; //precursor tolerance, after any recalibration
+  std::vector<mAdduct> adducts;   //adduct masses searched, after any adaptive first pass
+  std::vector<bool>    explained; //spectra explained by the closed search stage
+} mCheckpoint;
+
+class MData;
+
+//A checkpoint queued for the checkpoint writer thread
+typedef struct mCheckpointJob{
+  MData*  data;
+  bool    bSpectra;       //also write the store of processed spectra
+  std::vector<char> buf;  //serialized search state
+} mCheckpointJob;
+
 class MData {
 public:
 
@@ -62,28 +89,44 @@ public:
   MSpectrum& at(const int& i);
   MSpectrum* getSpectrum(const int& i);
 
+  void      buildMassList     ();
+  void      closeResults      ();
+  void      clusterSpectra    ();
+  bool      createResults     (MDatabase& db);
   bool      createDiag        (FILE*& f);
   NeoPepXMLParser* createPepXML(std::string& str, MDatabase& db);
   bool      createPercolator  (FILE*& f, FILE*& f2);
   bool      createTXT         (FILE*& f);
+  void      finishCheckpoint  ();
   void      diagSinglet       ();
   void      exportPepXML      (NeoPepXMLParser*& p, std::vector<mResults>& r);
   void      exportPercolator  (FILE*& f, std::vector<mResults>& r);
+  void      exportResults     (MDatabase& db);
   void      exportTXT         (FILE*& f, std::vector<mResults>& r);
   bool      getBoundaries     (double mass1, double mass2, std::vector<int>& index, bool* buffer);
   bool      getBoundaries2    (double mass, double prec, std::vector<int>& index, bool* buffer);
+  mCheckpoint& getCheckpoint  ();
+  size_t    getChunkCount     ();
   double    getMaxMass        ();
   double    getMinMass        ();
   void      outputDiagnostics (FILE* f, MSpectrum& s, MDatabase& db);
   bool      outputResults     (MDatabase& db);
   void      processPSM        (MSpectrum& s, mScoreCard3& sc, mResults& r);
   void      processSpectrumInfo (MSpectrum& s, mResults& r);
+  bool      loadChunk         (size_t i);
+  bool      readCheckpoint    ();
+  bool      readPartials      ();
   bool      readSpectra       ();
+  void      releaseSpill      ();
+  void      removeCheckpoint  ();
+  void      selectShard       (int i, int n);
   void      setAdductSites    (std::string s);
   void      setLog            (MLog* c);
   void      setParams         (MParams* p);
   void      setVersion        (const char* v);
   int       size              ();
+  bool      writeCheckpoint   (mCheckpoint& cp);
+  bool      writePartial      ();
 
   bool*     getAdductSites    ();
 
@@ -93,6 +136,8 @@ private:
   bool* bScans;
   char               version[32];
   std::vector<MSpectrum*>  spec;
+  std::vector<int>         specOrder;  //acquisition position of each spectrum, for merging shards
+  int                      specTotal;  //spectra read, before selecting a shard
   std::vector<mMass>      massList;
   static mParams*           params;
   MParams*           parObj;
@@ -100,6 +145,29 @@ private:
   static MLog*              mlog;
   int                pepXMLindex;
 
+  //Open result files, between createResults and closeResults
+  FILE*              fTXT;
+  FILE*              fPerc;
+  FILE*              fPerc2;
+  FILE*              fDiag;
+  std::string        fXML;
+  NeoPepXMLParser*   pepxml;
+
+  //Temporary spectrum store of a chunked search. Spectra are written as they finish processing,
+  //then ordered by precursor mass and read back one chunk at a time.
+  FILE*              spillFile;
+  std::string        spillName;
+  int64_t            spillOffset;
+  std::vector<mSpill> spillList;
+  std::vector<size_t> chunkList;  //first spillList entry of each chunk
+  float              lastRTime;   //retention time of the last finished MS2 spectrum
+
+  //Checkpoints of the search, written by a separate thread while the search continues. The
+  //processed spectra are written once; the search state is replaced at every checkpoint.
+  ThreadPool<mCheckpointJob*>* checkpointWriter;
+  mCheckpoint        checkpoint;        //state read by readCheckpoint
+  bool               bCheckpointSpectra; //the processed spectra are written or were read
+
   //Common memory to be shared by all threads during spectral processing
   static bool* memoryPool;
   static double** tempRawData;
@@ -126,6 +194,10 @@ private:
   //static void xCorrProc(MSpectrum* s);
 
   //spectral processing functions
+  void addSpectrum(MSpectrum* s);
+  static void checkpointProc(mCheckpointJob* j);
+  bool writeCheckpointSpectra();
+  void planChunks();
   static void averageScansCentroid(std::vector<MSToolkit::Spectrum*>& s, MSToolkit::Spectrum& avg, double min, double max);
   static int  findPeak(MSToolkit::Spectrum* s, double mass);
   static int  findPeak(MSToolkit::Spectrum* s, double mass, double prec);
@@ -140,8 +212,13 @@ private:
   //Utilities
   static void        centroid(MSToolkit::Spectrum* s, void* out, double resolution, int instrument = 0, int type=0); //0=MSpectrum, 1=Spectrum
   static void        collapseSpectrum(MSpectrum& s);
+  std::string checkpointName    ();
   static int  compareInt        (const void *p1, const void *p2);
   static int  compareMassList   (const void *p1, const void *p2);
+  std::string partialName       (int i);
+  static bool compareSpillMass  (const mSpill& a, const mSpill& b);
+  static bool compareSpillOffset(const mSpill& a, const mSpill& b);
+  static bool replaceFile       (std::string& tName, std::string& fName);
   static int compareScanBinRev2(const void *p1, const void *p2);
   static bool compareSpecPoint(const mSpecPoint& p1, const mSpecPoint& p2){ return p1.mass<p2.mass; }
   static int         getCharge(MSpectrum& s, int index, int next);
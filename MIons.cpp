@@ -56,6 +56,13 @@ MIons::MIons(){
   modList=NULL;
   pep1=NULL;
   maxModCount=0;
+  maskLen=0;
+  ladderLen=0;
+  ladderProtein=-1;
+  ladderStart=-1;
+  ladderReuse=0;
+  ladderTotal=0;
+  bAdductIons=true;
   ionCount=0;
 }
 
@@ -74,236 +81,307 @@ void MIons::addMod(char mod, bool xl, double mass){
   aaMod[mod].mod[aaMod[mod].count++].mass=mass;
 }
 
-void MIons::buildModIons2(bool bAdduct) {
-  //cout << "buildModIons2: " << (int)bAdduct << endl;
-  double mMass;
-
-  mPrecursor.clear();
+//First phase of ion generation: enumerates every variant of the current peptide (variable
+//modifications and, if bAdduct, open modification sites) with its precursor mass and mask.
+//No fragment ions are computed here; call buildModIons() afterwards for the variants of interest.
+void MIons::buildModVariants(bool bAdduct) {
   pepLinks.clear();
   pepMass.clear();
-  pepMods.clear();
+  pepModCount.clear();
   maxLink = -99;
+  bAdductIons = bAdduct;
 
   vPeaks.clear();
-  mPeaks.clear();
   vPeaksRev.clear();
-  mPeaksRev.clear();
 
   //set up boundaries
   ionCount = pep1Len;
+  maskLen = pep1Len+2;
 
-  //peptide number
-  pepCount = 0;
-
-  modMask=string(pep1Len+2,'0');
-  mPrecursor.insert(pair<string, size_t>(modMask, pepCount));
-
-  //b- & y-ions from first peptide
+  //unmodified peptide
+  pepMasks.assign(maskLen,0);
   pepMass.push_back(pep1Mass);
   pepMassMin = pepMassMax = pep1Mass;
-  mMass = aaMass['n'];
   pepMass[0] += aaMass['n'];
-  if (nPep1) {
-    mMass += aaMass['$'];
-    pepMass[0] += aaMass['$'];
-  }
-  pepMods.emplace_back();
-  if(bAdduct) {
-    //cout << "Adduct: " << vPeaks.size() << "\t" << vPeaksRev.size() << endl;
-    //TODO: Combine modIonsMaskRec and modIonsNew into single function.
-    //So that you don't have to clear and repeat as is done below.
-    modIonsMaskRec(0,mMass,-99,pepCount,0,-1,modMask);
-    vPeaks.clear();
-    mPeaks.clear();
-
-    //displayPrecursors();
-    //if (pepseq.compare("NFPPSQDASGDLYTTSSQLTLPATQCLAGK") == 0) displayPrecursors();
-    mMass = pep1Mass+aaMass['n'];
-    if(nPep1) mMass += aaMass['$'];
-    map<string, size_t>::iterator it = mPrecursor.begin();
-    while (it != mPrecursor.end()) {
-      modIonsNew(it->first, it->second, mMass);
-      it++;
-    }
-  } else {
-    //cout << "NoAdduct" << endl;
-    modIonsMaskRecNoAdduct(0, mMass, pepCount, 0, -1, modMask);
-    //displayPrecursors();
-    //if (pepseq.compare("NFPPSQDASGDLYTTSSQLTLPATQCLAGK") == 0) displayPrecursors();
-    mMass = pep1Mass + aaMass['n'];
-    if (nPep1) mMass += aaMass['$'];
-    map<string, size_t>::iterator it = mPrecursor.begin();
-    while (it != mPrecursor.end()) {
-      modIonsNew(it->first, it->second, mMass,3);
-      it++;
+  if (nPep1) pepMass[0] += aaMass['$'];
+  pepModCount.push_back(0);
+  pepLinks.push_back(-99);
+  if (pepMass[0] < pepMassMin) pepMassMin = pepMass[0];
+  if (pepMass[0] > pepMassMax) pepMassMax = pepMass[0];
+
+  if(bAdduct) modIonsMaskRec(0,-99,0,0,-1);
+  else modIonsMaskRecNoAdduct(0,0,0,-1);
+  pepCount = pepMass.size();
+  orderVariants();
+
+  //nothing is selected for fragment ion generation until the caller says so
+  pepSelect.assign(pepCount,false);
+
+  //The closed search uses the variants without open modification sites and, as in
+  //modIonsMaskRecNoAdduct(), without modifications on the last residue.
+  pepClosed.assign(pepCount,true);
+  if(bAdduct){
+    for(size_t i=0;i<pepCount;i++){
+      const unsigned char* mask=&pepMasks[i*maskLen];
+      if(pepLinks[i]!=-99 || mask[pep1Len-1]!=0 || mask[pep1Len]!=0 || mask[pep1Len+1]!=0) pepClosed[i]=false;
     }
   }
-  pepCount++; //Double-check this?
-
-  //build y-ions here
-  //use same mMass?
-  //mMass = 18.0105633 + aaMass['c'];
-  //if (cPep1) mMass += aaMass['$']; //'%' instead??
-  if (bAdduct) {
-    map<string, size_t>::iterator it = mPrecursor.begin();
-    while (it != mPrecursor.end()) {
-      modIonsRecNew(it->first, it->second,pepMass[it->second]);
-      it++;
-    }
-  } else {
-    map<string, size_t>::iterator it = mPrecursor.begin();
-    while (it != mPrecursor.end()) {
-      modIonsRecNew(it->first, it->second,pepMass[it->second],3);
-      it++;
-    }
+}
+
+//Second phase of ion generation: builds the b- and y-ion ladders for all variants
+//flagged in pepSelect. Variants that are not selected receive no fragment ions.
+void MIons::buildModIons() {
+  size_t stop = bAdductIons ? 2 : 3;
+  size_t i;
+
+  fragRec.clear();
+  fragRecRev.clear();
+
+  //selected variants, in mask order for the b-ions and reverse mask order for the y-ions
+  ladderOrder.clear();
+  ladderRank.resize(pepCount);
+  for(i=0;i<pepOrder.size();i++){
+    if(!pepSelect[pepOrder[i]]) continue;
+    ladderRank[pepOrder[i]] = ladderOrder.size();
+    ladderOrder.push_back(pepOrder[i]);
+  }
+  ladderOrderRev.assign(ladderOrder.begin(),ladderOrder.end());
+  sort(ladderOrderRev.begin(), ladderOrderRev.end(), mMaskCompareRev(&pepMasks[0], maskLen));
+
+  ladderLen = (maskLen>stop) ? maskLen-stop : 0;
+  if(maskLen>stop){
+    modIonsNew(maskLen-stop);
+    modIonsRecNew(maskLen-stop);
   }
 
+  buildPeaks(fragRec,ladderOrder,vPeaks);
+  buildPeaks(fragRecRev,ladderOrderRev,vPeaksRev);
 }
 
 //For diagnostics. Never called otherwise.
 void MIons::displayPrecursors() {
-  map<string, size_t>::iterator it = mPrecursor.begin();
-  while (it != mPrecursor.end()) {
-    cout << it->first << "\t" << it->second << endl;
-    cout << "\t" << pepMass[it->second] << endl;
-    if (pepMods[it->second].mods.size() > 0) {
-      for (size_t a = 0;a < pepMods[it->second].mods.size();a++) {
-        cout << "\t" << (int)pepMods[it->second].mods[a].pos << "," << pepMods[it->second].mods[a].mass << "," << (int)pepMods[it->second].mods[a].term;
+  vector<mPepMod> mods;
+  for(size_t i=0;i<pepOrder.size();i++){
+    size_t v=pepOrder[i];
+    for(size_t a=0;a<maskLen;a++){
+      unsigned char c = pepMasks[v*maskLen+a];
+      if(c==MASK_ADDUCT) cout << 'x';
+      else cout << (char)('0'+c);
+    }
+    cout << "\t" << v << endl;
+    cout << "\t" << pepMass[v] << endl;
+    getVariantMods(v,mods);
+    if (mods.size() > 0) {
+      for (size_t a = 0;a < mods.size();a++) {
+        cout << "\t" << (int)mods[a].pos << "," << mods[a].mass << "," << (int)mods[a].term;
       }
       cout << endl;
     }
-    it++;
   }
 }
 
-void MIons::modIonsNew(const string& mask, size_t pepIndex, double mass, size_t stop) {
-  //cout << "modIonsNew: " << mask << " " << pepIndex << " " << mass << endl;
-  double m = mass;
-  bool bAdduct = false;
-  int iAdduct = -1;
-
-  //add all modification masses
-  for (int a = 0; a < mask.size() - 2; a++) {
-    if (mask[a] != '0') {
-      //cout << mask << " has mod at: " << a << "  new mass=" << m << " val=" << mask[a] - 49 << " aa:" << pep1[a] << " wtf:" << aaMod[pep1[a]].mod[mask[a] - 49].mass << endl;
-      m += aaMod[pep1[a]].mod[mask[a] - 49].mass;
+//Builds the b-ion ladders (n positions) of the selected variants as a prefix trie. Variants
+//are visited in mask order, so all variants sharing a mask prefix are adjacent and each
+//distinct prefix fragment is computed and recorded once, for the whole run of variants.
+//Open modification (negative) fragments are shared only by variants with the same precursor mass.
+void MIons::modIonsNew(size_t n) {
+  const unsigned char* mask;
+  const unsigned char* prev = NULL;
+  size_t a, k, lcp;
+  size_t v;
+  double m;
+  bool bZero;
+
+  ladderMass.resize(n);
+  ladderAdduct.resize(n);
+  ladderRec.resize(n);
+
+  for (k = 0; k < ladderOrder.size(); k++) {
+    v = ladderOrder[k];
+    mask = &pepMasks[v*maskLen];
+
+    //length of the prefix shared with the previous variant
+    lcp = 0;
+    if (prev != NULL) {
+      while (lcp < n && mask[lcp] == prev[lcp]) lcp++;
+    }
+    prev = mask;
+
+    //extend fragments of the shared prefix to this variant
+    for (a = 0; a < lcp; a++) {
+      mFragRec& f = fragRec[ladderRec[a]];
+      if (!ladderAdduct[a]) f.hi = k + 1;
+      else if (f.pepMass == pepMass[v] && f.hi == k) f.hi = k + 1;
+      else ladderRec[a] = addFragment(fragRec, -ladderMass[a], pepMass[v], k, (int)(k*n + a));
     }
-  }
-  double trueMass = m;
-  m = 0;
-
-  //process n-term here
-
-  //process sequence
-  for (int a = 0; a < mask.size() - stop; a++) {
-    if (mask[a] == 'x') bAdduct = true;
-    if (mask[a] != '0') m += aaMod[pep1[a]].mod[mask[a] - 49].mass;
-    m += aaMass[pep1[a]];
-    if(bAdduct) addPeakNew(-m, trueMass, pepIndex);
-    else addPeakNew(m, trueMass, pepIndex);
-  }
 
-  //process c-term here
+    //new branch of the trie. The first variant has the longest unmodified prefix, which
+    //may already be in the ladder cache from an overlapping peptide.
+    bZero = (k == 0);
+    for (a = lcp; a < n; a++) {
+      ladderTotal++;
+      if (bZero && mask[a] == 0) {
+        if (a < ladderCache.size()) {
+          m = ladderCache[a];
+          ladderReuse++;
+        } else {
+          m = (a == 0) ? 0 : ladderMass[a - 1];
+          m += aaMass[pep1[a]];
+          ladderCache.push_back(m);
+        }
+        ladderMass[a] = m;
+        ladderAdduct[a] = false;
+        ladderRec[a] = addFragment(fragRec, m, 0, k, (int)(k*n + a));
+        continue;
+      }
+      bZero = false;
+      m = (a == 0) ? 0 : ladderMass[a - 1];
+      ladderAdduct[a] = (a == 0) ? false : ladderAdduct[a - 1];
+      if (mask[a] == MASK_ADDUCT) ladderAdduct[a] = true;
+      else if (mask[a] != 0) m += aaMod[pep1[a]].mod[mask[a] - 1].mass;
+      m += aaMass[pep1[a]];
+      ladderMass[a] = m;
+      if (ladderAdduct[a]) ladderRec[a] = addFragment(fragRec, -m, pepMass[v], k, (int)(k*n + a));
+      else ladderRec[a] = addFragment(fragRec, m, 0, k, (int)(k*n + a));
+    }
+  }
 }
 
-void MIons::modIonsRecNew(const string& mask, size_t pepIndex, double mass, size_t stop){
-  //cout << "modIonsRecNew: " << mask << " " << pepIndex << " " << mass << endl;
-  double m=mass;
-  int iAdduct=-1;
-
-  //add all modification masses
-  for (int a = 0; a < mask.size() - 2; a++) {
-    if(mask[a]=='x') iAdduct=a;
-    //else if(mask[a]!='0'){
-    //  cout << mask << " has mod at: " << a << "  new mass=" << m << " val=" << mask[a] - 49 << " aa:" << pep1[a] << " wtf:" << aaMod[pep1[a]].mod[mask[a] - 49].mass << endl;
-    //  m+=aaMod[pep1[a]].mod[mask[a]-49].mass;
-    //}
+//Builds the y-ion ladders (n positions) of the selected variants as a suffix trie. The y-ion
+//at position a is the unmodified ladder plus the mods after a, so variants that share a mask
+//suffix (adjacent in reverse mask order) share their fragments.
+void MIons::modIonsRecNew(size_t n) {
+  const unsigned char* mask;
+  const unsigned char* prev = NULL;
+  size_t a, k, lcs, shared;
+  size_t v;
+  int seq;
+  double m;
+
+  //unmodified ladder
+  ladderBase.resize(n);
+  m = pepMass[0];
+  for (a = 0; a < n; a++) {
+    m -= aaMass[pep1[a]];
+    ladderBase[a] = m;
   }
-  double trueMass=m;
-  //cout << "trueMass: " << m << endl;
-
-  //process n-term here
-
-  //process sequence
-  for(int a=0;a<mask.size()-stop;a++){
-    if(mask[a]!='0' && mask[a]!='x'){
-      if (a<iAdduct)addPeakRevNew((aaMass[pep1[a]]+aaMod[pep1[a]].mod[mask[a] - 49].mass) - m, trueMass, pepIndex);
-      else {
-        //cout << "Add peak1: " << m << " - " << (aaMass[pep1[a]] + aaMod[pep1[a]].mod[mask[a] - 49].mass) << " " << trueMass << endl;
-        addPeakRevNew(m - (aaMass[pep1[a]] + aaMod[pep1[a]].mod[mask[a] - 49].mass), trueMass, pepIndex);
-      }
-      m -= (aaMass[pep1[a]]+ aaMod[pep1[a]].mod[mask[a] - 49].mass);
-    } else {
-      if(a <iAdduct)addPeakRevNew(aaMass[pep1[a]]-m, trueMass, pepIndex);
-      else {
-        //cout << "Add peak2: " << m << " - " << aaMass[pep1[a]] << " " << trueMass << endl;
-        addPeakRevNew(m - aaMass[pep1[a]], trueMass, pepIndex);
+
+  ladderModMass.resize(maskLen);
+  ladderAdduct.resize(maskLen);
+  ladderRec.resize(n);
+
+  for (k = 0; k < ladderOrderRev.size(); k++) {
+    v = ladderOrderRev[k];
+    mask = &pepMasks[v*maskLen];
+
+    //length of the suffix shared with the previous variant; positions from shared onward
+    //have identical fragments
+    lcs = 0;
+    if (prev != NULL) {
+      while (lcs < maskLen && mask[maskLen - 1 - lcs] == prev[maskLen - 1 - lcs]) lcs++;
+    }
+    prev = mask;
+    shared = (lcs == maskLen) ? 0 : maskLen - 1 - lcs;
+
+    //mod mass and adduct after each position, accumulated from the c-terminus
+    if (lcs == 0) {
+      ladderModMass[maskLen - 1] = 0;
+      ladderAdduct[maskLen - 1] = false;
+    }
+    for (a = shared; a-- > 0;) {
+      ladderModMass[a] = ladderModMass[a + 1];
+      ladderAdduct[a] = ladderAdduct[a + 1];
+      if (mask[a + 1] == MASK_ADDUCT) {
+        if (a + 1 < (size_t)pep1Len) ladderAdduct[a] = true;
+      } else if (mask[a + 1] != 0) ladderModMass[a] += aaMod[pep1[a + 1]].mod[mask[a + 1] - 1].mass;
+    }
+
+    for (a = 0; a < n; a++) {
+      seq = (int)(ladderRank[v] * n + a);
+      if (a >= shared) {
+        mFragRec& f = fragRecRev[ladderRec[a]];
+        if (!ladderAdduct[a] || (f.pepMass == pepMass[v] && f.hi == k)) {
+          f.hi = k + 1;
+          if (seq < f.seq) f.seq = seq;
+          continue;
+        }
       }
-      m-=aaMass[pep1[a]];
+      m = ladderBase[a] + ladderModMass[a];
+      if (ladderAdduct[a]) ladderRec[a] = addFragment(fragRecRev, -m, pepMass[v], k, seq);
+      else ladderRec[a] = addFragment(fragRecRev, m, 0, k, seq);
     }
   }
+}
 
-  //process c-term here
+//Records a fragment ion of variant at position lo of the ladder order. Returns its index.
+//Fragments are merged into peaks by buildPeaks().
+size_t MIons::addFragment(vector<mFragRec>& v, double mass, double pepMass, size_t lo, int seq) {
+  mFragRec f;
+  f.key = (int)(mass * 10);
+  f.seq = seq;
+  f.full = bAdductIons && (size_t)seq % ladderLen == ladderLen - 1; //seq is rank*ladderLen+position
+  f.mass = mass;
+  f.pepMass = pepMass;
+  f.lo = lo;
+  f.hi = lo + 1;
+  v.push_back(f);
+  return v.size() - 1;
 }
 
-//Abstract this and combine with addPeakRevNew
-void MIons::addPeakNew(double mass, double pepMass, size_t pepIndex) {
-  //cout << "addPeakNew: " << mass << "\t" << pepMass << "\t" << pepIndex << endl;
-  map<int, size_t>::iterator it;
-  map<int, size_t>::iterator it2;
-  int peak = (int)(mass * 10);
-  it = mPeaks.find(peak);
-  if (it == mPeaks.end()) {
-    mPeaks.insert(pair<int, size_t>(peak, vPeaks.size()));
-    vPeaks.emplace_back();
-    vPeaks.back().mass = mass;
-    vPeaks.back().index.emplace_back();
-    if (mass < 0) {
-      vPeaks.back().index.back().pepMass = pepMass;
-    }
-    vPeaks.back().index.back().pepIndex.push_back(pepIndex);
-  } else {
-    if (mass < 0) {
-      size_t a;
-      for (a = 0; a < vPeaks[it->second].index.size(); a++) {
-        if (vPeaks[it->second].index[a].pepMass == pepMass) break;
+//Merges the fragment records into peaks. Fragments that share a 0.1 Da key share a peak,
+//whose mass is that of the first fragment recorded. Negative (open modification) fragments
+//are further split by variant precursor mass, and whole-sequence fragments get their own
+//peaks so the closed search can skip them. The variants of each record are expanded
+//from the ladder order into the peak's variant list.
+void MIons::buildPeaks(vector<mFragRec>& v, vector<size_t>& order, sIPeakSet& peakSet) {
+  size_t a, b, c, d, e;
+  double mass;
+  int seq;
+
+  peakSet.clear();
+  sort(v.begin(), v.end(), compareFrag);
+
+  a = 0;
+  while (a < v.size()) {
+    mass = v[a].mass;
+    seq = v[a].seq;
+    for (b = a + 1; b < v.size() && v[b].key == v[a].key; b++) {
+      if (v[b].seq < seq) {
+        seq = v[b].seq;
+        mass = v[b].mass;
       }
-      if (a == vPeaks[it->second].index.size()) {
-        vPeaks[it->second].index.emplace_back();
-        vPeaks[it->second].index[a].pepMass = pepMass;
+    }
+    for (c = a; c < b; c = d) {
+      sIPeak p;
+      p.mass = mass;
+      p.pepMass = v[c].pepMass;
+      p.full = v[c].full;
+      p.first = peakSet.pep.size();
+      for (d = c; d < b && v[d].pepMass == v[c].pepMass && v[d].full == v[c].full; d++) {
+        for (e = v[d].lo; e < v[d].hi; e++) peakSet.pep.push_back(order[e]);
       }
-      vPeaks[it->second].index[a].pepIndex.push_back(pepIndex);
-    } else vPeaks[it->second].index[0].pepIndex.push_back(pepIndex);
+      p.count = peakSet.pep.size() - p.first;
+      peakSet.peaks.push_back(p);
+    }
+    a = b;
   }
 }
 
-void MIons::addPeakRevNew(double mass, double pepMass, size_t pepIndex){
-  map<int,size_t>::iterator it;
-  map<int, size_t>::iterator it2;
-  int peak=(int)(mass*10);
-  it=mPeaksRev.find(peak);
-  if(it==mPeaksRev.end()){
-    mPeaksRev.insert(pair<int,size_t>(peak,vPeaksRev.size()));
-    vPeaksRev.emplace_back();
-    vPeaksRev.back().mass=mass;
-    vPeaksRev.back().index.emplace_back();
-    if(mass<0){
-      vPeaksRev.back().index.back().pepMass=pepMass;
-    }
-    vPeaksRev.back().index.back().pepIndex.push_back(pepIndex);
-  } else {
-    if(mass<0){
-      size_t a;
-      for(a=0;a<vPeaksRev[it->second].index.size();a++){
-        if(vPeaksRev[it->second].index[a].pepMass==pepMass) break;
-      }
-      if(a== vPeaksRev[it->second].index.size()) {
-        vPeaksRev[it->second].index.emplace_back();
-        vPeaksRev[it->second].index[a].pepMass=pepMass;
-      }
-      vPeaksRev[it->second].index[a].pepIndex.push_back(pepIndex);
-    } else vPeaksRev[it->second].index[0].pepIndex.push_back(pepIndex);
-  }
+//Adds a variant derived from parent, with mask code placed at pos. Returns the new variant index.
+size_t MIons::addVariant(size_t parent, int pos, unsigned char code, double mass, int link) {
+  size_t v = pepMass.size();
+  pepMasks.resize(pepMasks.size() + maskLen);
+  memcpy(&pepMasks[v*maskLen], &pepMasks[parent*maskLen], maskLen);
+  pepMasks[v*maskLen + pos] = code;
+  pepMass.push_back(mass);
+  pepModCount.push_back(pepModCount[parent] + (code == MASK_ADDUCT ? 0 : 1));
+  pepLinks.push_back(link);
+  if (link > maxLink) maxLink = link;
+
+  //check if mass boundaries have changed
+  if (mass < pepMassMin) pepMassMin = mass;
+  if (mass > pepMassMax) pepMassMax = mass;
+  return v;
 }
 
 double MIons::getAAMass(char aa){
@@ -314,32 +392,36 @@ double MIons::getFixedModMass(char aa){
   return aaFixedModMass[aa];
 }
 
-//Iterates over the peptide amino acid sequence and creates a map of all variations
-//that are possible (variable modifications, adducts, etc.).
-void MIons::modIonsMaskRec(int pos, double mMass, int oSite, size_t pepNum, int depth, int modSite, string mask) {
+//Lists the variable modifications of a variant in order of position.
+void MIons::getVariantMods(size_t pepIndex, vector<mPepMod>& v){
+  const unsigned char* mask = &pepMasks[pepIndex*maskLen];
+  mPepMod pm;
+  v.clear();
+  for (size_t a = 0; a < maskLen; a++) {
+    if (mask[a] == 0 || mask[a] == MASK_ADDUCT) continue;
+    pm.mass = aaMod[pep1[a]].mod[mask[a] - 1].mass;
+    pm.pos = (char)a;
+    pm.term = false;
+    v.push_back(pm);
+  }
+}
+
+//Iterates over the peptide amino acid sequence and records all variations
+//that are possible (variable modifications, adducts, etc.). Only masks and precursor
+//masses are recorded; fragment ions are left to buildModIons().
+void MIons::modIonsMaskRec(int pos, int oSite, size_t pepNum, int depth, int modSite) {
+  size_t v;
 
   for (int i = pos; i < ionCount; i++) { //recursive function continues from last position
 
     //see if adduct attaches here
     if (oSite == -99 && i == 0 && nPep1 && site['n']) {  //if n-terminus can be linked, proceed as if it is linked
-      pepCount++;
-      string mask2(mask);
-      mask2[pep1Len] = 'x';
-      //cout << mask2 << endl;
-      mPrecursor.insert(pair<string, size_t>(mask2, pepCount));
-      pepMass.push_back(pepMass[pepNum]);
-      pepMods.push_back(pepMods[pepNum]);
-      modIonsMaskRec(i, mMass, i, pepCount, depth, modSite, mask2);
+      v = addVariant(pepNum, pep1Len, MASK_ADDUCT, pepMass[pepNum], i);
+      modIonsMaskRec(i, i, v, depth, modSite);
 
     } else if (oSite == -99 && modSite < i && site[pep1[i]]) { //otherwise attach adduct to available site
-      pepCount++;
-      string mask2(mask);
-      mask2[i] = 'x';
-      //cout << mask2 << endl;
-      mPrecursor.insert(pair<string, size_t>(mask2, pepCount));
-      pepMass.push_back(pepMass[pepNum]);
-      pepMods.push_back(pepMods[pepNum]);
-      modIonsMaskRec(i, mMass, i, pepCount, depth, modSite, mask2);
+      v = addVariant(pepNum, i, MASK_ADDUCT, pepMass[pepNum], i);
+      modIonsMaskRec(i, i, v, depth, modSite);
     }
 
     //only check modifications if adduct is not attached and we are allowed more modifications
@@ -351,80 +433,29 @@ void MIons::modIonsMaskRec(int pos, double mMass, int oSite, size_t pepNum, int
         if (aaMod[pep1[i]].mod[j].xl && i == pep1Len - 1 && !cPep1) continue;
 
         //Add masses
-        pepCount++;
-        string mask2(mask);
-        mask2[i] = 49 + j;
-        //cout << mask2 << endl;
-        mPrecursor.insert(pair<string, size_t>(mask2, pepCount));
-        pepMass.push_back(pepMass[pepNum] + aaMod[pep1[i]].mod[j].mass);
-        pepMods.push_back(pepMods[pepNum]);
-        mPepMod pm;
-        pm.mass = aaMod[pep1[i]].mod[j].mass;
-        pm.pos = (char)i;
-        pm.term = false;
-        pepMods.back().mods.push_back(pm);
-        modIonsMaskRec(i, mMass + aaMod[pep1[i]].mod[j].mass, oSite, pepCount, depth + 1, i, mask2);
-
-      }
-    }
-
-    mMass += aaMass[pep1[i]]; //add the amino acid mass
-    if (i == ionCount) { //special case for the end of a peptide
-      mMass += aaMass['c']; //add static mods to last amino acid
-      pepMass[pepNum] += aaMass['c'];
-      if (cPep1) {
-        mMass += aaMass['%']; //add static mods to end of protein
-        pepMass[pepNum] += aaMass['%'];
+        v = addVariant(pepNum, i, (unsigned char)(j + 1), pepMass[pepNum] + aaMod[pep1[i]].mod[j].mass, oSite);
+        modIonsMaskRec(i, oSite, v, depth + 1, i);
       }
     }
-    addPeakNew(mMass, pepMass[pepNum], pepNum);
-
   }
 
   if (oSite == -99 && cPep1 && site['c']) { //if c-terminus can be linked, proceed as if it is linked
-    pepCount++;
-    string mask2(mask);
-    mask2[pep1Len + 1] = 'x';
-    //cout << mask2 << endl;
-    mPrecursor.insert(pair<string, size_t>(mask2, pepCount));
-    pepMass.push_back(pepMass[pepNum]);
-    pepMods.push_back(pepMods[pepNum]);
-    modIonsMaskRec(ionCount, mMass, ionCount, pepCount, depth, modSite, mask2);
+    v = addVariant(pepNum, pep1Len + 1, MASK_ADDUCT, pepMass[pepNum], ionCount);
+    modIonsMaskRec(ionCount, ionCount, v, depth, modSite);
   }
 
   //if the c-terminus can be modified, proceed with the modifications
   if (pos == ionCount && cPep1 && oSite != pos && depth < maxModCount) {
     //Check if amino acid is on the modification list
     for (int j = 0; j < aaMod[pep1[pos]].count; j++) {
-      //Add masses
-      pepCount++;
-      string mask2(mask);
-      mask2[pos] = 49 + j;
-      //cout << mask2 << endl;
-      mPrecursor.insert(pair<string, size_t>(mask2, pepCount));
-      pepMass.push_back(pepMass[pepNum] + aaMod[pep1[pos]].mod[j].mass);
-      pepMods.push_back(pepMods[pepNum]);
-      mPepMod pm;
-      pm.mass = aaMod[pep1[pos]].mod[j].mass;
-      pm.pos = (char)pos;
-      pm.term = false;
-      pepMods.back().mods.push_back(pm);
-      modIonsMaskRec(ionCount, mMass + aaMod[pep1[pos]].mod[j].mass, oSite, pepCount, depth + 1, pos, mask2);
-
+      v = addVariant(pepNum, pos, (unsigned char)(j + 1), pepMass[pepNum] + aaMod[pep1[pos]].mod[j].mass, oSite);
+      modIonsMaskRec(ionCount, oSite, v, depth + 1, pos);
     }
   }
-
-  //check if mass boundaries have changed
-  if (pepMass[pepNum] < pepMassMin)pepMassMin = pepMass[pepNum];
-  if (pepMass[pepNum] > pepMassMax)pepMassMax = pepMass[pepNum];
-
-  //Mark position of adduct
-  while (pepLinks.size() <= pepNum) pepLinks.push_back(0);
-  pepLinks[pepNum] = oSite;
-  if (oSite > maxLink) maxLink = oSite;
 }
 
-void MIons::modIonsMaskRecNoAdduct(int pos, double mMass, size_t pepNum, int depth, int modSite, string mask) {
+void MIons::modIonsMaskRecNoAdduct(int pos, size_t pepNum, int depth, int modSite) {
+  size_t v;
 
   for (int i = pos; i < ionCount - 1; i++) { //recursive function continues from last position
 
@@ -437,37 +468,25 @@ void MIons::modIonsMaskRecNoAdduct(int pos, double mMass, size_t pepNum, int dep
         if (aaMod[pep1[i]].mod[j].xl && i == pep1Len - 1 && !cPep1) continue;
 
         //Add masses
-        pepCount++;
-        string mask2(mask);
-        mask2[i] = 49 + j;
-        //cout << mask2 << endl;
-        mPrecursor.insert(pair<string, size_t>(mask2, pepCount));
-        pepMass.push_back(pepMass[pepNum] + aaMod[pep1[i]].mod[j].mass);
-        pepMods.push_back(pepMods[pepNum]);
-        mPepMod pm;
-        pm.mass = aaMod[pep1[i]].mod[j].mass;
-        pm.pos = (char)i;
-        pm.term = false;
-        pepMods.back().mods.push_back(pm);
-        modIonsMaskRecNoAdduct(i, mMass + aaMod[pep1[i]].mod[j].mass, pepCount, depth + 1, i, mask2);
-
-      }
-    }
-
-    mMass += aaMass[pep1[i]]; //add the amino acid mass
-    if (i == ionCount - 1) { //special case for the end of a peptide
-      mMass += aaMass['c']; //add static mods to last amino acid
-      pepMass[pepNum] += aaMass['c'];
-      if (cPep1) {
-        mMass += aaMass['%']; //add static mods to end of protein
-        pepMass[pepNum] += aaMass['%'];
+        v = addVariant(pepNum, i, (unsigned char)(j + 1), pepMass[pepNum] + aaMod[pep1[i]].mod[j].mass, -99);
+        modIonsMaskRecNoAdduct(i, v, depth + 1, i);
       }
     }
   }
+}
 
-  //check if mass boundaries have changed
-  if (pepMass[pepNum] < pepMassMin)pepMassMin = pepMass[pepNum];
-  if (pepMass[pepNum] > pepMassMax)pepMassMax = pepMass[pepNum];
+//Sorts the variants by mask and drops repeated masks, keeping the first variant to produce it.
+void MIons::orderVariants() {
+  size_t i, j;
+  pepOrder.clear();
+  for (i = 0; i < pepCount; i++) pepOrder.push_back(i);
+  sort(pepOrder.begin(), pepOrder.end(), mMaskCompare(&pepMasks[0], maskLen));
+  j = 0;
+  for (i = 0; i < pepOrder.size(); i++) {
+    if (j > 0 && memcmp(&pepMasks[pepOrder[i] * maskLen], &pepMasks[pepOrder[j - 1] * maskLen], maskLen) == 0) continue;
+    pepOrder[j++] = pepOrder[i];
+  }
+  pepOrder.resize(j);
 }
 
 double MIons::getModMass(int index){
@@ -486,6 +505,10 @@ int MIons::getIonCount (){
   return ionCount;
 }
 
+size_t MIons::getLadderLen(){
+  return ladderLen;
+}
+
 void MIons::getPeptide(char *seq){
   strncpy(seq,pep1,pep1Len);
   seq[pep1Len]='\0';
@@ -519,23 +542,31 @@ void MIons::setMaxModCount(int i){
   maxModCount=i;
 }
 
-void MIons::setPeptide(char* seq, int len, double mass, bool nTerm, bool cTerm){
-  pep1=seq;
+//Copies the peptide sequence, so the caller's storage need not outlive the ion calculations.
+//If given, protein and start identify where the peptide came from. Consecutive peptides from the
+//same protein and start share the cached unmodified b-ion ladder.
+void MIons::setPeptide(const char* seq, int len, double mass, bool nTerm, bool cTerm, int protein, int start){
+  if(protein<0 || protein!=ladderProtein || start!=ladderStart) ladderCache.clear();
+  ladderProtein=protein;
+  ladderStart=start;
+  pepseq.assign(seq, len);
+  pep1=&pepseq[0];
   pep1Len=len;
   pep1Mass=mass;
   nPep1=nTerm;
   cPep1=cTerm;
-
-  char pp[256];
-  strncpy(pp, seq, len);
-  pp[len] = '\0';
-  pepseq = pp;
-
 }
 
 /*============================
   Utilities
 ============================*/
+bool MIons::compareFrag(const mFragRec& a, const mFragRec& b){
+  if(a.key!=b.key) return a.key<b.key;
+  if(a.pepMass!=b.pepMass) return a.pepMass<b.pepMass;
+  if(a.full!=b.full) return b.full;
+  return a.seq<b.seq;
+}
+
 int MIons::compareD(const void *p1, const void *p2){
   const double d1 = *(double *)p1;
   const double d2 = *(double *)p2;
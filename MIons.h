@@ -19,6 +19,7 @@ limitations under the License.
 
 #include "MStructs.h"
 //#include "MIonSet.h"
+#include <algorithm>
 #include <map>
 #include <vector>
 
@@ -41,6 +42,54 @@ typedef struct mMod{
   mModType  mod[10];
 } mMod;
 
+//Variant mask codes: 0 is unmodified, 1-10 is the variable mod (index+1) on that amino acid,
+//MASK_ADDUCT marks the open modification site. Masks order the same as the original character masks.
+#define MASK_ADDUCT 0xFF
+
+//A fragment ion shared by a run of variants in the ladder order, prior to merging into peaks
+typedef struct mFragRec{
+  int     key;      //(int)(mass*10); fragments with the same key share a peak
+  int     seq;      //order of creation; the first fragment in a key sets the peak mass
+  bool    full;     //last ladder position of the open modification ladders (whole sequence)
+  double  mass;
+  double  pepMass;  //variant precursor mass, for negative (open modification) fragments only
+  size_t  lo;       //first variant, as position in the ladder order
+  size_t  hi;       //one past the last variant
+} mFragRec;
+
+//Orders variant indexes by their masks, then by index
+struct mMaskCompare {
+  const unsigned char* masks;
+  size_t len;
+  mMaskCompare(const unsigned char* m, size_t n){
+    masks=m;
+    len=n;
+  }
+  bool operator()(const size_t& a, const size_t& b) const {
+    int i=memcmp(masks+a*len,masks+b*len,len);
+    if(i!=0) return i<0;
+    return a<b;
+  }
+};
+
+//Orders variant indexes by their masks read from the end, then by index
+struct mMaskCompareRev {
+  const unsigned char* masks;
+  size_t len;
+  mMaskCompareRev(const unsigned char* m, size_t n){
+    masks=m;
+    len=n;
+  }
+  bool operator()(const size_t& a, const size_t& b) const {
+    const unsigned char* ma=masks+a*len;
+    const unsigned char* mb=masks+b*len;
+    for(size_t i=len;i-->0;){
+      if(ma[i]!=mb[i]) return ma[i]<mb[i];
+    }
+    return a<b;
+  }
+};
+
 class MIons {
 public:
   MIons();
@@ -49,7 +98,8 @@ public:
   //Functions
   void      addFixedMod       (char mod, double mass);
   void      addMod            (char mod, bool xl, double mass);
-  void      buildModIons2     (bool bAdduct=true);
+  void      buildModIons      ();
+  void      buildModVariants  (bool bAdduct=true);
   double    getAAMass         (char aa);
   double    getFixedModMass   (char aa);
 
@@ -57,6 +107,7 @@ public:
   //MIonSet&  operator[ ]   (const int& i);
   //MIonSet*  at            (const int& i);
   int       getIonCount   ();
+  size_t    getLadderLen  ();
   double    getModMass    (int index);
   int       getModMassSize();
   double*   getMods       ();
@@ -68,38 +119,29 @@ public:
   //Modifiers
   void  setAAMass       (char aa, double mass);
   void  setMaxModCount  (int i);
-  void  setPeptide      (char* seq, int len, double mass, bool nTerm, bool cTerm);
+  void  setPeptide      (const char* seq, int len, double mass, bool nTerm, bool cTerm, int protein=-1, int start=-1);
 
   //Data Members
   double* modList;
   bool site[128]; //possible sites of linkage based on parameters
 
   //New data members for tree search
-  //std::vector<sNode2>* peaks;
-  //std::vector<sNode2>* peaksRev;
-  //std::map<int, size_t> mP;  //could be private
-  //std::map<int, size_t> mPRev;  //could be private
-  std::map<std::string,size_t> mPrecursor;
-  std::string modMask; //could be private
   size_t pepCount;
   std::vector<int> pepLinks;
   std::vector<double> pepMass;
-  std::vector<sPepModSet> pepMods;
+  std::vector<int> pepModCount; //number of variable modifications on each variant
+  std::vector<bool> pepSelect; //variants that receive fragment ions in buildModIons()
+  std::vector<bool> pepClosed; //variants scored by the unmodified (closed) search
   double pepMassMin;
   double pepMassMax;
   int maxLink;
+  size_t ladderReuse;  //b-ion ladder positions taken from the ladder cache
+  size_t ladderTotal;  //b-ion ladder positions built or reused
 
   std::string pepseq;
-  std::vector<sIPeak> vPeaksRev;
-  std::map<int,size_t> mPeaksRev;
-  std::vector<sIPeak> vPeaks;
-  std::map<int, size_t> mPeaks;
-  void addPeakNew(double mass, double pepMass, size_t pepIndex);
-  void addPeakRevNew(double mass, double pepMass, size_t pepIndex);
-  void modIonsNew(const std::string& mask, size_t pepIndex, double mass, size_t stop=2);
-  void modIonsRecNew(const std::string& mask, size_t pepIndex, double mass, size_t stop=2);
-  void modIonsMaskRec(int pos, double mMass, int oSite, size_t pepNum, int depth, int modSite, std::string mask); //could be private?
-  void modIonsMaskRecNoAdduct(int pos, double mMass, size_t pepNum, int depth, int modSite, std::string mask); //could be private?
+  sIPeakSet vPeaksRev;
+  sIPeakSet vPeaks;
+  void getVariantMods(size_t pepIndex, std::vector<mPepMod>& v);
 
   void displayPrecursors();
 
@@ -126,6 +168,7 @@ private:
 
   char* pep1;
 
+  bool bAdductIons; //variants were enumerated with open modification sites
   bool nPep1; //peptide has protein n-terminus
   bool cPep1; //peptide has protein c-terminus
 
@@ -133,7 +176,36 @@ private:
   std::vector<double>  modMassArray;
   //std::vector<MIonSet> sets;
 
+  //Variant enumeration and fragment buffers. These are reused from peptide to peptide.
+  size_t maskLen;                       //mask positions per variant: sequence, n-term, c-term
+  std::vector<unsigned char> pepMasks;  //one mask per variant, maskLen codes each
+  std::vector<size_t> pepOrder;         //unique masks in lexicographic order
+  std::vector<mFragRec> fragRec;
+  std::vector<mFragRec> fragRecRev;
+  std::vector<size_t> ladderOrder;      //selected variants in mask order (b-ions)
+  std::vector<size_t> ladderOrderRev;   //selected variants in reverse mask order (y-ions)
+  std::vector<size_t> ladderRank;       //position of each variant in ladderOrder
+  std::vector<size_t> ladderRec;        //current fragment record at each ladder position
+  size_t ladderLen;                     //ladder positions of the current build
+  std::vector<double> ladderMass;
+  std::vector<double> ladderBase;
+  std::vector<double> ladderModMass;
+  std::vector<bool>   ladderAdduct;
+  std::vector<double> ladderCache;      //unmodified b-ion ladder of the current protein and start
+  int ladderProtein;
+  int ladderStart;
+
+  size_t addVariant       (size_t parent, int pos, unsigned char code, double mass, int link);
+  size_t addFragment      (std::vector<mFragRec>& v, double mass, double pepMass, size_t lo, int seq);
+  void   buildPeaks       (std::vector<mFragRec>& v, std::vector<size_t>& order, sIPeakSet& peakSet);
+  void   modIonsNew       (size_t n);
+  void   modIonsRecNew    (size_t n);
+  void   modIonsMaskRec   (int pos, int oSite, size_t pepNum, int depth, int modSite);
+  void   modIonsMaskRecNoAdduct(int pos, size_t pepNum, int depth, int modSite);
+  void   orderVariants    ();
+
   //Utilities
+  static bool compareFrag(const mFragRec& a, const mFragRec& b);
   static int compareD(const void *p1,const void *p2);
 
 };
@@ -3,16 +3,25 @@
 using namespace std;
 
 MLog::MLog(){
+  bFatal = true;
+  Threading::CreateMutex(&mutexError);
   clear();
 }
 
+MLog::~MLog(){
+  Threading::DestroyMutex(mutexError);
+}
+
 void MLog::addDBWarning(std::string msg){
   string myMsg = "WARNING: " + msg;
   cout << myMsg << endl;
   vDBWarnings.push_back(myMsg);
 }
 
+//Records the error and writes the log. The program ends unless errors are set to be non-fatal
+//(setFatal), in which case the caller returns its error code instead.
 void MLog::addError(std::string msg){
+  Threading::LockMutex(mutexError);
   strError = "\n";
   time_t timeNow;
   time(&timeNow);
@@ -21,7 +30,8 @@ void MLog::addError(std::string msg){
   strError += "\tERROR: " + msg;
   cout << strError << endl;
   exportLog();
-  exit(-4004);
+  if (bFatal) exit(-4004);
+  Threading::UnlockMutex(mutexError);
 }
 
 void MLog::addMessage(string msg, bool silent){
@@ -101,6 +111,10 @@ void MLog::exportLog(){
   fclose(f);
 }
 
+bool MLog::hasError(){
+  return strError.size()>0;
+}
+
 void MLog::setDBinfo(std::string fn, int prot, int pep, int adduct){
   dbInfo = "FASTA database: ";
   dbInfo += fn;
@@ -109,6 +123,10 @@ void MLog::setDBinfo(std::string fn, int prot, int pep, int adduct){
   dbInfo += tStr;
 }
 
+void MLog::setFatal(bool b){
+  bFatal = b;
+}
+
 void MLog::setLog(char* fn){
   string f = fn;
   setLog(f);
@@ -116,4 +134,4 @@ void MLog::setLog(char* fn){
 
 void MLog::setLog(std::string fn){
   logFile = fn;
-}
\ No newline at end of file
+}
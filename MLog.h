@@ -6,6 +6,7 @@
 #include <string>
 #include <vector>
 #include <cstdint>
+#include "Threading.h"
 
 #define LOGSZ 500
 
@@ -20,6 +21,7 @@ typedef struct mWarning {
 class MLog {
 public:
   MLog();
+  ~MLog();
 
   void addError(std::string msg);
   void addDBWarning(std::string msg);
@@ -30,8 +32,10 @@ public:
 
   void clear();
   void exportLog();
+  bool hasError();
 
   void setDBinfo(std::string fn, int prot, int pep, int adduct);
+  void setFatal(bool b);
   void setLog(char* fn);
   void setLog(std::string fn);
 
@@ -46,6 +50,8 @@ private:
   std::vector<std::string> vParamWarnings; //special log for params;
   std::vector<mWarning> vWarnings;
   std::string strError;
+  bool bFatal;  //errors end the program; false when the caller recovers (server jobs)
+  Mutex mutexError;
 
 
 };
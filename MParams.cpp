@@ -160,6 +160,14 @@ void MParams::exportDefault(string ver){
   fprintf(f, "# Remove the '#' at the beginning of a parameter line to activate that parameter.\n");
   fprintf(f, "\n\n#\n# Computational Settings\n#\n");
   fprintf(f, "threads = %d\n",def.threads);
+  fprintf(f, "peptide_order = %d          #0 = search peptides by mass, 1 = by protein and start position (overlapping peptides share fragment ladders)\n",def.peptideOrder);
+  fprintf(f, "prefilter_top_k = %d        #open search: rank variants by fragments in strong spectrum bins and fully score only the top K per spectrum. 0 = score all\n",def.prefilterTopK);
+  fprintf(f, "prefilter_recall = %d       #0 = off, 1 = also score all variants and report how often the prefilter keeps the best score (slower)\n",(int)def.prefilterRecall);
+  fprintf(f, "score_pruning = %d          #0 = off, 1 = skip scoring spectra where an upper bound of the peptide score cannot displace the retained hits\n",(int)def.scorePruning);
+  fprintf(f, "spectrum_memory = %d        #0 = hold all spectra in memory. N = keep spectra in a temporary file and search them in precursor mass chunks of about N MB each\n",def.spectrumMemory);
+  fprintf(f, "database_block = %d         #0 = digest the whole database in memory. N = digest and search the database in blocks of N proteins, for databases too large to hold as peptides\n",def.databaseBlock);
+  fprintf(f, "checkpoint = %d             #0 = off. N = save the search state every N minutes; an interrupted search continues from it with the --resume option\n",def.checkpoint);
+  fprintf(f, "shard_mode = %d             #with the --shard i/N option: 0 = each shard searches a part of the peptide list, 1 = a precursor mass range of the spectra\n",def.shardMode);
   fprintf(f, "\n\n#\n# Input and Output files - specify full path for input files if not in current working directory\n#\n");
   fprintf(f, "MS_data_file = yourData.mzML            #users specify their data here.\n");
   fprintf(f, "database = SearchDatabase.fasta         #users specify their proteins here.\n");
@@ -201,14 +209,24 @@ void MParams::exportDefault(string ver){
   fprintf(f, "ion_series_Y = %d\n", (int)def.ionSeries[4]);
   fprintf(f, "ion_series_Z = %d              #Z-dot values are used\n", (int)def.ionSeries[5]);
   fprintf(f, "\n\n#\n# Search Space Prameters: specifies breadth of data analysis.\n#\n");
+  fprintf(f, "cluster_spectra = %d          #0 = off, 1 = search repeated acquisitions of the same precursor once and copy the results to each spectrum.\n",(int)def.clusterSpectra);
+  fprintf(f, "cluster_rt = %.1lf             #retention time window (in minutes) of spectrum clustering.\n",def.clusterRT);
+  fprintf(f, "cluster_similarity = %.2lf     #cosine similarity of the processed spectra needed to cluster them (0.0 - 1.0).\n",def.clusterSimilarity);
+  fprintf(f, "closed_evalue_cutoff = %g     #0 = off, otherwise run the closed search first and skip the open search for spectra with a closed hit at or below this E-value.\n",def.closedEValue);
+  fprintf(f, "adaptive_sample = %d          #0 = off, N = first search 1 of every N spectra over the full adduct range, then search all spectra for only the adduct masses found.\n",def.adaptiveSample);
+  fprintf(f, "adaptive_min_count = %d       #first pass hits (E-value <= 0.01) needed to call an adduct mass in adaptive_sample mode.\n",def.adaptiveMinCount);
+  fprintf(f, "#adduct_mass = 305.0682 10  #search only the listed adduct masses, each with an optional ppm tolerance (default is ppm_tolerance_pre).\n");
+  fprintf(f, "                              #use one line per adduct. Adducts must fall within min_adduct_mass and max_adduct_mass.\n");
   fprintf(f, "#adduct_sites = DE         #restricts adduct mass to the specified amino acids. Use 'n' and 'c' for protein termini.\n");
   fprintf(f, "decoy_filter = %s %d    #identifier for all decoys in the database. 0=database has decoys, 1=have Magnum generate decoys\n",def.decoyPrefix.c_str(),(int)def.buildDecoy);
+  fprintf(f, "decoy_seed = %d              #seed for Magnum-generated decoys. A given seed always produces the same decoys.\n",def.decoySeed);
   fprintf(f, "generate_entrapments = %s %d   #generate entrapment sequences (shuffled targets labeled as targets) with identifier on name. 0=no entrapments, 1=generate one entrapment per target\n",def.entrapmentPrefix.c_str(),(int)def.buildEntrapment);
   //deprecated:
   //fprintf(f, "e_value_depth = %d       #robustness of e-value histogram. Larger number improves e-value estimates, but increases computation time.\n",def.eValDepth);
   fprintf(f, "min_adduct_mass = %.1lf     #lowest allowed adduct mass in Daltons.\n",def.minAdductMass);
   fprintf(f, "max_adduct_mass = %.1lf    #highest allowed adduct mass in Daltons.\n",def.maxAdductMass);
   fprintf(f, "\nppm_tolerance_pre = %.1lf   #mass tolerance on precursor when searching (in ppm)\n",def.ppmPrecursor);
+  fprintf(f, "precursor_recalibration = %d  #0 = off, N = fit the precursor ppm error (m/z and retention time) from a closed search of 1 of every N spectra, correct all precursors, and tighten ppm_tolerance_pre.\n",def.recalSample);
   fprintf(f, "precursor_refinement = %d   #0 = off, 1 = attempt to correct precursor prediction errors from MS1 scan.\n",(int)def.precursorRefinement);
   fprintf(f, "isotope_error = %d          #search isotope peak offsets. 0=off, 1=one offset, 2=two offsets, 3=three offsets\n",def.isotopeError);
   fprintf(f, "prefer_precursor_pred = %d  #prefer precursor mono mass predicted by instrument software.\n",def.preferPrecursor);
@@ -217,6 +235,8 @@ void MParams::exportDefault(string ver){
   fprintf(f, "                           #  2 = supplement predictions with additional analysis\n");
   fprintf(f, "\nspectrum_processing = %d    #0 = no, 1 = collapse MS2 isotope distributions to a single monoisotopic peak.\n",def.specProcess);
   fprintf(f, "min_spectrum_peaks = %d    #minimum peaks in a MS2 scan to be searched.\n",def.minPeaks);
+  fprintf(f, "min_xcorr_bins = %d         #minimum positive bins in the transformed (XCorr) spectrum to be searched. 0 = off\n",def.minXCorrBins);
+  fprintf(f, "min_xcorr_coverage = %.2lf   #minimum fraction of the precursor mass spanned by the positive XCorr bins (0.0 - 1.0). 0 = off\n",def.minXCorrCoverage);
   fprintf(f, "max_spectrum_peaks = %d     #maximum number of MS2 peaks to use during analysis. 0 uses all peaks.\n",def.maxPeaks);
   fprintf(f, "\nmin_peptide_length = %d     #minimum number of amino acids per peptide searched.\n",def.minPepLen);
   fprintf(f, "max_peptide_length = %d    #maximum number of amino acids per peptide searched.\n", def.maxPepLen);
@@ -308,14 +328,84 @@ void MParams::parse(const char* cmd) {
     params->aaMass.push_back(m);
     logParam("aa_mass",values[0] + " " + values[1]);
 
+  } else if(strcmp(param,"adaptive_min_count")==0){
+    params->adaptiveMinCount=atoi(&values[0][0]);
+    if(params->adaptiveMinCount<1) {
+      warn("ERROR: adaptive_min_count must be 1 or greater. Reverting to default of 3.",3);
+      params->adaptiveMinCount=3;
+    }
+    logParam("adaptive_min_count",values[0]);
+
+  } else if(strcmp(param,"adaptive_sample")==0){
+    params->adaptiveSample=atoi(&values[0][0]);
+    if(params->adaptiveSample<0) {
+      warn("ERROR: adaptive_sample must be 0 or greater. Reverting to default of 0.",3);
+      params->adaptiveSample=0;
+    }
+    logParam("adaptive_sample",values[0]);
+
+  } else if(strcmp(param,"adduct_mass")==0){
+    mAdduct a;
+    a.mass = atof(&values[0][0]);
+    a.ppm = 0;
+    if (values.size() > 1) a.ppm = atof(&values[1][0]);
+    if (a.ppm<0) {
+      warn("ERROR: adduct_mass tolerance must be 0 or greater. Using ppm_tolerance_pre.",3);
+      a.ppm=0;
+    }
+    params->adducts.push_back(a);
+    if (values.size() > 1) logParam("adduct_mass",values[0] + " " + values[1]);
+    else logParam("adduct_mass",values[0]);
+
   } else if(strcmp(param,"adduct_sites")==0){
     params->adductSites=values[0];
     logParam("adduct_sites",values[0]);
 
+  } else if(strcmp(param,"checkpoint")==0){
+    params->checkpoint=atoi(&values[0][0]);
+    if(params->checkpoint<0) {
+      warn("ERROR: checkpoint must be 0 or greater. Reverting to default of 0.",3);
+      params->checkpoint=0;
+    }
+    logParam("checkpoint",values[0]);
+
+  } else if(strcmp(param,"cluster_rt")==0){
+    params->clusterRT=atof(&values[0][0]);
+    logParam("cluster_rt",values[0]);
+
+  } else if(strcmp(param,"cluster_similarity")==0){
+    params->clusterSimilarity=atof(&values[0][0]);
+    if(params->clusterSimilarity<0 || params->clusterSimilarity>1) {
+      warn("ERROR: cluster_similarity must be between 0.0 and 1.0. Reverting to default of 0.9.",3);
+      params->clusterSimilarity=0.9;
+    }
+    logParam("cluster_similarity",values[0]);
+
+  } else if(strcmp(param,"cluster_spectra")==0){
+    if(atoi(&values[0][0])!=0) params->clusterSpectra=true;
+    else params->clusterSpectra=false;
+    logParam("cluster_spectra",values[0]);
+
+  } else if(strcmp(param,"closed_evalue_cutoff")==0){
+    params->closedEValue=atof(&values[0][0]);
+    if(params->closedEValue<0) {
+      warn("ERROR: closed_evalue_cutoff must be 0 or greater. Reverting to default of 0.",3);
+      params->closedEValue=0;
+    }
+    logParam("closed_evalue_cutoff",values[0]);
+
 	} else if(strcmp(param,"database")==0){
     params->dbFile=values[0];
     logParam("database", values[0]);
 
+  } else if(strcmp(param,"database_block")==0){
+    params->databaseBlock=atoi(&values[0][0]);
+    if(params->databaseBlock<0) {
+      warn("ERROR: database_block must be 0 or greater. Reverting to default of 0.",3);
+      params->databaseBlock=0;
+    }
+    logParam("database_block",values[0]);
+
   } else if(strcmp(param,"diagnostic")==0){  //a value of -1 means diagnose all spectra, overriding any existing or following spectrum specifications
     if (atoi(&values[0][0])==-1) params->diag.clear();
     params->diag.push_back(atoi(&values[0][0]));
@@ -331,6 +421,10 @@ void MParams::parse(const char* cmd) {
     else params->buildDecoy = true;
     logParam("decoy_filter", values[0] + " " + values[1]);
 
+  } else if(strcmp(param,"decoy_seed")==0){
+    params->decoySeed=atoi(&values[0][0]);
+    logParam("decoy_seed",values[0]);
+
   } else if(strcmp(param,"generate_entrapments")==0){
     if (values.size() != 2) {
       warn("ERROR: bad generate_entrapments parameter. Expected format: generate_entrapments = <entrapment_label> 1", 3);
@@ -499,6 +593,14 @@ void MParams::parse(const char* cmd) {
     params->minPeaks = atoi(&values[0][0]);
     logParam("min_spectrum_peaks",values[0]);
 
+  } else if (strcmp(param, "min_xcorr_bins") == 0){
+    params->minXCorrBins = atoi(&values[0][0]);
+    logParam("min_xcorr_bins",values[0]);
+
+  } else if (strcmp(param, "min_xcorr_coverage") == 0){
+    params->minXCorrCoverage = atof(&values[0][0]);
+    logParam("min_xcorr_coverage",values[0]);
+
   } else if(strcmp(param,"modification")==0){
     m.xl=false;
     m.index=(int)values[0][0];
@@ -544,6 +646,10 @@ void MParams::parse(const char* cmd) {
 		params->ms2Resolution=atoi(&values[0][0]);
     logParam("MS2_resolution",values[0]);
 
+  } else if(strcmp(param,"peptide_order")==0){
+    params->peptideOrder=atoi(&values[0][0]);
+    logParam("peptide_order",values[0]);
+
   } else if(strcmp(param,"percolator_version")==0){
     params->percVersion=atof(&values[0][0]);
     logParam("percolator_version",values[0]);
@@ -557,6 +663,27 @@ void MParams::parse(const char* cmd) {
     else params->precursorRefinement = true;
     logParam("precursor_refinement",values[0]);
 
+  } else if(strcmp(param,"prefilter_recall")==0){
+    if(atoi(&values[0][0])!=0) params->prefilterRecall=true;
+    else params->prefilterRecall=false;
+    logParam("prefilter_recall",values[0]);
+
+  } else if(strcmp(param,"prefilter_top_k")==0){
+    params->prefilterTopK=atoi(&values[0][0]);
+    if(params->prefilterTopK<0) {
+      warn("ERROR: prefilter_top_k must be 0 or greater. Reverting to default of 0.",3);
+      params->prefilterTopK=0;
+    }
+    logParam("prefilter_top_k",values[0]);
+
+  } else if(strcmp(param,"precursor_recalibration")==0){
+    params->recalSample=atoi(&values[0][0]);
+    if(params->recalSample<0) {
+      warn("ERROR: precursor_recalibration must be 0 or greater. Reverting to default of 0.",3);
+      params->recalSample=0;
+    }
+    logParam("precursor_recalibration",values[0]);
+
   } else if(strcmp(param,"prefer_precursor_pred")==0){
     params->preferPrecursor=atoi(&values[0][0]);
     logParam("prefer_precursor_pred",values[0]);
@@ -578,6 +705,49 @@ void MParams::parse(const char* cmd) {
     params->resPath=values[0];
     logParam("results_path",values[0]);
 
+  } else if(strcmp(param,"resume")==0){
+    if(atoi(&values[0][0])!=0) params->resume=true;
+    else params->resume=false;
+    logParam("resume",values[0]);
+
+  } else if(strcmp(param,"score_pruning")==0){
+    if(atoi(&values[0][0])!=0) params->scorePruning=true;
+    else params->scorePruning=false;
+    logParam("score_pruning",values[0]);
+
+  } else if(strcmp(param,"shard")==0){
+    int i=0;
+    int n=0;
+    if(sscanf(&values[0][0],"%d/%d",&i,&n)!=2 || n<1 || i<1 || i>n) {
+      warn("ERROR: shard must be given as i/N, with i from 1 to N. Reverting to default of no sharding.",3);
+      i=0;
+      n=0;
+    }
+    params->shardIndex=i;
+    params->shardCount=n;
+    logParam("shard",values[0]);
+
+  } else if(strcmp(param,"shard_merge")==0){
+    if(atoi(&values[0][0])!=0) params->shardMerge=true;
+    else params->shardMerge=false;
+    logParam("shard_merge",values[0]);
+
+  } else if(strcmp(param,"shard_mode")==0){
+    params->shardMode=atoi(&values[0][0]);
+    if(params->shardMode<0 || params->shardMode>1) {
+      warn("ERROR: shard_mode must be 0 or 1. Reverting to default of 0.",3);
+      params->shardMode=0;
+    }
+    logParam("shard_mode",values[0]);
+
+  } else if(strcmp(param,"spectrum_memory")==0){
+    params->spectrumMemory=atoi(&values[0][0]);
+    if(params->spectrumMemory<0) {
+      warn("ERROR: spectrum_memory must be 0 or greater. Reverting to default of 0.",3);
+      params->spectrumMemory=0;
+    }
+    logParam("spectrum_memory",values[0]);
+
   } else if(strcmp(param,"spectrum_processing")==0) {
     params->specProcess=atoi(&values[0][0]);
     logParam("spectrum_processing",values[0]);
@@ -104,6 +104,10 @@ MSpectrum::MSpectrum(mParams& p){
 
   kojakSparseArray = NULL;
   kojakBins = 0;
+  kojakMax = 0;
+  cluster = -1;
+  xcorrBins = 0;
+  xcorrCoverage = 0;
 
   lowScore = 0;
 
@@ -208,6 +212,11 @@ MSpectrum::MSpectrum(const MSpectrum& p){
   }
 
   kojakBins=p.kojakBins;
+  kojakMax=p.kojakMax;
+  kojakBits=p.kojakBits;
+  cluster=p.cluster;
+  xcorrBins=p.xcorrBins;
+  xcorrCoverage=p.xcorrCoverage;
   if(p.kojakSparseArray==NULL){
     kojakSparseArray=NULL;
   } else {
@@ -350,6 +359,11 @@ MSpectrum& MSpectrum::operator=(const MSpectrum& p){
       delete [] kojakSparseArray;
     }
     kojakBins=p.kojakBins;
+    kojakMax=p.kojakMax;
+    kojakBits=p.kojakBits;
+    cluster=p.cluster;
+    xcorrBins=p.xcorrBins;
+    xcorrCoverage=p.xcorrCoverage;
     if(p.kojakSparseArray==NULL){
       kojakSparseArray=NULL;
     } else {
@@ -479,6 +493,277 @@ void MSpectrum::clearPrecursors(){
   singlets->clear();
 }
 
+//Removes all search results, keeping the spectrum and its E-value histograms
+void MSpectrum::clearScores(){
+  mScoreCard sc;
+  for(int i=0;i<20;i++) topHit[i]=sc;
+  for(size_t i=0;i<singlets->size();i++) singlets->at(i).clear();
+  lowScore=0;
+}
+
+//Cosine similarity of the processed (kojakXCorr) spectra
+double MSpectrum::similarity(MSpectrum& s){
+  int bins = kojakBins<s.kojakBins ? kojakBins : s.kojakBins;
+  int sz = (int)invBinSize + 1;
+  double dot = 0;
+  double n1 = 0;
+  double n2 = 0;
+  int i,j;
+  for (i = 0; i<kojakBins; i++){
+    if (kojakSparseArray[i] == NULL) continue;
+    for (j = 0; j<sz; j++) n1 += kojakSparseArray[i][j] * kojakSparseArray[i][j];
+  }
+  for (i = 0; i<s.kojakBins; i++){
+    if (s.kojakSparseArray[i] == NULL) continue;
+    for (j = 0; j<sz; j++) n2 += s.kojakSparseArray[i][j] * s.kojakSparseArray[i][j];
+  }
+  if (n1 == 0 || n2 == 0) return 0;
+  for (i = 0; i<bins; i++){
+    if (kojakSparseArray[i] == NULL || s.kojakSparseArray[i] == NULL) continue;
+    for (j = 0; j<sz; j++) dot += kojakSparseArray[i][j] * s.kojakSparseArray[i][j];
+  }
+  return dot / sqrt(n1*n2);
+}
+
+//Marks the peptides of a streamed database block (indexes from base) referenced by the search results
+void MSpectrum::markPeptides(vector<bool>& used, int base){
+  int i;
+  mScoreCard* sc;
+  for (i = 0; i<20; i++){
+    if (topHit[i].simpleScore>0 && topHit[i].pep >= base) used[topHit[i].pep - base] = true;
+  }
+  for (size_t a = 0; a<singlets->size(); a++){
+    for (sc = singlets->at(a).peptideFirst; sc != NULL; sc = sc->next){
+      if (sc->pep >= base) used[sc->pep - base] = true;
+    }
+  }
+  for (sc = singletFirst; sc != NULL; sc = sc->next){
+    if (sc->pep >= base) used[sc->pep - base] = true;
+  }
+}
+
+//Points the search results at the new indexes of the marked peptides (see markPeptides)
+void MSpectrum::remapPeptides(vector<int>& remap, int base){
+  int i;
+  mScoreCard* sc;
+  for (i = 0; i<20; i++){
+    if (topHit[i].simpleScore>0 && topHit[i].pep >= base) topHit[i].pep = remap[topHit[i].pep - base];
+  }
+  for (size_t a = 0; a<singlets->size(); a++){
+    for (sc = singlets->at(a).peptideFirst; sc != NULL; sc = sc->next){
+      if (sc->pep >= base) sc->pep = remap[sc->pep - base];
+    }
+  }
+  for (sc = singletFirst; sc != NULL; sc = sc->next){
+    if (sc->pep >= base) sc->pep = remap[sc->pep - base];
+  }
+}
+
+//Reads top hits written by saveState and adds them to the current ones, as the search would
+bool MSpectrum::readResults(FILE* f){
+  int count, i;
+  if (fread(&count, sizeof(int), 1, f) != 1 || count<0 || count>20) return false;
+  for (i = 0; i<count; i++){
+    mScoreCard sc;
+    if (!readScoreCard(f, sc)) return false;
+    checkScore(sc, 0);
+  }
+  return true;
+}
+
+//Reads a score card written by saveScoreCard
+bool MSpectrum::readScoreCard(FILE* f, mScoreCard& sc){
+  int n;
+  if (fread(&sc.precursor, sizeof(char), 1, f) != 1) return false;
+  if (fread(&sc.site, sizeof(char), 1, f) != 1) return false;
+  if (fread(&sc.conFrag, sizeof(int), 1, f) != 1) return false;
+  if (fread(&sc.match, sizeof(int), 1, f) != 1) return false;
+  if (fread(&sc.pep, sizeof(int), 1, f) != 1) return false;
+  if (fread(&sc.simpleScore, sizeof(float), 1, f) != 1) return false;
+  if (fread(&sc.mass, sizeof(double), 1, f) != 1) return false;
+  if (fread(&sc.massA, sizeof(double), 1, f) != 1) return false;
+  if (fread(&sc.eVal, sizeof(double), 1, f) != 1) return false;
+  if (fread(&n, sizeof(int), 1, f) != 1 || n<0) return false;
+  sc.mods->resize(n);
+  if (n>0 && fread(&sc.mods->at(0), sizeof(mPepMod), n, f) != (size_t)n) return false;
+  return true;
+}
+
+//Reads a processed spectrum written by writeSpill. Search results and E-value histograms are not
+//stored; they are built after the spectrum is loaded. Returns false on a truncated or corrupt record.
+bool MSpectrum::readSpill(FILE* f){
+  int i, j;
+  int sz = (int)invBinSize + 1;
+
+  clear();
+  if (fread(&scanNumber, sizeof(int), 1, f) != 1) return false;
+  if (fread(&rTime, sizeof(float), 1, f) != 1) return false;
+  if (fread(&charge, sizeof(int), 1, f) != 1) return false;
+  if (fread(&mz, sizeof(double), 1, f) != 1) return false;
+  if (fread(&maxIntensity, sizeof(float), 1, f) != 1) return false;
+  if (fread(&instrumentPrecursor, sizeof(bool), 1, f) != 1) return false;
+  if (fread(&i, sizeof(int), 1, f) != 1 || i<0 || i>SPILL_MAX_NATIVEID) return false;
+  nativeID.resize(i);
+  if (i>0 && fread(&nativeID[0], 1, i, f) != (size_t)i) return false;
+
+  if (fread(&i, sizeof(int), 1, f) != 1 || i<0 || i>SPILL_MAX_PRECURSORS) return false;
+  mPrecursor p;
+  for (j = 0; j<i; j++){
+    if (fread(&p, sizeof(mPrecursor), 1, f) != 1) return false;
+    addPrecursor(p, singletMax);
+  }
+
+  if (fread(&xCorrArraySize, sizeof(int), 1, f) != 1) return false;
+  if (fread(&kojakMax, sizeof(int), 1, f) != 1) return false;
+  if (fread(&xcorrBins, sizeof(int), 1, f) != 1) return false;
+  if (fread(&xcorrCoverage, sizeof(double), 1, f) != 1) return false;
+  if (fread(&i, sizeof(int), 1, f) != 1 || i<0 || i>SPILL_MAX_BINS) return false;
+  kojakBits.resize(i);
+  if (i>0 && fread(&kojakBits[0], sizeof(unsigned int), i, f) != (size_t)i) return false;
+
+  if (kojakSparseArray != NULL){
+    for (j = 0; j<kojakBins; j++){
+      if (kojakSparseArray[j] != NULL) delete[] kojakSparseArray[j];
+    }
+    delete[] kojakSparseArray;
+    kojakSparseArray = NULL;
+  }
+  kojakBins = 0;
+  if (fread(&i, sizeof(int), 1, f) != 1 || i<0 || i>SPILL_MAX_BINS) return false;
+  kojakBins = i;
+  kojakSparseArray = new char*[kojakBins];
+  for (j = 0; j<kojakBins; j++) kojakSparseArray[j] = NULL;
+  int count;
+  if (fread(&count, sizeof(int), 1, f) != 1 || count<0 || count>kojakBins) return false;
+  for (j = 0; j<count; j++){
+    if (fread(&i, sizeof(int), 1, f) != 1 || i<0 || i >= kojakBins || kojakSparseArray[i] != NULL) return false;
+    kojakSparseArray[i] = new char[sz];
+    if (fread(kojakSparseArray[i], 1, sz, f) != (size_t)sz) return false;
+  }
+  cluster = -1;
+  return true;
+}
+
+//Reads the E-value histograms, top hits, and top peptides of each precursor written by saveState.
+//The peptides are added to the current lists, as the search would.
+bool MSpectrum::readState(FILE* f){
+  int count, i, j, len, n;
+  if (fread(&count, sizeof(int), 1, f) != 1 || count<0) return false;
+  for (i = 0; i<count; i++){
+    if (fread(&len, sizeof(int), 1, f) != 1 || len<0 || len>maxPepLen) return false;
+    if (mHisto[len] == NULL) mHisto[len] = new MHistogram();
+    if (fread(&mHisto[len]->slope, sizeof(double), 1, f) != 1) return false;
+    if (fread(&mHisto[len]->intercept, sizeof(double), 1, f) != 1) return false;
+    if (fread(&mHisto[len]->rSq, sizeof(double), 1, f) != 1) return false;
+  }
+  if (!readResults(f)) return false;
+
+  if (fread(&n, sizeof(int), 1, f) != 1 || n != (int)singlets->size()) return false;
+  for (i = 0; i<n; i++){
+    if (fread(&count, sizeof(int), 1, f) != 1 || count<0) return false;
+    for (j = 0; j<count; j++){
+      mScoreCard sc;
+      if (!readScoreCard(f, sc)) return false;
+      singlets->at(i).checkPeptideScore(sc);
+    }
+  }
+  return true;
+}
+
+//Appends the E-value histograms, the top hits, and the top peptides of each precursor to a
+//buffer, for checkpoints and for merging the results of several searches.
+void MSpectrum::saveState(vector<char>& v){
+  int count, i;
+  mScoreCard* sc;
+  count = 0;
+  for (i = 0; i<maxPepLen + 1; i++){
+    if (mHisto[i] != NULL) count++;
+  }
+  appendBytes(v, &count, 1);
+  for (i = 0; i<maxPepLen + 1; i++){
+    if (mHisto[i] == NULL) continue;
+    appendBytes(v, &i, 1);
+    appendBytes(v, &mHisto[i]->slope, 1);
+    appendBytes(v, &mHisto[i]->intercept, 1);
+    appendBytes(v, &mHisto[i]->rSq, 1);
+  }
+
+  for (count = 0; count<20; count++){
+    if (topHit[count].simpleScore <= 0) break;
+  }
+  appendBytes(v, &count, 1);
+  for (i = 0; i<count; i++) saveScoreCard(v, topHit[i]);
+
+  count = (int)singlets->size();
+  appendBytes(v, &count, 1);
+  for (size_t a = 0; a<singlets->size(); a++){
+    count = 0;
+    for (sc = singlets->at(a).peptideFirst; sc != NULL; sc = sc->next) count++;
+    appendBytes(v, &count, 1);
+    for (sc = singlets->at(a).peptideLast; sc != NULL; sc = sc->prev) saveScoreCard(v, *sc); //last first, so reading keeps the order of ties
+  }
+}
+
+//Appends a score card to a search state buffer
+void MSpectrum::saveScoreCard(vector<char>& v, mScoreCard& sc){
+  int n;
+  appendBytes(v, &sc.precursor, 1);
+  appendBytes(v, &sc.site, 1);
+  appendBytes(v, &sc.conFrag, 1);
+  appendBytes(v, &sc.match, 1);
+  appendBytes(v, &sc.pep, 1);
+  appendBytes(v, &sc.simpleScore, 1);
+  appendBytes(v, &sc.mass, 1);
+  appendBytes(v, &sc.massA, 1);
+  appendBytes(v, &sc.eVal, 1);
+  n = (int)sc.mods->size();
+  appendBytes(v, &n, 1);
+  if (n>0) appendBytes(v, &sc.mods->at(0), n);
+}
+
+//Writes the processed spectrum (precursors and kojakXCorr data) to a temporary store. Returns
+//the number of bytes written.
+size_t MSpectrum::writeSpill(FILE* f){
+  int i, j;
+  int sz = (int)invBinSize + 1;
+  size_t bytes = 0;
+
+  bytes += sizeof(int)*fwrite(&scanNumber, sizeof(int), 1, f);
+  bytes += sizeof(float)*fwrite(&rTime, sizeof(float), 1, f);
+  bytes += sizeof(int)*fwrite(&charge, sizeof(int), 1, f);
+  bytes += sizeof(double)*fwrite(&mz, sizeof(double), 1, f);
+  bytes += sizeof(float)*fwrite(&maxIntensity, sizeof(float), 1, f);
+  bytes += sizeof(bool)*fwrite(&instrumentPrecursor, sizeof(bool), 1, f);
+  i = (int)nativeID.size();
+  bytes += sizeof(int)*fwrite(&i, sizeof(int), 1, f);
+  if (i>0) bytes += fwrite(&nativeID[0], 1, i, f);
+
+  i = (int)precursor->size();
+  bytes += sizeof(int)*fwrite(&i, sizeof(int), 1, f);
+  if (i>0) bytes += sizeof(mPrecursor)*fwrite(&precursor->at(0), sizeof(mPrecursor), i, f);
+
+  bytes += sizeof(int)*fwrite(&xCorrArraySize, sizeof(int), 1, f);
+  bytes += sizeof(int)*fwrite(&kojakMax, sizeof(int), 1, f);
+  bytes += sizeof(int)*fwrite(&xcorrBins, sizeof(int), 1, f);
+  bytes += sizeof(double)*fwrite(&xcorrCoverage, sizeof(double), 1, f);
+  i = (int)kojakBits.size();
+  bytes += sizeof(int)*fwrite(&i, sizeof(int), 1, f);
+  if (i>0) bytes += sizeof(unsigned int)*fwrite(&kojakBits[0], sizeof(unsigned int), i, f);
+
+  bytes += sizeof(int)*fwrite(&kojakBins, sizeof(int), 1, f);
+  int count = 0;
+  for (j = 0; j<kojakBins; j++) {
+    if (kojakSparseArray != NULL && kojakSparseArray[j] != NULL) count++;
+  }
+  bytes += sizeof(int)*fwrite(&count, sizeof(int), 1, f);
+  for (j = 0; j<kojakBins && count>0; j++){
+    if (kojakSparseArray[j] == NULL) continue;
+    bytes += sizeof(int)*fwrite(&j, sizeof(int), 1, f);
+    bytes += fwrite(kojakSparseArray[j], 1, sz, f);
+  }
+  return bytes;
+}
+
 void MSpectrum::erasePrecursor(int i){
   precursor->erase(precursor->begin()+i);
   singlets->erase(singlets->begin()+i);
@@ -705,7 +990,11 @@ void MSpectrum::kojakXCorr(double* pdTempRawData, double* pdTmpFastXcorrData, fl
   int iTmp;
   double dTmp;
   double dSum;
+  int iFirst = 0;
+  int iLast = 0;
 
+  xcorrBins = 0;
+  xcorrCoverage = 0;
   pPre->iHighestIon = 0;
   pPre->dHighestIntensity = 0;
   BinIons(pPre);
@@ -779,9 +1068,37 @@ void MSpectrum::kojakXCorr(double* pdTempRawData, double* pdTmpFastXcorrData, fl
       else if (pfFastXcorrData[i]<-128) kojakSparseArray[iTmp][j] = -128;
       else if (pfFastXcorrData[i]>0) kojakSparseArray[iTmp][j] = (char)(pfFastXcorrData[i] + 0.5);
       else kojakSparseArray[iTmp][j] = (char)(pfFastXcorrData[i] - 0.5);
+      if (kojakSparseArray[iTmp][j] > kojakMax) kojakMax = kojakSparseArray[iTmp][j];
+      if (kojakSparseArray[iTmp][j] > 0) {
+        if (xcorrBins == 0) iFirst = i;
+        iLast = i;
+        xcorrBins++;
+      }
     }
   }
 
+  //Quality: the positive bins and the fraction of the precursor mass range they span
+  double pMass = 0;
+  for (i = 0; i<(int)precursor->size(); i++){
+    if (precursor->at(i).monoMass>pMass) pMass = precursor->at(i).monoMass;
+  }
+  if (xcorrBins>1 && pMass>0) xcorrCoverage = binSize*(iLast - iFirst) / pMass;
+  if (xcorrCoverage>1) xcorrCoverage = 1;
+
+  //Bitmap of the strong bins (at least a quarter of the largest value), indexed by bin number
+  //like the sparse array, for a quick count of shared fragment bins
+  int strong = kojakMax / 4;
+  if (strong < 1) strong = 1;
+  kojakBits.assign(xCorrArraySize / 32 + 1, 0);
+  for (i = 0; i<xCorrArraySize; i++){
+    if (pfFastXcorrData[i] + 0.5 < strong) continue;
+    dTmp = binSize*i;
+    iTmp = (int)dTmp;
+    if (kojakSparseArray[iTmp] == NULL) continue;
+    j = (int)((dTmp - iTmp)*invBinSize+0.5);
+    if (kojakSparseArray[iTmp][j] >= strong) kojakBits[i >> 5] |= (1u << (i & 31));
+  }
+
 }
 
 void MSpectrum::BinIons(mPreprocessStruct *pPre) {
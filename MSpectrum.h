@@ -28,11 +28,22 @@ limitations under the License.
 
 #define HISTOSZ 152
 
+//Limits for the counts of a stored spectrum (see readSpill), to reject corrupt files
+#define SPILL_MAX_NATIVEID   65536
+#define SPILL_MAX_PRECURSORS 65536
+#define SPILL_MAX_BINS       (1<<24)
+
 typedef struct sHistoPep {
   int pepIndex;
   int topScore;
 } sHistoPep;
 
+//Appends n values to a byte buffer, for serializing search state
+template<class T> inline void appendBytes(std::vector<char>& v, const T* p, size_t n){
+  const char* c = (const char*)p;
+  v.insert(v.end(), c, c + sizeof(T)*n);
+}
+
 class MSpectrum {
 
 public:
@@ -52,6 +63,11 @@ public:
   int             xCorrSparseArraySize;
   char**          kojakSparseArray;
   int             kojakBins;
+  int             kojakMax;   //largest value in kojakSparseArray
+  std::vector<unsigned int> kojakBits;  //bitmap of the bins with strong positive values, for prefiltering
+  int             cluster;    //index of the representative spectrum of its cluster; -1 if not clustered
+  int             xcorrBins;  //quality: positive bins in kojakSparseArray
+  double          xcorrCoverage; //quality: span of the positive bins over the largest precursor mass
 
   int peakCounts;
   
@@ -110,6 +126,7 @@ public:
   void addPrecursor           (mPrecursor& p, int sz);
   void clear                  ();
   void  clearPrecursors();
+  void  clearScores();
   void erasePrecursor         (int i);
   void setCharge              (int i);
   void setInstrumentPrecursor (bool b);
@@ -129,16 +146,26 @@ public:
   bool generateXcorrDecoys2(int maxPepLen);
   bool generateXcorrDecoys3(int minP, int maxP, int depth);
   bool generateXcorrDecoys4(int minP, int maxP);
+  double similarity(MSpectrum& s);
   void linearRegression(double& slope, double& intercept, int&  iMaxXcorr, int& iStartXcorr, int& iNextXcorr);
   void linearRegression2(double& slope, double& intercept, int&  iMaxXcorr, int& iStartXcorr, int& iNextXcorr, double& rSquared);
   void linearRegression3(double& slope, double& intercept, double& rSquared);
   void linearRegression4(int* h, int sz, double& slope, double& intercept, double& rSquared);
   double makeXCorrB(int decoyIndex, double modMass, int maxZ, int len, int offset=0);
   double makeXCorrY(int decoyIndex, double modMass, int maxZ, int len, int offset=0);
+  void  markPeptides      (std::vector<bool>& used, int base);
+  bool  readResults       (FILE* f);
+  bool  readScoreCard     (FILE* f, mScoreCard& sc);
+  bool  readSpill         (FILE* f);
+  bool  readState         (FILE* f);
+  void  remapPeptides     (std::vector<int>& remap, int base);
   void  resetSingletList  ();
+  void  saveScoreCard     (std::vector<char>& v, mScoreCard& sc);
+  void  saveState         (std::vector<char>& v);
   void  shortResults(std::vector<mScoreCard2>& v);
   void  shortResults2(std::vector<mScoreCard3>& v);
   void  sortMZ            ();
+  size_t writeSpill       (FILE* f);
   void  sortIntensityRev() { sort(spec->begin(), spec->end(), compareIntensityRev); }
   //void  xCorrScore        ();
   void kojakXCorr(double* pdTempRawData, double* pdTmpFastXcorrData, float* pfFastXcorrData, mPreprocessStruct*& pPre);
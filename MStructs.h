@@ -29,14 +29,28 @@ limitations under the License.
 
 #define MAX_PRECURSOR 32
 
-//FASTA database structure
+//FASTA database structure: a protein record in the packed MDatabase store
 typedef struct mDB{
   bool decoy;
-  std::string description; //FASTA description (header - after first space)
-  std::string name;        //FASTA name (header - before first space)
-  std::string sequence;    //FASTA sequence
+  size_t descOffset;       //FASTA description (header - after first space), position in the header arena
+  size_t nameOffset;       //FASTA name (header - before first space), position in the header arena
+  size_t seqOffset;        //position of the FASTA sequence in the database sequence arena
+  size_t seqLen;           //number of residues in the FASTA sequence
+  int source;              //generated proteins: index of the protein they derive from; -1 for FASTA proteins
+  char transform;          //generated proteins: 'r'=reversed between cut sites, 's'=shuffled
+  uint64_t seed;           //generated proteins: shuffle seed
 } mDB;
 
+//View of a protein in the packed MDatabase store. Pointers are invalidated if the database grows.
+//Generated proteins have no stored residues (sequence is NULL); use MDatabase::getSequence().
+typedef struct mProtein{
+  bool        decoy;
+  const char* description;
+  const char* name;
+  const char* sequence;
+  size_t      length;
+} mProtein;
+
 typedef struct mFile{
   std::string input;
   std::string base;
@@ -55,12 +69,14 @@ typedef struct mPeptide{
   bool cTerm;
   bool nTerm;
   char xlSites;
+  int seqIndex;           //residues stored by the database for peptides of shuffled proteins; -1 if read from the protein
   double mass;            //monoisotopic, zero mass
   std::vector<mPepMap>* map;   //array of mappings where peptides appear in more than one place
   mPeptide(){
     cTerm=false;
     nTerm=false;
     xlSites=0;
+    seqIndex=-1;
     mass=0;
     map = new std::vector<mPepMap>;
   }
@@ -68,6 +84,7 @@ typedef struct mPeptide{
     cTerm=m.cTerm;
     nTerm=m.nTerm;
     xlSites=m.xlSites;
+    seqIndex=m.seqIndex;
     mass=m.mass;
     map = new std::vector<mPepMap>(*m.map);
   }
@@ -79,6 +96,7 @@ typedef struct mPeptide{
       cTerm = m.cTerm;
       nTerm = m.nTerm;
       xlSites = m.xlSites;
+      seqIndex = m.seqIndex;
       mass=m.mass;
       delete map;
       map = new std::vector<mPepMap>(*m.map);
@@ -99,6 +117,12 @@ typedef struct mMass {
   double  mass;
 } mMass;
 
+//A known adduct mass for the targeted open search
+typedef struct mAdduct {
+  double  mass;
+  double  ppm;    //precursor tolerance for this adduct; 0=use ppm_tolerance_pre
+} mAdduct;
+
 typedef struct mSparseMatrix{
   int   bin;
   float fIntensity;
@@ -112,6 +136,11 @@ typedef struct mEnzymeRules{
 } mEnzymeRules;
 
 typedef struct mParams {
+  int     adaptiveMinCount; //hits needed in the first pass to call an adduct mass
+  int     adaptiveSample; //first pass of the adaptive open search on 1 of every N spectra; 0=off
+  int     checkpoint;     //minutes between checkpoints of the search state; 0=off
+  int     databaseBlock;  //digest and search the database in blocks of this many proteins; 0=all at once
+  int     decoySeed;      //run seed for Magnum-generated decoys
   int     eValDepth;
   int     instrument;     //0=Orbi, 1=FTICR
   int     isotopeError;
@@ -119,33 +148,50 @@ typedef struct mParams {
   int     maxPeaks;
   int     maxPepLen;
   int     minPeaks;
+  int     minXCorrBins;   //quality filter: positive XCorr bins needed to search a spectrum
   int     minPepLen;
   int     miscleave;
   int     ms1Centroid;
   int     ms2Centroid;
   int     ms1Resolution;
   int     ms2Resolution;
+  int     peptideOrder;   //0=search peptides by mass, 1=by protein and start position
+  int     prefilterTopK;  //open search: variants fully scored per spectrum after the shared bin prefilter; 0=all
   int     preferPrecursor;
+  int     recalSample;    //precursor recalibration from a closed search of 1 of every N spectra; 0=off
   int     setA;
+  int     shardCount;     //split the search into this many shards; 0=off
+  int     shardIndex;     //shard searched by this process, 1 to shardCount
+  int     shardMode;      //0=split the peptide list, 1=split the spectra by precursor mass
   int     setB;
   int     specProcess;
+  int     spectrumMemory; //MB of spectra held in memory at once; spectra beyond this are searched in chunks; 0=all
   int     threads;
   int     topCount;
   int     truncate;
   bool    buildDecoy;
   bool    buildEntrapment;
+  bool    clusterSpectra; //search repeated acquisitions of a precursor once, through a representative spectrum
   bool    exportPepXML;
   bool    exportPercolator;
   bool    ionSeries[6];
   bool    precursorRefinement;
+  bool    prefilterRecall; //also score all variants to report the recall of the prefilter
+  bool    resume;         //continue an interrupted search from its checkpoint
+  bool    scorePruning;   //skip spectra whose score upper bound cannot displace their retained hits
+  bool    shardMerge;     //combine the partial results of all shards instead of searching
   bool    splitPercolator;
   bool    xcorr;
   double  binOffset;
   double  binSize;
+  double  clusterRT;      //retention time window (minutes) of spectrum clustering
+  double  clusterSimilarity; //cosine similarity of the processed spectra needed to cluster them
+  double  closedEValue;   //hierarchical search: skip the open search for spectra with a closed hit at or below this E-value; 0=off
   double  maxPepMass;
   double  minPepMass;
   double  maxAdductMass;
   double  minAdductMass;
+  double  minXCorrCoverage; //quality filter: fraction of the precursor mass spanned by positive XCorr bins
   double  percVersion;
   double  ppmPrecursor;
   double  rIonThreshold;
@@ -163,12 +209,18 @@ typedef struct mParams {
   std::string     resPath;
   std::string     dbPath;
   std::string     msBase;
+  std::vector<mAdduct>  adducts;  //if not empty, only these adduct masses are searched
   std::vector<mMass>    aaMass;
   std::vector<int>      diag;
   std::vector<mMass>    mods;
   std::vector<mMass>    fMods;
   std::vector<double>   rIons;
   mParams(){
+    adaptiveMinCount=3;
+    adaptiveSample=0;
+    checkpoint=0;
+    databaseBlock=0;
+    decoySeed=0;
     eValDepth=5000;
     instrument=0;
     isotopeError=3;
@@ -176,21 +228,34 @@ typedef struct mParams {
     maxPeaks=0;
     maxPepLen=50;
     minPeaks=20;
+    minXCorrBins=0;
     minPepLen=6;
     miscleave=2;
     ms1Centroid=1;
     ms2Centroid=1;
     ms1Resolution=60000;
     ms2Resolution=15000;
+    peptideOrder=0;
+    prefilterTopK=0;
+    scorePruning=false;
+    shardMerge=false;
+    prefilterRecall=false;
     preferPrecursor=2;
+    recalSample=0;
+    resume=false;
     setA=0;
+    shardCount=0;
+    shardIndex=0;
+    shardMode=0;
     setB=0;
     specProcess=1;
+    spectrumMemory=0;
     threads=1;
     topCount=5;
     truncate=0;
     buildDecoy=false;
     buildEntrapment=false;
+    clusterSpectra=false;
     exportPepXML=true;
     exportPercolator=false;
     ionSeries[0]=false; //a-ions
@@ -203,11 +268,15 @@ typedef struct mParams {
     splitPercolator=false;
     xcorr=false;
     binSize=0.03;
+    closedEValue=0;
+    clusterRT=1.0;
+    clusterSimilarity=0.9;
     binOffset=0.0;
     maxPepMass=4000.0;
     minPepMass=500.0;
     maxAdductMass=500.0;
     minAdductMass=10.0;
+    minXCorrCoverage=0;
     percVersion=2.04;
     ppmPrecursor=25.0;
     rIonThreshold=10.0;
@@ -442,11 +511,6 @@ typedef struct sNode2{
   int id=0; //for diagnostics only
 } sNode2;
 
-typedef struct sPepModSet{
-  std::vector<mPepMod> mods;
-  mPepMod& operator[](const size_t& index) { return mods[index]; }
-} sPepModSet;
-
 typedef struct sPrecursor{
   int index;
   double monomass;
@@ -467,19 +531,24 @@ typedef struct sDIndex{
   size_t b;
 } sDIndex;
 
-typedef struct sIPep {
-  double pepMass=0;
-  std::vector<size_t> pepIndex;
-} sIPep;
-
+//A fragment ion peak shared by one or more peptide variants. Negative masses carry the open
+//modification and are split into one peak per variant precursor mass (pepMass).
 typedef struct sIPeak {
   double mass=0;
-  std::vector<sIPep> index;
+  double pepMass=0;
+  size_t first=0;   //first variant index of this peak in sIPeakSet::pep
+  size_t count=0;   //number of variant indexes
+  bool full=false;  //fragment spans the whole sequence; not part of the unmodified (closed) search
 } sIPeak;
 
-typedef struct sScoreSet2 {
-  double scoreP[MAX_PRECURSOR]{};  //never more than 10 precursors
-  double score = 0;
-} sScoreSet2;
+//Flat fragment peak list: each peak references a run of variant indexes in pep (CSR layout).
+typedef struct sIPeakSet {
+  std::vector<sIPeak> peaks;
+  std::vector<size_t> pep;
+  void clear(){
+    peaks.clear();
+    pep.clear();
+  }
+} sIPeakSet;
 
 #endif
@@ -89,6 +89,17 @@ MTopPeps& MTopPeps::operator=(const MTopPeps& c){
   return *this;
 }
 
+//Removes all peptide scores, keeping the list size
+void MTopPeps::clear(){
+  while (peptideFirst != NULL){
+    mScoreCard* tmp = peptideFirst;
+    peptideFirst = peptideFirst->next;
+    delete tmp;
+  }
+  peptideLast = NULL;
+  peptideCount = 0;
+}
+
 void MTopPeps::checkPeptideScore(mScoreCard& s){
 
   mScoreCard* sc;
@@ -38,6 +38,7 @@ public:
   //list<mSingletScoreCard*>**  singletList;
 
   void  checkPeptideScore(mScoreCard& s);
+  void  clear();
   //void  resetSingletList(double mass);
 
 };
@@ -29,9 +29,18 @@ int main(int argc, char* argv[]){
   cout << "Copyright Michael Hoopmann, Institute for Systems Biology" << endl;
   cout << "Visit http://magnum-ms.org for full documentation." << endl;
   if(argc<2){
-    cout << "Usage: magnum <Config File> [<Data File>...]" << endl;
+    cout << "Usage: magnum <Config File> [--shard i/N | --shard-spectra i/N | --merge] [--resume] [<Data File>...]" << endl;
+    cout << "       magnum <Config File> --serve <Spool Directory>" << endl;
     cout << "\nNote: To create a default configuration file for Magnum, run the following command:" << endl;
     cout << "        magnum --config" << endl;
+    cout << "\nTo split a search over N processes, run each with --shard i/N (i = 1 to N) to search part" << endl;
+    cout << "of the peptides, or --shard-spectra i/N to search part of the spectra. Then run once with" << endl;
+    cout << "--merge to combine the partial results and export them." << endl;
+    cout << "\nA search run with checkpoint = N in the configuration file saves its state every N minutes." << endl;
+    cout << "If it is interrupted, run it again with --resume to continue from the last checkpoint." << endl;
+    cout << "\nWith --serve, the database is digested once and Magnum waits for search jobs: files ending" << endl;
+    cout << "in .job placed in the spool directory, each with an MS_data_file line and any parameters that" << endl;
+    cout << "differ from the configuration file. A file named stop in the spool directory ends the server." << endl;
     return 1;
   }
 
@@ -52,11 +61,43 @@ int main(int argc, char* argv[]){
   int fc=1;
   MagnumManager manager;
   if(!manager.setParams(argv[1])) return -3;
-  if(argc>2){
-    manager.clearFiles();
-    for (i = 2; i<argc; i++) fc = manager.setFile(argv[i]);
+  bool bFiles=false;
+  const char* spool=NULL;
+  for (i = 2; i<argc; i++){
+    if (strcmp(argv[i], "--shard") == 0 || strcmp(argv[i], "--shard-spectra") == 0){
+      if (i + 1 == argc){
+        cout << "  Error: " << argv[i] << " requires a value of i/N" << endl;
+        return -3;
+      }
+      string s = "shard = ";
+      s += argv[i + 1];
+      manager.setParam(s);
+      if (strcmp(argv[i], "--shard-spectra") == 0) manager.setParam("shard_mode = 1");
+      i++;
+      continue;
+    }
+    if (strcmp(argv[i], "--merge") == 0){
+      manager.setParam("shard_merge = 1");
+      continue;
+    }
+    if (strcmp(argv[i], "--resume") == 0){
+      manager.setParam("resume = 1");
+      continue;
+    }
+    if (strcmp(argv[i], "--serve") == 0){
+      if (i + 1 == argc){
+        cout << "  Error: --serve requires a spool directory" << endl;
+        return -3;
+      }
+      spool = argv[++i];
+      continue;
+    }
+    if (!bFiles) manager.clearFiles();
+    bFiles = true;
+    fc = manager.setFile(argv[i]);
   }
-  manager.run();
+  if (spool != NULL) manager.serve(spool);
+  else manager.run();
 
   time(&timeNow);
   cout << " Time at finish: " << ctime(&timeNow) << endl;
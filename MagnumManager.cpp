@@ -3,6 +3,11 @@
 #include "MData.h"
 #include "MDB.h"
 #include "MIons.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
 
 using namespace std;
 
@@ -59,50 +64,125 @@ bool MagnumManager::setParams(string& s){
 }
 
 int MagnumManager::run(){
-  time_t timeNow;
   size_t i;
+  int ret;
 
   //Step #1: Prepare from settings
+  if ((ret = checkParams()) != 0) return ret;
   MData spec(&params);
-  spec.setLog(&log);
-  spec.setVersion(VERSION);
-  spec.setAdductSites(params.adductSites);
-  spec.setParams(&param_obj);
+  setData(spec);
 
   //Step #2: Read in database and generate peptide lists
   MDatabase db;
+  if ((ret = buildDatabase(db, spec)) != 0) return ret;
+
+  //Step #3: Read in spectra and map precursors
+  //Iterate over all input files
+  for (i = 0; i<files.size(); i++){
+    if ((ret = searchFile(db, spec, i)) != 0) return ret;
+  }
+
+  return 0;
+
+}
+
+//Reads the database and generates the peptide list, once for all data files
+int MagnumManager::buildDatabase(MDatabase& db, MData& spec){
+  size_t i;
   db.setLog(&log);
   for (i = 0; i<params.fMods.size(); i++) db.addFixedMod(params.fMods[i].index, params.fMods[i].mass);
   for (i = 0; i<params.aaMass.size(); i++) db.setAAMass((char)params.aaMass[i].index, params.aaMass[i].mass);
   if (!db.setEnzyme(params.enzyme.c_str())) exit(-3);
   db.setAdductSites(spec.getAdductSites());
   cout << "\n Reading FASTA database: " << params.dbFile << endl;
-  if (!db.buildDB(params.dbFile.c_str(),params.decoyPrefix,params.entrapmentPrefix)){
+  if (!db.buildDB(params.dbFile.c_str(),params.decoyPrefix,params.entrapmentPrefix,params.threads)){
     cout << "  Error opening database file: " << params.dbFile << endl;
     return -1;
   }
   // if entrapments enabled, build entrapments first so decoys are generated off of entrapments + targets dataset
   if(params.buildEntrapment) db.buildEntrapment(params.entrapmentPrefix);
-  if(params.buildDecoy) db.buildDecoy(params.decoyPrefix);
-  db.buildPeptides(params.minPepMass, params.maxPepMass, params.miscleave, params.minPepLen, params.maxPepLen);
+  if(params.buildDecoy) db.buildDecoy(params.decoyPrefix, (uint64_t)(unsigned int)params.decoySeed);
+  db.setStream((size_t)params.databaseBlock);
+  db.buildPeptides(params.minPepMass, params.maxPepMass, params.miscleave, params.minPepLen, params.maxPepLen, params.threads);
   log.setDBinfo(string(params.dbFile),db.getProteinDBSize(),db.getPeptideListSize(),db.adductPepCount);
+  return 0;
+}
 
-  //Step #3: Read in spectra and map precursors
-  //Iterate over all input files
-  for (i = 0; i<files.size(); i++){
+//Rejects combinations of search modes that cannot work together
+int MagnumManager::checkParams(){
+  if ((params.shardCount>0 || params.shardMerge) && (params.databaseBlock>0 || params.spectrumMemory>0)){
+    cout << "  Error: sharded searches cannot be combined with database_block or spectrum_memory." << endl;
+    return -4;
+  }
+  //these passes fit or filter from the shard's own slice, so its results would differ from a single search
+  if (params.shardCount>0 && (params.recalSample>0 || params.adaptiveSample>0)){
+    cout << "  Error: sharded searches cannot be combined with precursor_recalibration or adaptive_sample." << endl;
+    return -4;
+  }
+  if (params.shardCount>0 && params.shardMode==0 && params.closedEValue>0){
+    cout << "  Error: peptide-sharded searches cannot be combined with closed_evalue_cutoff. Use --shard-spectra instead." << endl;
+    return -4;
+  }
+  if ((params.checkpoint>0 || params.resume) && (params.shardMerge || params.databaseBlock>0 || params.spectrumMemory>0)){
+    cout << "  Error: checkpoints cannot be combined with --merge, database_block, or spectrum_memory." << endl;
+    return -4;
+  }
+  return 0;
+}
 
-    //set up our log
-    log.clear();
-    param_obj.buildOutput(files[i].input, files[i].base, files[i].ext);
-    log.setLog(param_obj.logFile);
-    log.addMessage("Magnum version: " + string(VERSION), true);
-    log.addMessage("Parameter file: " + paramFile, true);
+//Searches data file i against the peptide list and exports the results. The seconds spent in
+//each step are kept in fileTime.
+int MagnumManager::searchFile(MDatabase& db, MData& spec, size_t i){
+  time_t timeNow;
+  time_t timeStart;
+
+  //set up our log
+  time(&timeStart);
+  fileTime.read = fileTime.evalue = fileTime.search = fileTime.output = 0;
+  log.clear();
+  if (!param_obj.buildOutput(files[i].input, files[i].base, files[i].ext)) return -1;
+  log.setLog(param_obj.logFile);
+  log.addMessage("Magnum version: " + string(VERSION), true);
+  log.addMessage("Parameter file: " + paramFile, true);
+
+  if (params.ext.compare(".mgf") == 0 && params.precursorRefinement){
+    log.addError("Cannot perform precursor refinement using MGF files. Please disable by setting precursor_refinement=0");
+    return -10;
+  }
 
-    if (params.ext.compare(".mgf") == 0 && params.precursorRefinement){
-      log.addError("Cannot perform precursor refinement using MGF files. Please disable by setting precursor_refinement=0");
-      return -10;
+  //Combine the partial results of a sharded search and export them
+  if (params.shardMerge){
+    log.addMessage("Merging shard results.", true);
+    cout << " Merging shard results." << endl;
+    if (!spec.readPartials()){
+      log.addError("Error reading shard results for: " + files[i].input);
+      return -2;
     }
+    time(&timeNow);
+    fileTime.read = difftime(timeNow, timeStart);
+    log.addMessage("Exporting results.", true);
+    cout << " Exporting Results." << endl;
+    spec.outputResults(db);
+    time(&timeStart);
+    fileTime.output = difftime(timeStart, timeNow);
+    log.addMessage("Finished Magnum analysis.", true);
+    log.exportLog();
+    return 0;
+  }
 
+  //A resumed search restores its processed spectra and search state from the checkpoint
+  if (params.resume){
+    log.addMessage("Reading checkpoint of: " + files[i].input, true);
+    cout << " Reading checkpoint of: " << files[i].input.c_str() << endl;
+    if (!spec.readCheckpoint()){
+      log.addError("Error reading checkpoint of: " + files[i].input);
+      return -2;
+    }
+    if (spec.getCheckpoint().peptides != (size_t)db.getPeptideListSize() || (spec.getCheckpoint().stage == 0) != (params.closedEValue <= 0)){
+      log.addError("Checkpoint was made with a different database or search settings.");
+      return -2;
+    }
+  } else {
     //new file reading pipelines several steps to speed loading and transforming spectra
     log.addMessage("Reading and processing spectra data file: " + files[i].input, true);
     cout << " Reading and processing spectra data file: " << files[i].input.c_str() << " ... ";
@@ -110,59 +190,274 @@ int MagnumManager::run(){
       log.addError("Error reading MS_data_file: " + files[i].input);
       return -2;
     }
+  }
+  time(&timeNow);
+  fileTime.read = difftime(timeNow, timeStart);
 
-    //for (size_t a = 0;a < spec.size();a++) {
-    //  if (spec[a].getScanNumber() == 130224) spec[a].getPrecursor(1).monoMass = 1818.8927;
-    //}
-
-    //log.addMessage("Reading spectra data file: " + files[i].input, true);
-    //cout << "\n Reading spectra data file: " << files[i].input << " ... ";
-    //if (!spec.readSpectra()){
-    //  log.addError("Error reading MS_data_file: " + files[i].input);
-    //  return -2;
-    //}
-    //spec.mapPrecursors();
-
-    //log.addMessage("Start transformation.", true);
-    //time(&timeNow);
-    //cout << "\n Start transformation: " << ctime(&timeNow);
-    //spec.xCorr();
-    //time(&timeNow);
-    //cout << " Finished transformation: " << ctime(&timeNow) << endl;
-
-    //Step #4: Analyze single peptides with open mods
-    MAnalysis anal(params, &db, &spec);
-    time(&timeNow);
+  //Memory-bounded search: spectra are searched and exported one precursor mass chunk at a time
+  if (spec.getChunkCount()>0){
+    if (!spec.createResults(db)){
+      log.addError("Cannot create result files.");
+      return -2;
+    }
+    log.addMessage("Start spectral search.", true);
+    for (size_t c = 0; c<spec.getChunkCount(); c++){
+      if (!spec.loadChunk(c)){
+        log.addError("Error reading temporary spectrum store.");
+        return -2;
+      }
+      time(&timeNow);
+      cout << " Searching chunk " << c + 1 << " of " << spec.getChunkCount() << " (" << spec.size() << " spectra, " << spec.getMinMass() << " - " << spec.getMaxMass() << " Da): " << ctime(&timeNow);
+      if (params.clusterSpectra) spec.clusterSpectra();
+      MAnalysis anal(params, &db, &spec);
+      cout << "  Iterating spectra ... ";
+      anal.doEValuePrecalc();
+      cout << "  Scoring peptides ... ";
+      anal.doPeptideAnalysis();
+      spec.exportResults(db);
+    }
+    spec.closeResults();
+    spec.releaseSpill();
+    log.addMessage("Finish spectral search.", true);
+    time(&timeStart);
+    fileTime.search = difftime(timeStart, timeNow); //chunks are searched and exported together
+    cout << " Finished spectral search: " << ctime(&timeStart) << endl;
+
+    log.addMessage("Finished Magnum analysis.", true);
+    log.exportLog();
+    return 0;
+  }
+
+  if (params.shardCount>0 && params.shardMode == 1 && !params.resume) spec.selectShard(params.shardIndex, params.shardCount);
+  if (params.clusterSpectra && !params.resume) spec.clusterSpectra();
+
+  //for (size_t a = 0;a < spec.size();a++) {
+  //  if (spec[a].getScanNumber() == 130224) spec[a].getPrecursor(1).monoMass = 1818.8927;
+  //}
+
+  //log.addMessage("Reading spectra data file: " + files[i].input, true);
+  //cout << "\n Reading spectra data file: " << files[i].input << " ... ";
+  //if (!spec.readSpectra()){
+  //  log.addError("Error reading MS_data_file: " + files[i].input);
+  //  return -2;
+  //}
+  //spec.mapPrecursors();
+
+  //log.addMessage("Start transformation.", true);
+  //time(&timeNow);
+  //cout << "\n Start transformation: " << ctime(&timeNow);
+  //spec.xCorr();
+  //time(&timeNow);
+  //cout << " Finished transformation: " << ctime(&timeNow) << endl;
+
+  //Step #4: Analyze single peptides with open mods
+  MAnalysis anal(params, &db, &spec);
+  time(&timeNow);
+  if (!params.resume){ //a checkpoint has the histograms
     log.addMessage("Precompute expectation value histograms.", true);
     cout << " Precompute expectation value histograms: " << ctime(&timeNow);
     cout << "  Iterating spectra ... ";
     anal.doEValuePrecalc();
-    time(&timeNow);
-    cout << " Finished precompute expectation value histograms: " << ctime(&timeNow) << endl;
-
-    log.addMessage("Start spectral search.", true);
-    time(&timeNow);
-    cout << " Start spectral search: " << ctime(&timeNow);
-    log.addMessage("Scoring peptides.", true);
-    cout << "  Scoring peptides ... ";
-    anal.doPeptideAnalysis();
-
-    log.addMessage("Finish spectral search.", true);
-    time(&timeNow);
-    cout << " Finished spectral search: " << ctime(&timeNow) << endl;
+    time(&timeStart);
+    fileTime.evalue = difftime(timeStart, timeNow);
+    cout << " Finished precompute expectation value histograms: " << ctime(&timeStart) << endl;
+  }
 
-    //Step #5: Output results
+  log.addMessage("Start spectral search.", true);
+  time(&timeNow);
+  cout << " Start spectral search: " << ctime(&timeNow);
+  log.addMessage("Scoring peptides.", true);
+  cout << "  Scoring peptides ... ";
+  anal.doPeptideAnalysis();
+
+  log.addMessage("Finish spectral search.", true);
+  time(&timeStart);
+  fileTime.search = difftime(timeStart, timeNow);
+  cout << " Finished spectral search: " << ctime(&timeStart) << endl;
+
+  //Step #5: Output results. A shard only writes its partial results, for merging later.
+  if (params.shardCount>0){
+    log.addMessage("Exporting shard results.", true);
+    cout << " Exporting shard " << params.shardIndex << " of " << params.shardCount << " results." << endl;
+    if (!spec.writePartial()) return -2;
+  } else {
     log.addMessage("Exporting results.", true);
     cout << " Exporting Results." << endl;
     spec.outputResults(db);
+  }
+  if (params.checkpoint>0 || params.resume) spec.removeCheckpoint();
+  time(&timeNow);
+  fileTime.output = difftime(timeNow, timeStart);
 
-    log.addMessage("Finished Magnum analysis.", true);
-    log.exportLog();
+  log.addMessage("Finished Magnum analysis.", true);
+  log.exportLog();
+
+
+  return 0;
+}
+
+//Server mode: the database is read and digested once, then search jobs are taken from the spool
+//directory as they arrive. A job is a file ending in ".job" that holds the data file to search
+//(MS_data_file = ...) and any parameters that differ from the configuration file. Parameters
+//that change the peptide list cannot differ. Jobs are searched in name order; each is renamed
+//to ".job.running", then ".job.done" or ".job.failed", and its step times are appended to
+//magnum_jobs.txt in the spool directory. Errors fail only the job at hand, and jobs still marked
+//running when the server starts are marked failed. A file named "stop" in the spool directory ends
+//the server.
+int MagnumManager::serve(const char* dir){
+  time_t timeNow;
+  time_t timeStart;
+  int ret;
+  string spool = dir;
+
+  if ((ret = checkParams()) != 0) return ret;
+  MData spec(&params);
+  setData(spec);
+
+  MDatabase db;
+  time(&timeStart);
+  if ((ret = buildDatabase(db, spec)) != 0) return ret;
+  time(&timeNow);
+  cout << "\n Database ready in " << difftime(timeNow, timeStart) << " s. Waiting for jobs in: " << spool << endl;
+
+  //Errors in a job fail only that job
+  log.setFatal(false);
+
+  //Jobs left running by an earlier server that ended abnormally are marked as failed
+  vector<string> jobs;
+  if (!listJobs(spool, jobs, ".job.running")){
+    cout << "  Error: cannot read spool directory: " << spool << endl;
+    return -1;
+  }
+  for (size_t a = 0; a<jobs.size(); a++){
+    string job = jobs[a].substr(0, jobs[a].size() - 8);
+    rename((spool + "/" + jobs[a]).c_str(), (spool + "/" + job + ".failed").c_str());
+    cout << "  Job " << job << " was interrupted by an earlier server; marked as failed." << endl;
+    fileTime.read = fileTime.evalue = fileTime.search = fileTime.output = 0;
+    logJob(spool, job, "interrupted", "", 0);
+  }
+
+  mParams base = params;
+  vector<CnpxParameter> baseXml = param_obj.xmlParams;
+  while (true){
+    string stop = spool + "/stop";
+    FILE* f = fopen(stop.c_str(), "r");
+    if (f != NULL){
+      fclose(f);
+      remove(stop.c_str());
+      cout << "\n Stop requested; server finished." << endl;
+      break;
+    }
+
+    if (!listJobs(spool, jobs, ".job")){
+      cout << "  Error: cannot read spool directory: " << spool << endl;
+      return -1;
+    }
+    if (jobs.empty()){
+      Threading::ThreadSleep(2000);
+      continue;
+    }
 
+    for (size_t a = 0; a<jobs.size(); a++){
+      string job = spool + "/" + jobs[a];
+      string running = job + ".running";
+      if (rename(job.c_str(), running.c_str()) != 0) continue;
+      time(&timeStart);
+      cout << "\n Job " << jobs[a] << ": " << ctime(&timeStart);
+
+      //every job starts from the settings of the configuration file
+      params = base;
+      param_obj.xmlParams = baseXml;
+      params.msFile.clear();
+      files.clear();
+      fileTime.read = fileTime.evalue = fileTime.search = fileTime.output = 0;
+      log.clear();
+      string status = "failed";
+      if (!param_obj.parseConfig(running.c_str()) || log.hasError()){
+        cout << "  Error: cannot read the job's parameters." << endl;
+      } else if (params.msFile.empty()){
+        cout << "  Error: job does not name an MS_data_file." << endl;
+      } else if (!sameDatabase(params, base)){
+        cout << "  Error: job changes settings of the peptide list, which are fixed while the server runs." << endl;
+      } else if (checkParams() == 0 && setFile(params.msFile)>0){
+        setData(spec);
+        if (searchFile(db, spec, 0) == 0 && !log.hasError()) status = "done";
+      }
+      rename(running.c_str(), (job + "." + status).c_str());
+
+      time(&timeNow);
+      double total = difftime(timeNow, timeStart);
+      cout << " Job " << jobs[a] << " " << status << " in " << total << " s (spectra " << fileTime.read << " s, E-values " << fileTime.evalue << " s, search " << fileTime.search << " s, export " << fileTime.output << " s)." << endl;
+      logJob(spool, jobs[a], status, params.msFile, total);
+    }
+    params = base;
+    param_obj.xmlParams = baseXml;
   }
 
   return 0;
+}
 
+void MagnumManager::setData(MData& spec){
+  spec.setLog(&log);
+  spec.setVersion(VERSION);
+  spec.setAdductSites(params.adductSites);
+  spec.setParams(&param_obj);
+}
+
+//Lists the job files (ending in ".job") of the spool directory, in name order
+//Appends a line with the status and step times (fileTime) of a job to magnum_jobs.txt in the spool directory
+void MagnumManager::logJob(string& dir, const string& job, const string& status, const string& msFile, double total){
+  string tName = dir + "/magnum_jobs.txt";
+  FILE* f = fopen(tName.c_str(), "at");
+  if (f == NULL) return;
+  fseek(f, 0, SEEK_END);
+  if (ftell(f) == 0) fprintf(f, "Job\tStatus\tMS_data_file\tTotal\tSpectra\tEValues\tSearch\tExport\n");
+  fprintf(f, "%s\t%s\t%s\t%.0lf\t%.0lf\t%.0lf\t%.0lf\t%.0lf\n", job.c_str(), status.c_str(), msFile.c_str(), total, fileTime.read, fileTime.evalue, fileTime.search, fileTime.output);
+  fclose(f);
+}
+
+bool MagnumManager::listJobs(string& dir, vector<string>& v, const char* ext){
+  v.clear();
+#ifdef _WIN32
+  WIN32_FIND_DATAA fd;
+  HANDLE h = FindFirstFileA((dir + "\\*" + ext).c_str(), &fd);
+  if (h == INVALID_HANDLE_VALUE) return GetLastError() == ERROR_FILE_NOT_FOUND;
+  do {
+    if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) v.push_back(fd.cFileName);
+  } while (FindNextFileA(h, &fd));
+  FindClose(h);
+#else
+  DIR* d = opendir(dir.c_str());
+  if (d == NULL) return false;
+  struct dirent* e;
+  while ((e = readdir(d)) != NULL){
+    string s = e->d_name;
+    size_t n = strlen(ext);
+    if (s.size()>n && s.compare(s.size() - n, n, ext) == 0) v.push_back(s);
+  }
+  closedir(d);
+#endif
+  sort(v.begin(), v.end());
+  return true;
+}
+
+//Checks that two sets of parameters generate the same peptide list
+bool MagnumManager::sameDatabase(mParams& a, mParams& b){
+  size_t i;
+  if (a.dbFile != b.dbFile || a.enzyme != b.enzyme || a.adductSites != b.adductSites) return false;
+  if (a.miscleave != b.miscleave || a.minPepLen != b.minPepLen || a.maxPepLen != b.maxPepLen) return false;
+  if (a.minPepMass != b.minPepMass || a.maxPepMass != b.maxPepMass) return false;
+  if (a.buildDecoy != b.buildDecoy || a.decoyPrefix != b.decoyPrefix || a.decoySeed != b.decoySeed) return false;
+  if (a.buildEntrapment != b.buildEntrapment || a.entrapmentPrefix != b.entrapmentPrefix) return false;
+  if (a.databaseBlock != b.databaseBlock) return false;
+  if (a.fMods.size() != b.fMods.size() || a.aaMass.size() != b.aaMass.size()) return false;
+  for (i = 0; i<a.fMods.size(); i++){
+    if (a.fMods[i].index != b.fMods[i].index || a.fMods[i].mass != b.fMods[i].mass) return false;
+  }
+  for (i = 0; i<a.aaMass.size(); i++){
+    if (a.aaMass[i].index != b.aaMass[i].index || a.aaMass[i].mass != b.aaMass[i].mass) return false;
+  }
+  return true;
 }
 
 bool MagnumManager::getBaseFileName(string& base, string& fName, string& extP) {
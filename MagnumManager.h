@@ -7,6 +7,17 @@
 #define VERSION "1.5.3"
 #define BDATE "Apr 25 2024"
 
+class MData;
+class MDatabase;
+
+//Seconds spent in the steps of searching one data file
+typedef struct mFileTime{
+  double read;    //reading and processing spectra
+  double evalue;  //precomputing E-value histograms
+  double search;
+  double output;
+} mFileTime;
+
 class MagnumManager {
 public:
   MagnumManager();
@@ -22,6 +33,7 @@ public:
 
   bool getBaseFileName(std::string& base, std::string& fName, std::string& extP);
   int run();
+  int serve(const char* dir);
 
 
 private:
@@ -30,6 +42,15 @@ private:
   std::string paramFile;
   MParams param_obj;
   mParams params;
+  mFileTime fileTime;
+
+  int  buildDatabase(MDatabase& db, MData& spec);
+  int  checkParams();
+  bool listJobs(std::string& dir, std::vector<std::string>& v, const char* ext);
+  void logJob(std::string& dir, const std::string& job, const std::string& status, const std::string& msFile, double total);
+  bool sameDatabase(mParams& a, mParams& b);
+  int  searchFile(MDatabase& db, MData& spec, size_t i);
+  void setData(MData& spec);
 
 };
 